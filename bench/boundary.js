@@ -0,0 +1,146 @@
+#!/usr/bin/env node
+
+// Microbenchmarks for the JS <-> GObject boundary.
+//
+// Everything here runs headless against GLib, GObject and Gio only, and
+// covers the hot paths: function calls by signature shape, property
+// access, signal emission, object wrapping, boxed field access and array
+// marshaling by size. Prints one JSON array of results.
+//
+//     node bench/boundary.js [group...]
+
+"use strict";
+
+var measure = require('./common').measure;
+var GNode = require('../lib/');
+
+var GLib = GNode.importNS('GLib');
+var Gio = GNode.importNS('Gio');
+
+var ARRAY_SIZES = [16, 1024, 64 * 1024, 1024 * 1024];
+
+var groups = {
+    calls: function() {
+        return [
+            measure('calls', 'void -> int64', function() {
+                GLib.get_monotonic_time();
+            }),
+            measure('calls', 'int, int -> int', function() {
+                GLib.random_int_range(0, 100);
+            }),
+            measure('calls', 'string, int -> string (transfer full)', function() {
+                GLib.ascii_strup('foo', -1);
+            }),
+            (function() {
+                var action = Gio.SimpleAction.new('bench', null);
+                return measure('calls', 'method -> string', function() {
+                    action.get_name();
+                });
+            })(),
+            measure('calls', 'string -> array (out length)', function() {
+                GLib.base64_decode('Zm9vYmFy');
+            }),
+        ];
+    },
+
+    properties: function() {
+        var action = Gio.SimpleAction.new('bench', null);
+        var enabled = true;
+        return [
+            measure('properties', 'get boolean', function() {
+                action.enabled;
+            }),
+            measure('properties', 'get string', function() {
+                action.name;
+            }),
+            measure('properties', 'set boolean', function() {
+                action.enabled = (enabled = !enabled);
+            }),
+            measure('properties', 'getProperties (2)', function() {
+                action.getProperties(['name', 'enabled']);
+            }),
+            measure('properties', 'setProperties (1)', function() {
+                action.setProperties({ enabled: (enabled = !enabled) });
+            }),
+        ];
+    },
+
+    signals: function() {
+        var action = Gio.SimpleAction.new('bench', null);
+        var count = 0;
+        action.connect('activate', function(self, parameter) { count++; });
+        action.connect('notify::enabled', function(self, pspec) { count++; });
+
+        var enabled = true;
+        return [
+            measure('signals', 'emit activate (2 params)', function() {
+                action.activate(null);
+            }),
+            measure('signals', 'emit notify via property set', function() {
+                action.enabled = (enabled = !enabled);
+            }),
+        ];
+    },
+
+    wrappers: function() {
+        var group = Gio.SimpleActionGroup.new();
+        group.insert(Gio.SimpleAction.new('bench', null));
+        return [
+            measure('wrappers', 'new object, new wrapper', function() {
+                Gio.SimpleAction.new('bench', null);
+            }),
+            measure('wrappers', 'existing object, cached wrapper', function() {
+                group.lookup('bench');
+            }),
+        ];
+    },
+
+    boxed: function() {
+        var string = GLib.string_new('hello world');
+        return [
+            measure('boxed', 'get integer field', function() {
+                string.len;
+            }),
+            measure('boxed', 'get string field', function() {
+                string.str;
+            }),
+        ];
+    },
+
+    arrays: function() {
+        var results = [];
+        ARRAY_SIZES.forEach(function(size) {
+            var typed = new Uint8Array(size);
+            for (var i = 0; i < size; i++)
+                typed[i] = i & 0xff;
+            var plain = Array.prototype.slice.call(typed);
+            var encoded = GLib.base64_encode(typed);
+
+            results.push(measure('arrays', 'in Uint8Array ' + size, function() {
+                GLib.compute_checksum_for_data(GLib.ChecksumType.SHA1, typed);
+            }));
+            results.push(measure('arrays', 'in Array ' + size, function() {
+                GLib.compute_checksum_for_data(GLib.ChecksumType.SHA1, plain);
+            }));
+            results.push(measure('arrays', 'out guint8 ' + size, function() {
+                GLib.base64_decode(encoded);
+            }));
+        });
+        return results;
+    },
+};
+
+function main(argv) {
+    var names = argv.length ? argv : Object.keys(groups);
+    var results = [];
+
+    names.forEach(function(name) {
+        if (!groups[name])
+            throw new Error('Unknown benchmark group: ' + name);
+        results = results.concat(groups[name]());
+    });
+
+    console.log(JSON.stringify(results, null, 2));
+}
+
+main(process.argv.slice(2));
@@ -0,0 +1,59 @@
+"use strict";
+
+// Shared helpers for the scripts in bench/.
+
+function loadBinding() {
+    try {
+        return require('../build/Release/node-gtk');
+    } catch(e) {
+        return require('../build/Debug/node-gtk');
+    }
+}
+
+function median(values) {
+    var sorted = values.slice().sort(function(a, b) { return a - b; });
+    return sorted[sorted.length >> 1];
+}
+
+function elapsedNs(start) {
+    var t = process.hrtime(start);
+    return t[0] * 1e9 + t[1];
+}
+
+var BATCH_MS = 50;
+var BATCHES = 7;
+
+// Runs `fn` in batches sized to take roughly BATCH_MS each and reports
+// the median cost of one call. The first batch only warms up.
+function measure(group, name, fn) {
+    var n = 1;
+    for (;;) {
+        var start = process.hrtime();
+        for (var i = 0; i < n; i++)
+            fn();
+        if (elapsedNs(start) >= BATCH_MS * 1e6 || n >= 1 << 24)
+            break;
+        n *= 2;
+    }
+
+    var samples = [];
+    for (var b = 0; b < BATCHES; b++) {
+        var start = process.hrtime();
+        for (var i = 0; i < n; i++)
+            fn();
+        samples.push(elapsedNs(start) / n);
+    }
+
+    var ns = median(samples);
+    return {
+        group: group,
+        name: name,
+        iterations: n * BATCHES,
+        ns_per_op: ns,
+        ops_per_sec: 1e9 / ns,
+    };
+}
+
+exports.loadBinding = loadBinding;
+exports.median = median;
+exports.measure = measure;
@@ -0,0 +1,122 @@
+#!/usr/bin/env node
+
+// Concurrent file reads: blocking vs. Promise-based GIO.
+//
+// Reads the same set of files with the blocking load_contents(), with
+// load_contents.async() on the uv threadpool, and with the non-blocking
+// load_contents_async() Promise form. Besides the total time, it reports
+// how late a 1ms interval timer fired meanwhile, which is what a UI
+// thread would feel. Every mode runs in a fresh process, with libuv
+// driving the GLib main context.
+//
+//     node bench/gio-async.js [files] [kilobytes]
+
+"use strict";
+
+var childProcess = require('child_process');
+var fs = require('fs');
+var os = require('os');
+var path = require('path');
+var common = require('./common');
+var median = common.median;
+
+var MODES = ['sync', 'threadpool', 'promise'];
+var RUNS = 5;
+
+function now() {
+    var t = process.hrtime();
+    return t[0] * 1e3 + t[1] / 1e6;
+}
+
+function makeFiles(n, kilobytes) {
+    var dir = fs.mkdtempSync(path.join(os.tmpdir(), 'node-gtk-bench-'));
+    var data = Buffer.alloc ? Buffer.alloc(kilobytes * 1024, 'x') : new Buffer(kilobytes * 1024).fill('x');
+    var files = [];
+    for (var i = 0; i < n; i++) {
+        var file = path.join(dir, 'file' + i);
+        fs.writeFileSync(file, data);
+        files.push(file);
+    }
+    return { dir: dir, files: files };
+}
+
+function removeFiles(set) {
+    set.files.forEach(function(file) { fs.unlinkSync(file); });
+    fs.rmdirSync(set.dir);
+}
+
+function runOnce(mode, paths) {
+    var GNode = require('../lib/');
+    var Gio = GNode.importNS('Gio');
+    GNode.startLoop({ mode: 'uv' });
+
+    var vfs = Gio.Vfs.get_default();
+    var files = paths.map(function(p) { return vfs.get_file_for_path(p); });
+
+    var maxLag = 0;
+    var last = now();
+    var timer = setInterval(function() {
+        var t = now();
+        maxLag = Math.max(maxLag, t - last - 1);
+        last = t;
+    }, 1);
+
+    function finish(start) {
+        var elapsed = now() - start;
+        clearInterval(timer);
+        GNode.stopLoop();
+        process.stdout.write(JSON.stringify({ ms: elapsed, max_lag_ms: maxLag }));
+    }
+
+    // Let the interval settle before starting.
+    setTimeout(function() {
+        var start = now();
+
+        if (mode === 'sync') {
+            files.forEach(function(file) { file.load_contents(null); });
+            // The timer only notices the stall once the loop runs again.
+            setImmediate(function() { finish(start); });
+        } else if (mode === 'threadpool') {
+            Promise.all(files.map(function(file) {
+                return file.load_contents.async(file, null);
+            })).then(function() { finish(start); });
+        } else {
+            Promise.all(files.map(function(file) {
+                return file.load_contents_async(null);
+            })).then(function() { finish(start); });
+        }
+    }, 20);
+}
+
+function main(argv) {
+    if (argv[0] === '--run')
+        return runOnce(argv[1], JSON.parse(fs.readFileSync(argv[2], 'utf8')));
+
+    var nFiles = +argv[0] || 256;
+    var kilobytes = +argv[1] || 256;
+    var set = makeFiles(nFiles, kilobytes);
+    var list = path.join(set.dir, 'files.json');
+    fs.writeFileSync(list, JSON.stringify(set.files));
+
+    var results = MODES.map(function(mode) {
+        var samples = [];
+        for (var i = 0; i < RUNS; i++) {
+            var out = childProcess.execFileSync(process.execPath, [__filename, '--run', mode, list]);
+            samples.push(JSON.parse(out));
+        }
+        return {
+            mode: mode,
+            files: nFiles,
+            kilobytes: kilobytes,
+            runs: RUNS,
+            median_ms: median(samples.map(function(s) { return s.ms; })),
+            median_max_lag_ms: median(samples.map(function(s) { return s.max_lag_ms; })),
+        };
+    });
+
+    fs.unlinkSync(list);
+    removeFiles(set);
+    console.log(JSON.stringify(results, null, 2));
+}
+
+main(process.argv.slice(2));
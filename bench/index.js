@@ -0,0 +1,35 @@
+#!/usr/bin/env node
+
+// Runs every benchmark in bench/ and prints a single JSON report, so
+// results can be diffed between releases:
+//
+//     node bench/ > bench-0.0.20.json
+//
+// Each script runs in its own process; pass script names to run a subset.
+
+"use strict";
+
+var childProcess = require('child_process');
+var path = require('path');
+
+var SCRIPTS = ['boundary', 'startup', 'loop', 'gio-async'];
+
+function main(argv) {
+    var scripts = argv.length ? argv : SCRIPTS;
+    var report = {
+        version: require('../package.json').version,
+        node: process.version,
+        platform: process.platform + '-' + process.arch,
+        date: new Date().toISOString(),
+        results: {},
+    };
+
+    scripts.forEach(function(name) {
+        var out = childProcess.execFileSync(process.execPath, [path.join(__dirname, name + '.js')]);
+        report.results[name] = JSON.parse(out);
+    });
+
+    console.log(JSON.stringify(report, null, 2));
+}
+
+main(process.argv.slice(2));
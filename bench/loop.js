@@ -0,0 +1,172 @@
+#!/usr/bin/env node
+
+// Main loop integration benchmark.
+//
+// Measures what node's own I/O costs under each loop mode: 'glib', where
+// uv is nested inside a running GLib.MainLoop, and 'uv', where libuv
+// drives GLib's default context. Reports setTimeout(0) latency, TCP echo
+// round-trip latency over loopback and setImmediate throughput, and then
+// the latencies of a mixed workload where a TCP echo, a 1ms node
+// interval and a 1ms GLib timeout all run at once. Every mode runs in a
+// fresh process.
+//
+//     node bench/loop.js [glib|uv...]
+
+"use strict";
+
+var childProcess = require('child_process');
+var net = require('net');
+
+var MODES = ['glib', 'uv'];
+var SAMPLES = 2000;
+var IMMEDIATES = 100000;
+var INTERVAL_MS = 1;
+
+function now() {
+    var t = process.hrtime();
+    return t[0] * 1e6 + t[1] / 1e3;
+}
+
+function percentile(values, p) {
+    var sorted = values.slice().sort(function(a, b) { return a - b; });
+    return sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * p))];
+}
+
+function summarize(values) {
+    return {
+        p50_us: percentile(values, 0.5),
+        p99_us: percentile(values, 0.99),
+        max_us: percentile(values, 1),
+    };
+}
+
+function timerLatency(done) {
+    var samples = [];
+    (function next() {
+        if (samples.length === SAMPLES)
+            return done(summarize(samples));
+        var start = now();
+        setTimeout(function() {
+            samples.push(now() - start);
+            next();
+        }, 0);
+    })();
+}
+
+function echoLatency(done) {
+    var server = net.createServer(function(socket) { socket.pipe(socket); });
+    server.listen(0, '127.0.0.1', function() {
+        var samples = [];
+        var client = net.connect(server.address().port, '127.0.0.1');
+        var start;
+        client.on('data', function() {
+            samples.push(now() - start);
+            if (samples.length === SAMPLES) {
+                client.end();
+                server.close();
+                return done(summarize(samples));
+            }
+            start = now();
+            client.write('x');
+        });
+        client.on('connect', function() {
+            start = now();
+            client.write('x');
+        });
+    });
+}
+
+function immediateThroughput(done) {
+    var count = 0;
+    var start = now();
+    (function next() {
+        if (++count === IMMEDIATES)
+            return done({ per_sec: IMMEDIATES / ((now() - start) / 1e6) });
+        setImmediate(next);
+    })();
+}
+
+// Echo round trips, plus how late each tick of a node interval and of a
+// GLib timeout fires, all measured together until the echo is done.
+function mixedLatency(GLib, done) {
+    var nodeLate = [];
+    var glibLate = [];
+    var running = true;
+
+    var lastNode = now();
+    var interval = setInterval(function() {
+        var t = now();
+        nodeLate.push(Math.max(0, t - lastNode - INTERVAL_MS * 1e3));
+        lastNode = t;
+    }, INTERVAL_MS);
+
+    var lastGLib = now();
+    GLib.timeout_add(GLib.PRIORITY_DEFAULT, INTERVAL_MS, function() {
+        var t = now();
+        glibLate.push(Math.max(0, t - lastGLib - INTERVAL_MS * 1e3));
+        lastGLib = t;
+        return running;
+    });
+
+    echoLatency(function(echo) {
+        running = false;
+        clearInterval(interval);
+        done({
+            echo: echo,
+            node_interval_late: summarize(nodeLate),
+            glib_timeout_late: summarize(glibLate),
+        });
+    });
+}
+
+function runOnce(mode) {
+    var GNode = require('../lib/');
+    var GLib = GNode.importNS('GLib');
+    var result = { mode: mode };
+    var mainLoop = null;
+
+    GNode.startLoop({ mode: mode });
+
+    function finish() {
+        process.stdout.write(JSON.stringify(result));
+        if (mainLoop)
+            mainLoop.quit();
+        else
+            GNode.stopLoop();
+    }
+
+    setImmediate(function() {
+        timerLatency(function(timer) {
+            result.timeout = timer;
+            echoLatency(function(echo) {
+                result.echo = echo;
+                immediateThroughput(function(immediate) {
+                    result.immediate = immediate;
+                    mixedLatency(GLib, function(mixed) {
+                        result.mixed = mixed;
+                        finish();
+                    });
+                });
+            });
+        });
+    });
+
+    if (mode === 'glib') {
+        mainLoop = GLib.MainLoop.new(null, false);
+        mainLoop.run();
+    }
+}
+
+function main(argv) {
+    if (argv[0] === '--run')
+        return runOnce(argv[1]);
+
+    var modes = argv.length ? argv : MODES;
+    var results = modes.map(function(mode) {
+        return JSON.parse(childProcess.execFileSync(process.execPath, [__filename, '--run', mode]));
+    });
+
+    console.log(JSON.stringify(results, null, 2));
+}
+
+main(process.argv.slice(2));
@@ -0,0 +1,174 @@
+#!/usr/bin/env node
+
+// Namespace startup benchmark.
+//
+// Compares building a whole namespace through the old JS reflection
+// loops (one GIRepository call per method, property and field) with the
+// native one-pass gi.BuildNamespace(), and with the default lazy
+// importNS(). Class and struct templates now come with their members,
+// so the "js" mode stands in plain constructors for the bare templates
+// the binding used to make, and only its JS loops install members; it
+// leaves out the (small) cost of the bare templates themselves. Every
+// mode and namespace runs in a fresh process, so class templates are
+// never shared between runs.
+//
+//     node bench/startup.js [Namespace...]
+
+"use strict";
+
+var childProcess = require('child_process');
+var common = require('./common');
+var loadBinding = common.loadBinding;
+var median = common.median;
+
+var MODES = ['js', 'native', 'lazy'];
+var DEFAULT_NAMESPACES = ['Gio', 'Gtk'];
+var RUNS = 5;
+
+// The JS path as lib/index.js used to do it, kept here for comparison.
+function buildWithJS(gi, ns) {
+    var GIRepository = gi.Bootstrap();
+    var Enums = gi.BuildNamespace('GIRepository');
+    var InfoType = Enums.InfoType;
+    var repo = GIRepository.Repository_get_default();
+
+    GIRepository.Repository_require.call(repo, ns, null, 0);
+
+    function declareFunction(obj, info) {
+        var name = GIRepository.BaseInfo_get_name.call(info);
+        var flags = GIRepository.function_info_get_flags(info);
+        var target = flags & Enums.FunctionInfoFlags.IS_METHOD ? obj.prototype : obj;
+        Object.defineProperty(target, name, {
+            configurable: true,
+            writable: true,
+            value: gi.MakeFunction(info)
+        });
+    }
+
+    function propertyGetter(propertyName) {
+        return function() { return gi.ObjectPropertyGetter(this, propertyName); };
+    }
+    function propertySetter(propertyName) {
+        return function(value) { return gi.ObjectPropertySetter(this, propertyName, value); };
+    }
+    function fieldGetter(fieldInfo) {
+        return function() { return gi.BoxedFieldGetter(this, fieldInfo); };
+    }
+
+    function bareConstructor() {
+        return function() {};
+    }
+
+    function makeObject(info) {
+        var constructor = bareConstructor();
+
+        var nMethods = GIRepository.object_info_get_n_methods(info);
+        for (var i = 0; i < nMethods; i++)
+            declareFunction(constructor, GIRepository.object_info_get_method(info, i));
+
+        var nProperties = GIRepository.object_info_get_n_properties(info);
+        for (var i = 0; i < nProperties; i++) {
+            var propertyInfo = GIRepository.object_info_get_property(info, i);
+            var propertyName = GIRepository.BaseInfo_get_name.call(propertyInfo);
+            Object.defineProperty(constructor.prototype, propertyName.replace(/-/g, '_'), {
+                configurable: true,
+                get: propertyGetter(propertyName),
+                set: propertySetter(propertyName),
+            });
+        }
+
+        return constructor;
+    }
+
+    function makeStruct(info) {
+        var constructor = bareConstructor();
+
+        var nMethods = GIRepository.struct_info_get_n_methods(info);
+        for (var i = 0; i < nMethods; i++)
+            declareFunction(constructor, GIRepository.struct_info_get_method(info, i));
+
+        var nFields = GIRepository.struct_info_get_n_fields(info);
+        for (var i = 0; i < nFields; i++) {
+            var fieldInfo = GIRepository.struct_info_get_field(info, i);
+            var fieldName = GIRepository.BaseInfo_get_name.call(fieldInfo);
+            Object.defineProperty(constructor.prototype, fieldName.replace(/-/g, '_'), {
+                configurable: true,
+                get: fieldGetter(fieldInfo),
+            });
+        }
+
+        return constructor;
+    }
+
+    var module = {};
+    var nInfos = GIRepository.Repository_get_n_infos.call(repo, ns);
+    for (var i = 0; i < nInfos; i++) {
+        var info = GIRepository.Repository_get_info.call(repo, ns, i);
+        var name = GIRepository.BaseInfo_get_name.call(info);
+        var type = GIRepository.BaseInfo_get_type.call(info);
+
+        if (type === InfoType.FUNCTION)
+            module[name] = gi.MakeFunction(info);
+        else if (type === InfoType.OBJECT)
+            module[name] = makeObject(info);
+        else if (type === InfoType.STRUCT)
+            module[name] = makeStruct(info);
+        else if (type === InfoType.CONSTANT)
+            module[name] = gi.GetConstantValue(info);
+    }
+    return module;
+}
+
+function runOnce(mode, ns) {
+    var start = process.hrtime();
+    var module;
+
+    if (mode === 'js') {
+        module = buildWithJS(loadBinding(), ns);
+    } else if (mode === 'native') {
+        module = loadBinding().BuildNamespace(ns, null);
+    } else {
+        module = require('../lib/').importNS(ns);
+    }
+
+    var elapsed = process.hrtime(start);
+    return {
+        mode: mode,
+        namespace: ns,
+        ms: elapsed[0] * 1e3 + elapsed[1] / 1e6,
+        members: Object.keys(module).length,
+        rss: process.memoryUsage().rss,
+    };
+}
+
+function main(argv) {
+    if (argv[0] === '--run') {
+        process.stdout.write(JSON.stringify(runOnce(argv[1], argv[2])));
+        return;
+    }
+
+    var namespaces = argv.length ? argv : DEFAULT_NAMESPACES;
+    var results = [];
+
+    namespaces.forEach(function(ns) {
+        MODES.forEach(function(mode) {
+            var samples = [];
+            for (var i = 0; i < RUNS; i++) {
+                var out = childProcess.execFileSync(process.execPath, [__filename, '--run', mode, ns]);
+                samples.push(JSON.parse(out));
+            }
+            results.push({
+                mode: mode,
+                namespace: ns,
+                runs: RUNS,
+                median_ms: median(samples.map(function(s) { return s.ms; })),
+                median_rss: median(samples.map(function(s) { return s.rss; })),
+                members: samples[0].members,
+            });
+        });
+    });
+
+    console.log(JSON.stringify(results, null, 2));
+}
+
+main(process.argv.slice(2));
@@ -10,6 +10,9 @@
                 "src/gobject.cc",
                 "src/closure.cc",
                 "src/boxed.cc",
+                "src/trace.cc",
+                "src/isolate.cc",
+                "src/dispatch.cc",
             ],
             "cflags": [
                 "<!@(pkg-config --cflags gobject-introspection-1.0) -Wall -Werror",
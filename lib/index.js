@@ -36,15 +36,42 @@ var GIRepository = gi.Bootstrap();
     }
 })();
 
+// Defines `name` on `target` as a getter that resolves the real value
+// on first access and then replaces itself with a plain data property,
+// so that nothing is built from the typelib until someone touches it.
+// Assigning through an object inheriting from `target` (an instance,
+// for methods on a prototype) shadows the entry on that object only,
+// as it would for a plain data property.
+function defineLazyProperty(target, name, enumerable, resolve) {
+    function define(obj, value) {
+        Object.defineProperty(obj, name, {
+            configurable: true,
+            enumerable: enumerable,
+            writable: true,
+            value: value
+        });
+    }
+
+    Object.defineProperty(target, name, {
+        configurable: true,
+        enumerable: enumerable,
+        get: function() {
+            var value = resolve();
+            define(target, value);
+            return value;
+        },
+        set: function(value) {
+            define(this, value);
+        }
+    });
+}
+
 function declareFunction(obj, info) {
     var name = GIRepository.BaseInfo_get_name.call(info);
     var flags = GIRepository.function_info_get_flags(info);
-    var func = gi.MakeFunction(info);
     var target = flags & GIRepository.FunctionInfoFlags.IS_METHOD ? obj.prototype : obj;
-    Object.defineProperty(target, name, {
-        configurable: true,
-        writable: true,
-        value: func
+    defineLazyProperty(target, name, false, function() {
+        return gi.MakeFunction(info);
     });
 }
 
@@ -62,7 +89,7 @@ function makeEnum(info) {
     var nMethods = GIRepository.enum_info_get_n_methods(info);
     for (var i = 0; i < nMethods; i++) {
         var methodInfo = GIRepository.enum_info_get_method(info, i);
-        declareFunction(constructor, methodInfo);
+        declareFunction(obj, methodInfo);
     }
 
     return obj;
@@ -76,91 +103,20 @@ function makeFunction(info) {
     return gi.MakeFunction(info);
 }
 
+// Classes and structs come back from C with their methods, static
+// functions, properties and fields already installed on the template.
 function makeStruct(info) {
-    function fieldGetter(fieldInfo) {
-        return function() {
-            return gi.BoxedFieldGetter(this, fieldInfo);
-        };
-    }
-    function fieldSetter(fieldInfo) {
-        return function(value) {
-            return gi.BoxedFieldSetter(this, fieldInfo, value);
-        };
-    }
-
-    var constructor = gi.MakeBoxed(info);
-
-    var nMethods = GIRepository.struct_info_get_n_methods(info);
-    for (var i = 0; i < nMethods; i++) {
-        var methodInfo = GIRepository.struct_info_get_method(info, i);
-        declareFunction(constructor, methodInfo);
-    }
-
-    var nProperties = GIRepository.struct_info_get_n_fields(info);
-    for (var i = 0; i < nProperties; i++) {
-        var fieldInfo = GIRepository.struct_info_get_field(info, i);
-        var fieldFlags = GIRepository.field_info_get_flags(fieldInfo);
-
-        var fieldName = GIRepository.BaseInfo_get_name.call(fieldInfo);
-        var jsFieldName = fieldName.replace(/-/g, '_');
-
-        var desc = {};
-
-        if (fieldFlags & GIRepository.FieldInfoFlags.READABLE)
-            desc.get = fieldGetter(fieldInfo);
-
-        if (fieldFlags & GIRepository.FieldInfoFlags.WRITABLE) {
-            desc.set = fieldSetter(fieldInfo);
-            desc.configurable = true;
-        }
-
-        Object.defineProperty(constructor.prototype, jsFieldName, desc);
-    }
-
-    return constructor;
+    return gi.MakeBoxed(info);
 }
 
 function makeObject(info) {
-    function propertyGetter(propertyName) {
-        return function() {
-            return gi.ObjectPropertyGetter(this, propertyName);
-        };
-    }
-    function propertySetter(propertyName) {
-        return function(value) {
-            return gi.ObjectPropertySetter(this, propertyName, value);
-        };
-    }
-
-    var constructor = gi.MakeClass(info);
-
-    var nMethods = GIRepository.object_info_get_n_methods(info);
-    for (var i = 0; i < nMethods; i++) {
-        var methodInfo = GIRepository.object_info_get_method(info, i);
-        declareFunction(constructor, methodInfo);
-    }
-
-    var nProperties = GIRepository.object_info_get_n_properties(info);
-    for (var i = 0; i < nProperties; i++) {
-        var propertyInfo = GIRepository.object_info_get_property(info, i);
-
-        var propertyName = GIRepository.BaseInfo_get_name.call(propertyInfo);
-        var jsPropertyName = propertyName.replace(/-/g, '_');
-
-        Object.defineProperty(constructor.prototype, jsPropertyName, {
-            configurable: true,
-            get: propertyGetter(propertyName),
-            set: propertySetter(propertyName),
-        });
-    }
-
-    return constructor;
+    return gi.MakeClass(info);
 }
 
 function makeInfo(info) {
     var type = GIRepository.BaseInfo_get_type.call(info);
 
-    if (type === GIRepository.InfoType.ENUM)
+    if (type === GIRepository.InfoType.ENUM || type === GIRepository.InfoType.FLAGS)
         return makeEnum(info);
     if (type === GIRepository.InfoType.CONSTANT)
         return makeConstant(info);
@@ -168,22 +124,21 @@ function makeInfo(info) {
         return makeFunction(info);
     if (type === GIRepository.InfoType.OBJECT)
         return makeObject(info);
-    if (type === GIRepository.InfoType.STRUCT)
+    if (type === GIRepository.InfoType.STRUCT || type === GIRepository.InfoType.UNION ||
+        type === GIRepository.InfoType.BOXED)
         return makeStruct(info);
 }
 
-function importNS(ns, version) {
-    var module = {};
+function importNS(ns, version, eager) {
+    var module;
 
     var repo = GIRepository.Repository_get_default();
-    GIRepository.Repository_require.call(repo, ns, version || null, 0);
+    gi.Require(ns, version || null);
 
-    var nInfos = GIRepository.Repository_get_n_infos.call(repo, ns);
-    for (var i = 0; i < nInfos; i++) {
-        var info = GIRepository.Repository_get_info.call(repo, ns, i);
-        var name = GIRepository.BaseInfo_get_name.call(info);
-        module[name] = makeInfo(info);
-    }
+    if (eager)
+        module = gi.BuildNamespace(ns, version || null);
+    else
+        module = lazyNS(repo, ns);
 
     var override;
     try {
@@ -198,14 +153,137 @@ function importNS(ns, version) {
     return module;
 }
 
+function lazyNS(repo, ns) {
+    var module = {};
+
+    // Only the names are read up front. Each entry is looked up again by
+    // name and built the first time it is accessed.
+    function resolver(name) {
+        return function() {
+            var info = GIRepository.Repository_find_by_name.call(repo, ns, name);
+            return makeInfo(info);
+        };
+    }
+
+    var nInfos = GIRepository.Repository_get_n_infos.call(repo, ns);
+    for (var i = 0; i < nInfos; i++) {
+        var info = GIRepository.Repository_get_info.call(repo, ns, i);
+        var name = GIRepository.BaseInfo_get_name.call(info);
+        defineLazyProperty(module, name, true, resolver(name));
+    }
+
+    return module;
+}
+
 // Used to avoid exporting same module every time it's required
 var cache = Object.create(null);
-exports.importNS = function(ns, version) {
+// Namespaces are built lazily by default; pass `eager` to build the
+// whole namespace natively in one pass instead.
+exports.importNS = function(ns, version, eager) {
     var module = cache[ns] || (cache[ns] = {});
     var ver = version || '*';
-    return module[ver] || (module[ver] = importNS(ns, version));
+    return module[ver] || (module[ver] = importNS(ns, version, eager));
+};
+
+// Untyped gpointer arguments, such as the items a GCompareFunc passed
+// to ListStore.sort() gets, reach JS as opaque pointers. This returns the
+// wrapper of a GObject that already has one; for objects never seen from
+// JS, pass `isObject` as true to assert that the pointer is a GObject.
+// The pointer is then trusted, and anything else crashes the process.
+exports.objectFromPointer = function(pointer, isObject) {
+    return gi.ObjectFromPointer(pointer, !!isObject);
+};
+
+// By default uv is nested inside the GLib main loop, so node's own I/O
+// only runs while Gtk.main() (or another GLib loop) is spinning. With
+// `{ mode: 'uv' }` libuv drives GLib's default context instead, for
+// headless services that never run a GLib main loop; node then stays
+// alive until stopLoop() is called.
+exports.startLoop = function(options) {
+    gi.StartLoop(options && options.mode || 'glib');
+};
+
+exports.stopLoop = function() {
+    gi.StopLoop();
+};
+
+// Main loop instrumentation is off by default. Once enabled (which also
+// resets the counters), loopStats() returns the counters collected so
+// far; times are in milliseconds. The `timeouts` (ms, as computed by
+// uv_backend_timeout) and `dispatchDurations` (us) histograms are arrays
+// where bucket i counts values in [2^(i-1), 2^i), and bucket 0 zeroes.
+exports.enableLoopStats = function(enabled) {
+    gi.SetLoopStatsEnabled(enabled === undefined ? true : !!enabled);
+};
+
+exports.loopStats = function() {
+    return gi.GetLoopStats();
+};
+
+// Per-function call profiling is off by default and costs nothing then.
+// Enabling it (which also resets it) records, for every GI function
+// called, the call count, allocations, and cumulative and max time in
+// milliseconds for marshal-in, the native call, and marshal-out.
+exports.enableProfiler = function(enabled) {
+    gi.SetFunctionProfilingEnabled(enabled === undefined ? true : !!enabled);
+};
+
+// Returns the rows sorted by total time, heaviest first, or with
+// `{ format: 'table' }` the same rows formatted as a text table.
+exports.profile = function(options) {
+    var rows = gi.GetFunctionProfile();
+    rows.forEach(function(row) {
+        row.totalTime = row.inTime + row.ffiTime + row.outTime;
+    });
+    rows.sort(function(a, b) { return b.totalTime - a.totalTime; });
+
+    if (options && options.format === 'table')
+        return formatProfile(rows);
+    return rows;
+};
+
+function formatProfile(rows) {
+    var columns = ['calls', 'totalTime', 'inTime', 'ffiTime', 'outTime', 'inMax', 'ffiMax', 'outMax', 'allocations'];
+
+    function cell(row, column) {
+        var value = row[column];
+        return column === 'calls' || column === 'allocations' ? String(value) : value.toFixed(3);
+    }
+
+    var header = ['name'].concat(columns);
+    var lines = [header].concat(rows.map(function(row) {
+        return [row.name].concat(columns.map(function(column) { return cell(row, column); }));
+    }));
+
+    var widths = header.map(function(_, i) {
+        return Math.max.apply(null, lines.map(function(line) { return line[i].length; }));
+    });
+
+    return lines.map(function(line) {
+        return line.map(function(value, i) {
+            return i === 0 ? value + Array(widths[i] - value.length + 1).join(' ')
+                           : Array(widths[i] - value.length + 1).join(' ') + value;
+        }).join('  ');
+    }).join('\n');
+}
+
+// Writes a Chrome trace-event file (chrome://tracing, Perfetto) with one
+// event per GI call, signal handler and main loop dispatch. With
+// `{ perfMap: true }`, generated native code is also added to
+// /tmp/perf-<pid>.map for `perf`. The trace is finished on exit if
+// stopTracing() was not called.
+var tracing = false;
+
+exports.startTracing = function(path, options) {
+    gi.StartTracing(path, !!(options && options.perfMap));
+    if (!tracing)
+        process.on('exit', exports.stopTracing);
+    tracing = true;
 };
 
-exports.startLoop = function() {
-    gi.StartLoop();
+exports.stopTracing = function() {
+    if (tracing)
+        process.removeListener('exit', exports.stopTracing);
+    tracing = false;
+    gi.StopTracing();
 };
@@ -1,6 +1,10 @@
 
 #include "boxed.h"
 #include "function.h"
+#include "isolate.h"
+#include "value.h"
+
+#include <string.h>
 
 using namespace v8;
 
@@ -10,19 +14,500 @@ struct Boxed {
     GIBaseInfo *info;
 };
 
-static G_DEFINE_QUARK(gnode_js_template, gnode_js_template);
+/* Plain structs have no GType, so their templates are cached by their
+ * qualified name instead. */
+static char * GetStructKey(GIBaseInfo *info) {
+    return g_strdup_printf ("%s.%s", g_base_info_get_namespace (info), g_base_info_get_name (info));
+}
+
+/* Plain structs made from JS are small and made in large numbers, so
+ * their storage comes from a free list per size, refilled a chunk at a
+ * time. Chunks are never returned to the system. */
 
-static void BoxedClassDestroyed(const WeakCallbackData<FunctionTemplate, GIBaseInfo> &data) {
-    GIBaseInfo *info = data.GetParameter ();
-    GType gtype = g_registered_type_info_get_g_type ((GIRegisteredTypeInfo *) info);
+#define STRUCT_SLAB_CHUNK_SIZE 4096
+
+struct StructSlabItem {
+    StructSlabItem *next;
+};
+
+/* rounded size -> StructSlabItem free list, shared by all isolates */
+static GHashTable *struct_slabs;
+static GMutex struct_slab_lock;
+
+static gsize StructSlabRound(gsize size) {
+    const gsize align = 2 * sizeof (void *);
+    return MAX (sizeof (StructSlabItem), (size + align - 1) & ~(align - 1));
+}
+
+static void * StructSlabAlloc(gsize size) {
+    size = StructSlabRound (size);
+
+    g_mutex_lock (&struct_slab_lock);
+
+    if (struct_slabs == NULL)
+        struct_slabs = g_hash_table_new (NULL, NULL);
+
+    StructSlabItem *item = (StructSlabItem *) g_hash_table_lookup (struct_slabs, GSIZE_TO_POINTER (size));
+
+    if (item == NULL) {
+        gsize n_items = MAX (1, STRUCT_SLAB_CHUNK_SIZE / size);
+        char *chunk = (char *) g_malloc (n_items * size);
+
+        for (gsize i = 0; i < n_items; i++) {
+            StructSlabItem *new_item = (StructSlabItem *) (chunk + i * size);
+            new_item->next = item;
+            item = new_item;
+        }
+    }
+
+    g_hash_table_insert (struct_slabs, GSIZE_TO_POINTER (size), item->next);
+
+    g_mutex_unlock (&struct_slab_lock);
+
+    memset (item, 0, size);
+    return item;
+}
+
+static void StructSlabFree(gsize size, void *data) {
+    size = StructSlabRound (size);
+
+    StructSlabItem *item = (StructSlabItem *) data;
+
+    g_mutex_lock (&struct_slab_lock);
+    item->next = (StructSlabItem *) g_hash_table_lookup (struct_slabs, GSIZE_TO_POINTER (size));
+    g_hash_table_insert (struct_slabs, GSIZE_TO_POINTER (size), item);
+    g_mutex_unlock (&struct_slab_lock);
+}
+
+/* Structs and unions are wrapped alike, and only differ in how their
+ * members are read from the typelib. Plain GI_INFO_TYPE_BOXED infos
+ * have no members to read. */
+static int BoxedInfoGetNMethods(GIBaseInfo *info) {
+    switch (g_base_info_get_type (info)) {
+    case GI_INFO_TYPE_STRUCT:
+        return g_struct_info_get_n_methods ((GIStructInfo *) info);
+    case GI_INFO_TYPE_UNION:
+        return g_union_info_get_n_methods ((GIUnionInfo *) info);
+    default:
+        return 0;
+    }
+}
+
+static GIFunctionInfo * BoxedInfoGetMethod(GIBaseInfo *info, int n) {
+    if (g_base_info_get_type (info) == GI_INFO_TYPE_UNION)
+        return g_union_info_get_method ((GIUnionInfo *) info, n);
+    else
+        return g_struct_info_get_method ((GIStructInfo *) info, n);
+}
+
+static int BoxedInfoGetNFields(GIBaseInfo *info) {
+    switch (g_base_info_get_type (info)) {
+    case GI_INFO_TYPE_STRUCT:
+        return g_struct_info_get_n_fields ((GIStructInfo *) info);
+    case GI_INFO_TYPE_UNION:
+        return g_union_info_get_n_fields ((GIUnionInfo *) info);
+    default:
+        return 0;
+    }
+}
+
+static GIFieldInfo * BoxedInfoGetField(GIBaseInfo *info, int n) {
+    if (g_base_info_get_type (info) == GI_INFO_TYPE_UNION)
+        return g_union_info_get_field ((GIUnionInfo *) info, n);
+    else
+        return g_struct_info_get_field ((GIStructInfo *) info, n);
+}
+
+static gsize BoxedInfoGetSize(GIBaseInfo *info) {
+    switch (g_base_info_get_type (info)) {
+    case GI_INFO_TYPE_STRUCT:
+        return g_struct_info_get_size ((GIStructInfo *) info);
+    case GI_INFO_TYPE_UNION:
+        return g_union_info_get_size ((GIUnionInfo *) info);
+    default:
+        return 0;
+    }
+}
+
+/* Every wrapper gets one of these, owned by its weak callback.
+ * Wrappers are cached by the address they wrap, so the same memory
+ * always comes back as the same JS object while that object is alive. */
+struct BoxedInstance {
+    void *data;
+    GType gtype;
+    GIBaseInfo *info;
+    /* Whether data is ours to free once the wrapper is gone: with
+     * g_boxed_free, or for plain structs back to the slab when they were
+     * made from JS and with g_free when C handed them over. */
+    bool owned;
+    bool slab;
+    bool cached;
+    Persistent<Object> persistent;
+};
+
+static void BoxedInstanceFree(BoxedInstance *instance) {
+    if (instance->owned) {
+        if (instance->gtype != G_TYPE_NONE)
+            g_boxed_free (instance->gtype, instance->data);
+        else if (instance->slab)
+            StructSlabFree (BoxedInfoGetSize (instance->info), instance->data);
+        else
+            g_free (instance->data);
+    }
+
+    instance->persistent.Reset ();
+    g_base_info_unref (instance->info);
+    delete instance;
+}
+
+static void BoxedInstanceDestroyed(const WeakCallbackData<Object, BoxedInstance> &data) {
+    BoxedInstance *instance = data.GetParameter ();
+
+    if (instance->cached)
+        g_hash_table_remove (GetIsolateData (data.GetIsolate ())->boxed_instances, instance->data);
+
+    BoxedInstanceFree (instance);
+}
+
+static void BoxedInstanceNew(Isolate *isolate, Local<Object> obj, GIBaseInfo *info, GType gtype,
+                             void *data, bool owned, bool slab) {
+    IsolateData *isolate_data = GetIsolateData (isolate);
+    if (isolate_data->boxed_instances == NULL)
+        isolate_data->boxed_instances = g_hash_table_new (NULL, NULL);
+    GHashTable *boxed_instances = isolate_data->boxed_instances;
+
+    BoxedInstance *instance = new BoxedInstance ();
+    instance->data = data;
+    instance->gtype = gtype;
+    instance->info = g_base_info_ref (info);
+    instance->owned = owned;
+    instance->slab = slab;
+    instance->persistent.Reset (isolate, obj);
+    instance->persistent.SetWeak (instance, BoxedInstanceDestroyed);
+
+    /* A different type at the same address (a struct embedding another
+     * as its first member) gets a wrapper of its own, uncached. */
+    instance->cached = (g_hash_table_lookup (boxed_instances, data) == NULL);
+    if (instance->cached)
+        g_hash_table_insert (boxed_instances, data, instance);
+}
 
-    void *type_data = g_type_get_qdata (gtype, gnode_js_template_quark ());
-    assert (type_data != NULL);
-    Persistent<FunctionTemplate> *persistent = (Persistent<FunctionTemplate> *) type_data;
-    delete persistent;
+static bool BoxedInstanceMatches(BoxedInstance *instance, GIBaseInfo *info, GType gtype) {
+    if (gtype != G_TYPE_NONE)
+        return instance->gtype == gtype;
+    else
+        return g_base_info_equal (instance->info, info);
+}
+
+/* Frees what the isolate's wrappers still own. Uncached wrappers are
+ * only reachable from their weak callbacks, and are left to leak. */
+void BoxedIsolateCleanup(IsolateData *data) {
+    if (data->boxed_instances == NULL)
+        return;
+
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init (&iter, data->boxed_instances);
+    while (g_hash_table_iter_next (&iter, NULL, &value))
+        BoxedInstanceFree ((BoxedInstance *) value);
+
+    g_hash_table_destroy (data->boxed_instances);
+    data->boxed_instances = NULL;
+}
+
+Local<Value> GetBoxedField(Isolate *isolate, void *boxed, GIFieldInfo *field_info) {
+    GIArgument argument;
+    Local<Value> result;
+    GITypeInfo *type_info = g_field_info_get_type (field_info);
+
+    if (g_field_info_get_field (field_info, boxed, &argument))
+        result = GIArgumentToV8 (isolate, type_info, &argument);
+    else
+        isolate->ThrowException (Exception::Error (String::NewFromUtf8 (isolate, "Could not get boxed field")));
+
+    g_base_info_unref (type_info);
+    return result;
+}
+
+void SetBoxedField(Isolate *isolate, void *boxed, GIFieldInfo *field_info, Local<Value> value) {
+    GIArgument argument;
+    GITypeInfo *type_info = g_field_info_get_type (field_info);
+    V8ToGIArgument (isolate, type_info, &argument, value, true);
+    if (!g_field_info_set_field (field_info, boxed, &argument))
+        isolate->ThrowException (Exception::Error (String::NewFromUtf8 (isolate, "Could not set boxed field")));
+    g_base_info_unref (type_info);
+}
+
+static void FieldGetter(const FunctionCallbackInfo<Value> &args) {
+    Isolate *isolate = args.GetIsolate ();
+    void *boxed = BoxedFromWrapper (args.This ());
+    GIFieldInfo *field_info = (GIFieldInfo *) External::Cast (*args.Data ())->Value ();
+    Local<Value> value = GetBoxedField (isolate, boxed, field_info);
+    if (!value.IsEmpty ())
+        args.GetReturnValue ().Set (value);
+}
+
+static void FieldSetter(const FunctionCallbackInfo<Value> &args) {
+    Isolate *isolate = args.GetIsolate ();
+    void *boxed = BoxedFromWrapper (args.This ());
+    GIFieldInfo *field_info = (GIFieldInfo *) External::Cast (*args.Data ())->Value ();
+    SetBoxedField (isolate, boxed, field_info, args[0]);
+}
+
+static void FieldDestroyed(const WeakCallbackData<FunctionTemplate, GIFieldInfo> &data) {
+    GIFieldInfo *field_info = data.GetParameter ();
+    g_base_info_unref ((GIBaseInfo *) field_info);
+}
+
+/* Scalar fields are read and written straight at their offset, by an
+ * accessor specialized for the field's C type and installed on the
+ * instance template. Other fields go through GetBoxedField. */
+struct DirectField {
+    gint offset;
+    Persistent<External> persistent;
+};
+
+static void DirectFieldDestroyed(const WeakCallbackData<External, DirectField> &data) {
+    DirectField *field = data.GetParameter ();
+    field->persistent.Reset ();
+    delete field;
+}
+
+static inline void * DirectFieldAddress(const PropertyCallbackInfo<Value> &info) {
+    DirectField *field = (DirectField *) External::Cast (*info.Data ())->Value ();
+    char *boxed = (char *) info.Holder ()->GetAlignedPointerFromInternalField (0);
+    return boxed + field->offset;
+}
 
-    g_type_set_qdata (gtype, gnode_js_template_quark (), NULL);
-    g_base_info_unref (info);
+static inline void * DirectFieldAddress(const PropertyCallbackInfo<void> &info) {
+    DirectField *field = (DirectField *) External::Cast (*info.Data ())->Value ();
+    char *boxed = (char *) info.Holder ()->GetAlignedPointerFromInternalField (0);
+    return boxed + field->offset;
+}
+
+template <typename T> static T DirectFieldValue(Local<Value> value);
+template <> int32_t DirectFieldValue<int32_t>(Local<Value> value) { return value->Int32Value (); }
+template <> uint32_t DirectFieldValue<uint32_t>(Local<Value> value) { return value->Uint32Value (); }
+template <> double DirectFieldValue<double>(Local<Value> value) { return value->NumberValue (); }
+template <> bool DirectFieldValue<bool>(Local<Value> value) { return value->BooleanValue (); }
+
+/* T is the C type of the field, JST the one it is handed to JS as. */
+template <typename T, typename JST>
+static void DirectFieldGetter(Local<String> name, const PropertyCallbackInfo<Value> &info) {
+    info.GetReturnValue ().Set ((JST) *(T *) DirectFieldAddress (info));
+}
+
+template <typename T, typename JST>
+static void DirectFieldSetter(Local<String> name, Local<Value> value, const PropertyCallbackInfo<void> &info) {
+    *(T *) DirectFieldAddress (info) = (T) DirectFieldValue<JST> (value);
+}
+
+static bool DefineDirectField(Isolate *isolate, Local<ObjectTemplate> instance_tpl, GIFieldInfo *field_info,
+                              Local<String> name, GIFieldInfoFlags flags) {
+    GITypeInfo *type_info = g_field_info_get_type (field_info);
+    GITypeTag tag = g_type_info_get_tag (type_info);
+    bool is_pointer = g_type_info_is_pointer (type_info);
+    g_base_info_unref ((GIBaseInfo *) type_info);
+
+    /* Bitfields share their bytes with their neighbours; the slow path
+     * refuses them too. */
+    if (is_pointer || !(flags & GI_FIELD_IS_READABLE) || g_field_info_get_size (field_info) != 0)
+        return false;
+
+    AccessorGetterCallback getter;
+    AccessorSetterCallback setter;
+
+#define DIRECT_FIELD(T, JST) \
+    getter = DirectFieldGetter<T, JST>; \
+    setter = DirectFieldSetter<T, JST>; \
+    break;
+
+    switch (tag) {
+    case GI_TYPE_TAG_BOOLEAN: DIRECT_FIELD (gboolean, bool)
+    case GI_TYPE_TAG_INT8:    DIRECT_FIELD (gint8, int32_t)
+    case GI_TYPE_TAG_UINT8:   DIRECT_FIELD (guint8, uint32_t)
+    case GI_TYPE_TAG_INT16:   DIRECT_FIELD (gint16, int32_t)
+    case GI_TYPE_TAG_UINT16:  DIRECT_FIELD (guint16, uint32_t)
+    case GI_TYPE_TAG_INT32:   DIRECT_FIELD (gint32, int32_t)
+    case GI_TYPE_TAG_UINT32:  DIRECT_FIELD (guint32, uint32_t)
+    case GI_TYPE_TAG_UNICHAR: DIRECT_FIELD (gunichar, uint32_t)
+    case GI_TYPE_TAG_INT64:   DIRECT_FIELD (gint64, double)
+    case GI_TYPE_TAG_UINT64:  DIRECT_FIELD (guint64, double)
+    case GI_TYPE_TAG_FLOAT:   DIRECT_FIELD (gfloat, double)
+    case GI_TYPE_TAG_DOUBLE:  DIRECT_FIELD (gdouble, double)
+    default:
+        return false;
+    }
+
+#undef DIRECT_FIELD
+
+    DirectField *field = new DirectField ();
+    field->offset = g_field_info_get_offset (field_info);
+
+    Local<External> data = External::New (isolate, field);
+    field->persistent.Reset (isolate, data);
+    field->persistent.SetWeak (field, DirectFieldDestroyed);
+
+    if (flags & GI_FIELD_IS_WRITABLE)
+        instance_tpl->SetAccessor (name, getter, setter, data);
+    else
+        instance_tpl->SetAccessor (name, getter, NULL, data, DEFAULT, ReadOnly);
+
+    return true;
+}
+
+static void DefineBoxedMembers(Isolate *isolate, Local<FunctionTemplate> tpl, GIBaseInfo *info) {
+    int n_methods = BoxedInfoGetNMethods (info);
+    for (int i = 0; i < n_methods; i++) {
+        GIFunctionInfo *meth_info = BoxedInfoGetMethod (info, i);
+        DefineMethod (isolate, tpl, meth_info);
+        g_base_info_unref ((GIBaseInfo *) meth_info);
+    }
+
+    Local<ObjectTemplate> proto = tpl->PrototypeTemplate ();
+    Local<ObjectTemplate> instance_tpl = tpl->InstanceTemplate ();
+
+    int n_fields = BoxedInfoGetNFields (info);
+    for (int i = 0; i < n_fields; i++) {
+        GIFieldInfo *field_info = BoxedInfoGetField (info, i);
+        GIFieldInfoFlags flags = g_field_info_get_flags (field_info);
+
+        const char *field_name = g_base_info_get_name ((GIBaseInfo *) field_info);
+        char *js_name = g_strdelimit (g_strdup (field_name), "-", '_');
+        Local<String> name = String::NewFromUtf8 (isolate, js_name);
+        g_free (js_name);
+
+        if (DefineDirectField (isolate, instance_tpl, field_info, name, flags)) {
+            g_base_info_unref ((GIBaseInfo *) field_info);
+            continue;
+        }
+
+        Local<Value> field_external = External::New (isolate, field_info);
+        Local<FunctionTemplate> getter, setter;
+
+        if (flags & GI_FIELD_IS_READABLE)
+            getter = FunctionTemplate::New (isolate, FieldGetter, field_external);
+        if (flags & GI_FIELD_IS_WRITABLE)
+            setter = FunctionTemplate::New (isolate, FieldSetter, field_external);
+
+        if (getter.IsEmpty () && setter.IsEmpty ()) {
+            g_base_info_unref ((GIBaseInfo *) field_info);
+        } else {
+            /* The accessor templates own the field info. */
+            Persistent<FunctionTemplate> persistent(isolate, getter.IsEmpty () ? setter : getter);
+            persistent.SetWeak (field_info, FieldDestroyed);
+
+            proto->SetAccessorProperty (name, getter, setter);
+        }
+    }
+}
+
+static GIFunctionInfo * FindZeroArgsConstructor(GIBaseInfo *info) {
+    int n_methods = BoxedInfoGetNMethods (info);
+    for (int i = 0; i < n_methods; i++) {
+        GIFunctionInfo *meth_info = BoxedInfoGetMethod (info, i);
+
+        if ((g_function_info_get_flags (meth_info) & GI_FUNCTION_IS_CONSTRUCTOR) &&
+            g_callable_info_get_n_args ((GICallableInfo *) meth_info) == 0 &&
+            strcmp (g_base_info_get_name ((GIBaseInfo *) meth_info), "new") == 0)
+            return meth_info;
+
+        g_base_info_unref ((GIBaseInfo *) meth_info);
+    }
+    return NULL;
+}
+
+/* Boxed types whose copy function duplicates the public struct and
+ * nothing else, so that a copy of zeroed memory is a valid new value.
+ * Others may only take a reference on their argument (GClosure,
+ * GByteArray, GArray...) or read private data past the public fields. */
+static const char *value_boxed_types[] = {
+    "GdkColor",
+    "GdkRGBA",
+    "GdkRectangle",
+    "GtkBorder",
+    "GtkRequisition",
+    "GtkTextIter",
+    "GtkTreeIter",
+    "PangoColor",
+    NULL,
+};
+
+static bool BoxedCopiesByValue(GType gtype) {
+    const char *name = g_type_name (gtype);
+    for (int i = 0; value_boxed_types[i]; i++) {
+        if (strcmp (name, value_boxed_types[i]) == 0)
+            return true;
+    }
+    return false;
+}
+
+/* Storage for a struct made from JS. Boxed types get theirs from the
+ * type itself, so g_boxed_free can release it later: through a
+ * new() without arguments when there is one, otherwise as a copy of
+ * zeroed memory when that is known to be safe. Plain structs come from
+ * the slab. */
+static void * BoxedAllocate(Isolate *isolate, GIBaseInfo *info, GType gtype) {
+    gsize size = BoxedInfoGetSize (info);
+
+    if (gtype == G_TYPE_NONE) {
+        if (size == 0)
+            goto unsupported;
+        return StructSlabAlloc (size);
+    }
+
+    {
+        GIFunctionInfo *constructor = FindZeroArgsConstructor (info);
+        if (constructor) {
+            GIArgument return_value;
+            GError *error = NULL;
+            bool ok = g_function_info_invoke (constructor, NULL, 0, NULL, 0, &return_value, &error);
+            g_base_info_unref ((GIBaseInfo *) constructor);
+
+            if (!ok) {
+                isolate->ThrowException (Exception::Error (String::NewFromUtf8 (isolate, error->message)));
+                g_error_free (error);
+                return NULL;
+            }
+            return return_value.v_pointer;
+        }
+    }
+
+    if (size > 0 && BoxedCopiesByValue (gtype)) {
+        void *zeroed = g_alloca (size);
+        memset (zeroed, 0, size);
+        return g_boxed_copy (gtype, zeroed);
+    }
+
+ unsupported:
+    char *message = g_strdup_printf ("Cannot construct %s.%s from JS",
+                                     g_base_info_get_namespace ((GIBaseInfo *) info),
+                                     g_base_info_get_name ((GIBaseInfo *) info));
+    isolate->ThrowException (Exception::TypeError (String::NewFromUtf8 (isolate, message)));
+    g_free (message);
+    return NULL;
+}
+
+/* Sets every field named in the object literal. Other properties are
+ * ignored. */
+static void BoxedInitFields(Isolate *isolate, void *boxed, GIBaseInfo *info, Local<Object> fields) {
+    int n_fields = BoxedInfoGetNFields (info);
+    for (int i = 0; i < n_fields; i++) {
+        GIFieldInfo *field_info = BoxedInfoGetField (info, i);
+
+        char *js_name = g_strdelimit (g_strdup (g_base_info_get_name ((GIBaseInfo *) field_info)), "-", '_');
+        Local<String> key = String::NewFromUtf8 (isolate, js_name);
+        g_free (js_name);
+
+        if (fields->Has (key)) {
+            if (g_field_info_get_flags (field_info) & GI_FIELD_IS_WRITABLE)
+                SetBoxedField (isolate, boxed, field_info, fields->Get (key));
+            else
+                isolate->ThrowException (Exception::TypeError (String::NewFromUtf8 (isolate, "Field is not writable")));
+        }
+
+        g_base_info_unref ((GIBaseInfo *) field_info);
+    }
 }
 
 static void BoxedConstructor(const FunctionCallbackInfo<Value> &args) {
@@ -38,44 +523,66 @@ static void BoxedConstructor(const FunctionCallbackInfo<Value> &args) {
     Local<Object> self = args.This ();
 
     if (args[0]->IsExternal ()) {
-        /* The External case. This is how WrapperFromBoxed is called. */
-
-        /* XXX: We might want to copy the boxed? */
+        /* The External case. This is how WrapperFromBoxed is called,
+         * which also takes care of ownership. */
         void *boxed = External::Cast (*args[0])->Value ();
 
         self->SetAlignedPointerInInternalField (0, boxed);
     } else {
-        /* TODO: Boxed construction not supported yet. */
-        g_assert_not_reached ();
+        /* The JS case: new Gdk.RGBA () or new Gdk.RGBA ({ red: 1, ... }) */
+        GIBaseInfo *info = (GIBaseInfo *) External::Cast (*args.Data ())->Value ();
+        GType gtype = g_registered_type_info_get_g_type ((GIRegisteredTypeInfo *) info);
+
+        if (!args[0]->IsUndefined () && !args[0]->IsObject ()) {
+            isolate->ThrowException (Exception::TypeError (String::NewFromUtf8 (isolate, "Expected an object with field values")));
+            return;
+        }
+
+        void *boxed = BoxedAllocate (isolate, info, gtype);
+        if (boxed == NULL)
+            return;
+
+        self->SetAlignedPointerInInternalField (0, boxed);
+        BoxedInstanceNew (isolate, self, info, gtype, boxed, true, gtype == G_TYPE_NONE);
+
+        if (args[0]->IsObject ())
+            BoxedInitFields (isolate, boxed, info, args[0]->ToObject ());
     }
 }
 
 static Local<FunctionTemplate> GetBoxedTemplate(Isolate *isolate, GIBaseInfo *info, GType gtype) {
-    void *data;
+    IsolateData *data = GetIsolateData (isolate);
+    Local<FunctionTemplate> cached;
+    char *key = NULL;
 
-    if (gtype == G_TYPE_NONE)
-        data = NULL;
-    else
-        data = g_type_get_qdata (gtype, gnode_js_template_quark ());
+    if (gtype == G_TYPE_NONE) {
+        key = GetStructKey (info);
+        cached = GetCachedTemplate (data, key);
+    } else {
+        cached = GetCachedTemplate (data, gtype);
+    }
 
-    if (data) {
-        Persistent<FunctionTemplate> *persistent = (Persistent<FunctionTemplate> *) data;
-        Local<FunctionTemplate> tpl = Local<FunctionTemplate>::New (isolate, *persistent);
-        return tpl;
+    if (!cached.IsEmpty ()) {
+        g_free (key);
+        return cached;
     } else {
         Local<FunctionTemplate> tpl = FunctionTemplate::New (isolate, BoxedConstructor, External::New (isolate, info));
 
-        Persistent<FunctionTemplate> *persistent = new Persistent<FunctionTemplate>(isolate, tpl);
-        persistent->SetWeak (g_base_info_ref (info), BoxedClassDestroyed);
-
         const char *class_name = g_base_info_get_name (info);
         tpl->SetClassName (String::NewFromUtf8 (isolate, class_name));
 
-        tpl->InstanceTemplate ()->SetInternalFieldCount (1);
+        /* The second field keeps whatever owns the memory alive, for
+         * wrappers pointing into a StructArray. */
+        tpl->InstanceTemplate ()->SetInternalFieldCount (2);
+
+        DefineBoxedMembers (isolate, tpl, info);
 
-        if (gtype != G_TYPE_NONE)
-            g_type_set_qdata (gtype, gnode_js_template_quark (), persistent);
+        if (gtype == G_TYPE_NONE)
+            CacheTemplate (data, key, info, tpl);
+        else
+            CacheTemplate (data, gtype, info, tpl);
 
+        g_free (key);
         return tpl;
     }
 }
@@ -90,12 +597,47 @@ Local<Function> MakeBoxed(Isolate *isolate, GIBaseInfo *info) {
     return tpl->GetFunction ();
 }
 
-Local<Value> WrapperFromBoxed(Isolate *isolate, GIBaseInfo *info, void *data) {
+Local<Value> WrapperFromBoxed(Isolate *isolate, GIBaseInfo *info, void *data, GITransfer transfer) {
+    if (data == NULL)
+        return Null (isolate);
+
+    GType gtype = g_registered_type_info_get_g_type ((GIRegisteredTypeInfo *) info);
+
+    GHashTable *boxed_instances = GetIsolateData (isolate)->boxed_instances;
+    BoxedInstance *instance = boxed_instances ? (BoxedInstance *) g_hash_table_lookup (boxed_instances, data) : NULL;
+    if (instance && BoxedInstanceMatches (instance, info, gtype)) {
+        /* The same memory came back. If it came with a reference of its
+         * own (refcounted types like GVariant hand out the same pointer),
+         * drop the extra, as boxed wrappers always hold one. A plain
+         * struct we were only borrowing is ours from now on. */
+        if (transfer == GI_TRANSFER_EVERYTHING) {
+            if (gtype != G_TYPE_NONE)
+                g_boxed_free (gtype, data);
+            else
+                instance->owned = true;
+        }
+        return Local<Object>::New (isolate, instance->persistent);
+    }
+
+    /* Memory we don't own may go away under the wrapper, so boxed types
+     * are copied, and the copy is cached by its own address: borrowed
+     * memory can be freed and reused for an unrelated value. Plain
+     * structs can't be copied, and are wrapped as they are; they are
+     * ours when they come with full transfer. */
+    bool owned = (transfer == GI_TRANSFER_EVERYTHING);
+    if (gtype != G_TYPE_NONE) {
+        if (transfer != GI_TRANSFER_EVERYTHING)
+            data = g_boxed_copy (gtype, data);
+        owned = true;
+    }
+
     Local<Function> constructor = MakeBoxed (isolate, info);
 
     Local<Value> boxed_external = External::New (isolate, data);
     Local<Value> args[] = { boxed_external };
     Local<Object> obj = constructor->NewInstance (1, args);
+
+    BoxedInstanceNew (isolate, obj, info, gtype, data, owned, false);
     return obj;
 }
 
@@ -105,4 +647,224 @@ void * BoxedFromWrapper(Local<Value> value) {
     return data;
 }
 
+/* Arrays of inline structs are handed to JS as one StructArray: the
+ * elements' memory as `buffer`, the struct size as `stride` and the
+ * offset and typed array type of each scalar field as `layout`, so they
+ * can be read and written through typed views. at(i) points a single
+ * cursor, shared by the whole array, at element i; it has the fields
+ * and methods of a wrapper, but no wrapper is made per element. */
+struct StructArray {
+    char *data;
+    gsize stride;
+    long length;
+    Persistent<Object> persistent;
+};
+
+static void StructArrayDestroyed(const WeakCallbackData<Object, StructArray> &data) {
+    StructArray *array = data.GetParameter ();
+    array->persistent.Reset ();
+    delete array;
+}
+
+static void StructArrayAt(const FunctionCallbackInfo<Value> &args) {
+    Isolate *isolate = args.GetIsolate ();
+    Local<FunctionTemplate> tpl = Local<FunctionTemplate>::New (isolate, GetIsolateData (isolate)->struct_array_template);
+
+    if (!tpl->HasInstance (args.This ())) {
+        isolate->ThrowException (Exception::TypeError (String::NewFromUtf8 (isolate, "Not a StructArray.")));
+        return;
+    }
+
+    Local<Object> self = args.This ();
+    StructArray *array = (StructArray *) self->GetAlignedPointerFromInternalField (0);
+    int64_t index = args[0]->IntegerValue ();
+
+    if (index < 0 || index >= array->length) {
+        isolate->ThrowException (Exception::RangeError (String::NewFromUtf8 (isolate, "Index out of range.")));
+        return;
+    }
+
+    Local<Value> cursor = self->GetInternalField (1);
+    if (!cursor->IsObject ()) {
+        isolate->ThrowException (Exception::TypeError (String::NewFromUtf8 (isolate, "Elements of odd size have no cursor.")));
+        return;
+    }
+
+    cursor.As<Object> ()->SetAlignedPointerInInternalField (0, array->data + index * array->stride);
+    args.GetReturnValue ().Set (cursor);
+}
+
+static Local<FunctionTemplate> GetStructArrayTemplate(Isolate *isolate) {
+    Persistent<FunctionTemplate> &struct_array_template = GetIsolateData (isolate)->struct_array_template;
+
+    if (struct_array_template.IsEmpty ()) {
+        Local<FunctionTemplate> tpl = FunctionTemplate::New (isolate);
+        tpl->SetClassName (String::NewFromUtf8 (isolate, "StructArray"));
+        tpl->InstanceTemplate ()->SetInternalFieldCount (2);
+        tpl->PrototypeTemplate ()->Set (String::NewFromUtf8 (isolate, "at"), FunctionTemplate::New (isolate, StructArrayAt));
+        struct_array_template.Reset (isolate, tpl);
+    }
+    return Local<FunctionTemplate>::New (isolate, struct_array_template);
+}
+
+static const char * GetTypedArrayName(GITypeTag tag) {
+    switch (tag) {
+    case GI_TYPE_TAG_BOOLEAN:
+    case GI_TYPE_TAG_INT32:
+        return "Int32Array";
+    case GI_TYPE_TAG_INT8:
+        return "Int8Array";
+    case GI_TYPE_TAG_UINT8:
+        return "Uint8Array";
+    case GI_TYPE_TAG_INT16:
+        return "Int16Array";
+    case GI_TYPE_TAG_UINT16:
+        return "Uint16Array";
+    case GI_TYPE_TAG_UINT32:
+    case GI_TYPE_TAG_UNICHAR:
+        return "Uint32Array";
+    case GI_TYPE_TAG_FLOAT:
+        return "Float32Array";
+    case GI_TYPE_TAG_DOUBLE:
+        return "Float64Array";
+    default:
+        return NULL;
+    }
+}
+
+bool StructIsPlainData(GIStructInfo *info) {
+    bool plain = true;
+
+    int n_fields = g_struct_info_get_n_fields (info);
+    for (int i = 0; plain && i < n_fields; i++) {
+        GIFieldInfo *field_info = g_struct_info_get_field (info, i);
+        GITypeInfo *type_info = g_field_info_get_type (field_info);
+        GITypeTag tag = g_type_info_get_tag (type_info);
+
+        if (g_type_info_is_pointer (type_info)) {
+            plain = false;
+        } else if (tag == GI_TYPE_TAG_INTERFACE) {
+            GIBaseInfo *iface_info = g_type_info_get_interface (type_info);
+            GIInfoType iface_type = g_base_info_get_type (iface_info);
+            if (iface_type == GI_INFO_TYPE_STRUCT)
+                plain = StructIsPlainData ((GIStructInfo *) iface_info);
+            else
+                plain = (iface_type == GI_INFO_TYPE_ENUM || iface_type == GI_INFO_TYPE_FLAGS);
+            g_base_info_unref (iface_info);
+        } else {
+            /* Inline fixed-size arrays are still plain memory */
+            plain = (tag != GI_TYPE_TAG_UTF8 && tag != GI_TYPE_TAG_FILENAME &&
+                     tag != GI_TYPE_TAG_GLIST && tag != GI_TYPE_TAG_GSLIST &&
+                     tag != GI_TYPE_TAG_GHASH && tag != GI_TYPE_TAG_ERROR);
+            if (plain && tag == GI_TYPE_TAG_ARRAY) {
+                GITypeInfo *elem_info = g_type_info_get_param_type (type_info, 0);
+                plain = !g_type_info_is_pointer (elem_info) && g_type_info_get_tag (elem_info) != GI_TYPE_TAG_INTERFACE;
+                g_base_info_unref ((GIBaseInfo *) elem_info);
+            }
+        }
+
+        g_base_info_unref ((GIBaseInfo *) type_info);
+        g_base_info_unref ((GIBaseInfo *) field_info);
+    }
+
+    return plain;
+}
+
+static Local<Object> MakeStructLayout(Isolate *isolate, GIStructInfo *info) {
+    Local<Object> layout = Object::New (isolate);
+
+    int n_fields = g_struct_info_get_n_fields (info);
+    for (int i = 0; i < n_fields; i++) {
+        GIFieldInfo *field_info = g_struct_info_get_field (info, i);
+        GITypeInfo *type_info = g_field_info_get_type (field_info);
+        /* Bitfields have no typed array view */
+        bool is_plain = !g_type_info_is_pointer (type_info) && g_field_info_get_size (field_info) == 0;
+        const char *type_name = is_plain ? GetTypedArrayName (g_type_info_get_tag (type_info)) : NULL;
+
+        if (type_name) {
+            char *js_name = g_strdelimit (g_strdup (g_base_info_get_name ((GIBaseInfo *) field_info)), "-", '_');
+            Local<Object> field = Object::New (isolate);
+            field->Set (String::NewFromUtf8 (isolate, "offset"), Integer::New (isolate, g_field_info_get_offset (field_info)));
+            field->Set (String::NewFromUtf8 (isolate, "type"), String::NewFromUtf8 (isolate, type_name));
+            layout->Set (String::NewFromUtf8 (isolate, js_name), field);
+            g_free (js_name);
+        }
+
+        g_base_info_unref ((GIBaseInfo *) type_info);
+        g_base_info_unref ((GIBaseInfo *) field_info);
+    }
+
+    return layout;
+}
+
+Local<Value> MakeStructArray(Isolate *isolate, GIStructInfo *info, Local<ArrayBuffer> buffer, long length) {
+    Local<Object> obj = GetStructArrayTemplate (isolate)->GetFunction ()->NewInstance ();
+
+    StructArray *array = new StructArray ();
+    array->data = (char *) buffer->GetContents ().Data ();
+    array->stride = g_struct_info_get_size (info);
+    array->length = length;
+    array->persistent.Reset (isolate, obj);
+    array->persistent.SetWeak (array, StructArrayDestroyed);
+    obj->SetAlignedPointerInInternalField (0, array);
+
+    /* Wrappers keep their pointer in an aligned internal field, which
+     * odd-sized elements can't always provide. */
+    if (length > 0 && array->stride % 2 == 0) {
+        Local<Value> args[] = { External::New (isolate, array->data) };
+        Local<Object> cursor = MakeBoxed (isolate, info)->NewInstance (1, args);
+        cursor->SetInternalField (1, buffer);
+        obj->SetInternalField (1, cursor);
+    }
+
+    obj->Set (String::NewFromUtf8 (isolate, "buffer"), buffer);
+    obj->Set (String::NewFromUtf8 (isolate, "length"), Integer::New (isolate, length));
+    obj->Set (String::NewFromUtf8 (isolate, "stride"), Integer::New (isolate, array->stride));
+    obj->Set (String::NewFromUtf8 (isolate, "layout"), MakeStructLayout (isolate, info));
+    return obj;
+}
+
+bool StructArrayGetContents(Isolate *isolate, Local<Value> value, gsize stride, void **data_p, size_t *length_p) {
+    Persistent<FunctionTemplate> &struct_array_template = GetIsolateData (isolate)->struct_array_template;
+    if (struct_array_template.IsEmpty () || !value->IsObject ())
+        return false;
+
+    Local<FunctionTemplate> tpl = Local<FunctionTemplate>::New (isolate, struct_array_template);
+    if (!tpl->HasInstance (value))
+        return false;
+
+    StructArray *array = (StructArray *) value.As<Object> ()->GetAlignedPointerFromInternalField (0);
+    if (array->stride != stride)
+        return false;
+
+    *data_p = array->data;
+    *length_p = array->length;
+    return true;
+}
+
+void * BoxedFromValue(Isolate *isolate, GIBaseInfo *info, Local<Value> value) {
+    if (!value->IsObject ()) {
+        isolate->ThrowException (Exception::TypeError (String::NewFromUtf8 (isolate, "Expected a struct or an object literal")));
+        return NULL;
+    }
+
+    /* Native wrappers are taken as they are, as before. */
+    if (value.As<Object> ()->InternalFieldCount () > 0)
+        return BoxedFromWrapper (value);
+
+    /* An object literal: build a struct from it. The wrapper stays alive
+     * in the caller's handle scope, which covers a synchronous call;
+     * others collect it in made_structs. */
+    Local<Value> args[] = { value };
+    Local<Object> obj = MakeBoxed (isolate, info)->NewInstance (1, args);
+    if (obj.IsEmpty ())
+        return NULL;
+
+    IsolateData *data = GetIsolateData (isolate);
+    if (data->made_structs)
+        (*data->made_structs)->Set ((*data->made_structs)->Length (), obj);
+
+    return BoxedFromWrapper (obj);
+}
+
 };
@@ -8,7 +8,25 @@ namespace GNodeJS {
 
 v8::Local<v8::Function> MakeBoxed(v8::Isolate *isolate, GIBaseInfo *info);
 
-v8::Local<v8::Value> WrapperFromBoxed(v8::Isolate *isolate, GIBaseInfo *info, void *data);
+/* With GI_TRANSFER_EVERYTHING the wrapper takes over data; otherwise a
+ * boxed type is copied. The same address always maps to the same
+ * wrapper while it is alive. */
+v8::Local<v8::Value> WrapperFromBoxed(v8::Isolate *isolate, GIBaseInfo *info, void *data, GITransfer transfer);
 void * BoxedFromWrapper(v8::Local<v8::Value>);
+/* Like BoxedFromWrapper, but also accepts an object literal, from
+ * which a new struct of the given type is built. */
+void * BoxedFromValue(v8::Isolate *isolate, GIBaseInfo *info, v8::Local<v8::Value> value);
+
+/* Whether a struct is plain data: no pointers and nothing it owns, so
+ * that its memory can be copied, kept and freed as bytes. */
+bool StructIsPlainData(GIStructInfo *info);
+/* Wraps the memory of an array of inline structs, see boxed.cc. */
+v8::Local<v8::Value> MakeStructArray(v8::Isolate *isolate, GIStructInfo *info, v8::Local<v8::ArrayBuffer> buffer, long length);
+/* Whether value is a StructArray of elements of the given size, and if
+ * so, where its elements are. */
+bool StructArrayGetContents(v8::Isolate *isolate, v8::Local<v8::Value> value, gsize stride, void **data_p, size_t *length_p);
+
+v8::Local<v8::Value> GetBoxedField(v8::Isolate *isolate, void *boxed, GIFieldInfo *field_info);
+void SetBoxedField(v8::Isolate *isolate, void *boxed, GIFieldInfo *field_info, v8::Local<v8::Value> value);
 
 };
@@ -1,7 +1,11 @@
 
+#include "closure.h"
 #include "function.h"
 
+#include "dispatch.h"
+#include "isolate.h"
 #include "value.h"
+#include "trace.h"
 
 using namespace v8;
 
@@ -9,7 +13,23 @@ namespace GNodeJS {
 
 struct Closure {
     GClosure base;
+    Isolate *isolate;
     Persistent<Function> persistent;
+    /* Current when the handler was connected; entered for every call,
+     * since emissions from the main loop have none */
+    Persistent<Context> context;
+    /* Of the isolate; emissions on other threads go through it */
+    Dispatcher *dispatcher;
+
+    /* Converters for the instance and each signal parameter, resolved
+     * with g_signal_query when the closure is connected. NULL when the
+     * signature is unknown, in which case each value is probed. */
+    uint n_param_funcs;
+    GValueToV8Func *param_funcs;
+    /* Introspection data of the boxed parameters, looked up along with
+     * the converters; NULL when there are none. */
+    GIBaseInfo **param_infos;
+    V8ToGValueFunc return_func;
 
     static void Marshal(GClosure *closure,
                         GValue   *g_return_value,
@@ -17,19 +37,114 @@ struct Closure {
                         gpointer  invocation_hint,
                         gpointer  marshal_data);
 
+    static void Invoke(Closure *closure,
+                       GValue *g_return_value,
+                       uint argc, const GValue *g_argv,
+                       guint signal_id);
+
     static void Invalidated(gpointer data, GClosure *closure);
 };
 
+/* An emission from another thread, waiting on the JS thread's queue.
+ * Emissions with a return value block the emitter until it is set and
+ * use its values as they are; the others are fire-and-forget and run on
+ * copies, so the emitter is free to go on. Values holding bare pointers
+ * are copied as pointers and had better outlive the emission. */
+struct ClosureEmission {
+    DispatchItem base;
+    Closure *closure;
+    guint signal_id;
+    uint argc;
+    const GValue *argv;
+    GValue *copies;
+    GValue *return_value;
+};
+
+static void ClosureEmissionRun(DispatchItem *item, bool cancelled) {
+    ClosureEmission *emission = (ClosureEmission *) item;
+    Closure *closure = emission->closure;
+
+    /* Disconnected while it waited */
+    if (!cancelled && !closure->base.is_invalid) {
+        Closure::Invoke (closure, emission->return_value, emission->argc, emission->argv, emission->signal_id);
+    }
+
+    if (emission->copies == NULL)
+        return;
+
+    for (uint i = 0; i < emission->argc; i++)
+        g_value_unset (&emission->copies[i]);
+    g_free (emission->copies);
+    g_closure_unref (&closure->base);
+    delete emission;
+}
+
+static void ClosureMarshalFromThread(Closure *closure,
+                                     GValue *g_return_value,
+                                     uint argc, const GValue *g_argv,
+                                     guint signal_id) {
+    if (g_return_value) {
+        ClosureEmission emission;
+        emission.base.run = ClosureEmissionRun;
+        emission.closure = closure;
+        emission.signal_id = signal_id;
+        emission.argc = argc;
+        emission.argv = g_argv;
+        emission.copies = NULL;
+        emission.return_value = g_return_value;
+        if (!DispatchAndWait (closure->dispatcher, &emission.base))
+            g_warning ("Signal handler not run: its isolate is gone");
+        return;
+    }
+
+    ClosureEmission *emission = new ClosureEmission ();
+    emission->base.run = ClosureEmissionRun;
+    emission->closure = closure;
+    emission->signal_id = signal_id;
+    emission->argc = argc;
+    emission->copies = g_new0 (GValue, argc);
+    for (uint i = 0; i < argc; i++) {
+        g_value_init (&emission->copies[i], G_VALUE_TYPE (&g_argv[i]));
+        g_value_copy (&g_argv[i], &emission->copies[i]);
+    }
+    emission->argv = emission->copies;
+    emission->return_value = NULL;
+    g_closure_ref (&closure->base);
+
+    if (!DispatchPush (closure->dispatcher, &emission->base))
+        ClosureEmissionRun (&emission->base, true);
+}
+
 void Closure::Marshal(GClosure *base,
                       GValue   *g_return_value,
                       uint argc, const GValue *g_argv,
                       gpointer  invocation_hint,
                       gpointer  marshal_data) {
-    /* XXX: Any other way to get this? */
-    Isolate *isolate = Isolate::GetCurrent ();
+    Closure *closure = (Closure *) base;
+    GSignalInvocationHint *hint = (GSignalInvocationHint *) invocation_hint;
+    guint signal_id = hint ? hint->signal_id : 0;
+
+    /* GTask workers, GStreamer streaming threads, GDBus and the like
+     * emit wherever they happen to run. */
+    if (!DispatcherIsJSThread (closure->dispatcher)) {
+        ClosureMarshalFromThread (closure, g_return_value, argc, g_argv, signal_id);
+        return;
+    }
+
+    Invoke (closure, g_return_value, argc, g_argv, signal_id);
+}
+
+void Closure::Invoke(Closure *closure,
+                     GValue *g_return_value,
+                     uint argc, const GValue *g_argv,
+                     guint signal_id) {
+    Isolate *isolate = closure->isolate;
     HandleScope scope(isolate);
 
-    Closure *closure = (Closure *) base;
+    Local<Context> context = Local<Context>::New (isolate, closure->context);
+    Context::Scope context_scope (context);
+    TryCatch try_catch;
+
     Local<Function> func = Local<Function>::New(isolate, closure->persistent);
 
     #ifndef __linux__
@@ -38,32 +153,273 @@ void Closure::Marshal(GClosure *base,
         Local<Value> argv[argc];
     #endif
 
-    for (uint i = 0; i < argc; i++)
-        argv[i] = GValueToV8 (isolate, &g_argv[i]);
+    if (closure->param_funcs && argc == closure->n_param_funcs) {
+        for (uint i = 0; i < argc; i++) {
+            if (closure->param_infos && closure->param_infos[i])
+                argv[i] = BoxedGValueToV8 (isolate, &g_argv[i], closure->param_infos[i]);
+            else
+                argv[i] = closure->param_funcs[i] (isolate, &g_argv[i]);
+        }
+    } else {
+        for (uint i = 0; i < argc; i++)
+            argv[i] = GValueToV8 (isolate, &g_argv[i]);
+    }
 
     Local<Object> this_obj = func;
+    guint64 start = TraceEnabled () ? TraceNow () : 0;
     Local<Value> return_value = func->Call (this_obj, argc, argv);
 
+    if (start) {
+        if (signal_id) {
+            GSignalQuery query;
+            g_signal_query (signal_id, &query);
+            char *name = g_strdup_printf ("%s::%s", g_type_name (query.itype), query.signal_name);
+            TraceEvent ("signal", name, start, TraceNow ());
+            g_free (name);
+        } else {
+            TraceEvent ("signal", "closure", start, TraceNow ());
+        }
+    }
+
     #ifndef __linux__
         delete[] argv;
     #endif
 
-    if (g_return_value)
-        V8ToGValue (g_return_value, return_value);
+    if (g_return_value && !return_value.IsEmpty ()) {
+        if (closure->return_func)
+            closure->return_func (g_return_value, return_value);
+        else
+            V8ToGValue (g_return_value, return_value);
+    }
+
+    if (try_catch.HasCaught ())
+        ForwardException (isolate, try_catch);
+}
+
+/* Lets go of the closure's handles; reset_handles is false once the
+ * isolate is gone. */
+static void ClosureTeardown(Closure *closure, bool reset_handles) {
+    if (reset_handles) {
+        closure->persistent.Reset ();
+        closure->context.Reset ();
+    }
+    if (closure->param_infos) {
+        for (uint i = 0; i < closure->n_param_funcs; i++)
+            if (closure->param_infos[i])
+                g_base_info_unref (closure->param_infos[i]);
+        g_free (closure->param_infos);
+        closure->param_infos = NULL;
+    }
+    g_free (closure->param_funcs);
+    closure->param_funcs = NULL;
+    closure->~Closure();
+}
+
+/* Teardown of a closure invalidated on another thread, which holds a
+ * reference on it until then */
+struct ClosureTeardownItem {
+    DispatchItem base;
+    Closure *closure;
+};
+
+static void ClosureTeardownRun(DispatchItem *item, bool cancelled) {
+    ClosureTeardownItem *teardown = (ClosureTeardownItem *) item;
+    ClosureTeardown (teardown->closure, !cancelled);
+    g_closure_unref (&teardown->closure->base);
+    delete teardown;
 }
 
+/* Runs on whichever thread disconnects the handler or finalizes the
+ * object, which for GTask and GStreamer objects is often not ours. */
 void Closure::Invalidated(gpointer data, GClosure *base) {
     Closure *closure = (Closure *) base;
-    closure->~Closure();
+
+    if (DispatcherIsJSThread (closure->dispatcher)) {
+        ClosureTeardown (closure, true);
+        return;
+    }
+
+    ClosureTeardownItem *teardown = new ClosureTeardownItem ();
+    teardown->base.run = ClosureTeardownRun;
+    teardown->closure = closure;
+    g_closure_ref (base);
+
+    if (!DispatchPush (closure->dispatcher, &teardown->base))
+        ClosureTeardownRun (&teardown->base, true);
 }
 
 GClosure *MakeClosure(Isolate *isolate, Local<Function> function) {
     Closure *closure = (Closure *) g_closure_new_simple (sizeof (*closure), NULL);
+    closure->isolate = isolate;
     closure->persistent.Reset(isolate, function);
+    closure->context.Reset (isolate, isolate->GetCurrentContext ());
+    closure->dispatcher = GetIsolateData (isolate)->dispatcher;
     GClosure *gclosure = &closure->base;
     g_closure_set_marshal (gclosure, Closure::Marshal);
     g_closure_add_invalidate_notifier (gclosure, NULL, Closure::Invalidated);
     return gclosure;
 }
 
+GClosure *MakeClosure(Isolate *isolate, Local<Function> function, guint signal_id) {
+    GClosure *gclosure = MakeClosure (isolate, function);
+    Closure *closure = (Closure *) gclosure;
+
+    GSignalQuery query;
+    g_signal_query (signal_id, &query);
+    if (query.signal_id == 0)
+        return gclosure;
+
+    closure->n_param_funcs = query.n_params + 1;
+    closure->param_funcs = g_new (GValueToV8Func, closure->n_param_funcs);
+    closure->param_funcs[0] = GetGValueToV8Func (query.itype);
+    for (uint i = 0; i < query.n_params; i++) {
+        GType param_type = query.param_types[i] & ~G_SIGNAL_TYPE_STATIC_SCOPE;
+        closure->param_funcs[i + 1] = GetGValueToV8Func (param_type);
+
+        /* Types without introspection data are left to the converter,
+         * which reports them. */
+        if (G_TYPE_FUNDAMENTAL (param_type) == G_TYPE_BOXED && param_type != G_TYPE_BYTES) {
+            GIBaseInfo *info = g_irepository_find_by_gtype (NULL, param_type);
+            if (info) {
+                if (closure->param_infos == NULL)
+                    closure->param_infos = g_new0 (GIBaseInfo *, closure->n_param_funcs);
+                closure->param_infos[i + 1] = info;
+            }
+        }
+    }
+
+    GType return_type = query.return_type & ~G_SIGNAL_TYPE_STATIC_SCOPE;
+    if (return_type != G_TYPE_NONE)
+        closure->return_func = GetV8ToGValueFunc (return_type);
+
+    return gclosure;
+}
+
+/* Sits between a signal and the closure of a handler that does not need
+ * every emission. Emissions only store their values, replacing those of
+ * the previous one, and schedule a flush on the default main context if
+ * none is pending yet; the flush passes the last values on to the
+ * target. The target itself takes care of reaching the JS thread. */
+struct CoalescedClosure {
+    GClosure base;
+    GClosure *target;
+    /* 0 for once per idle */
+    guint interval_ms;
+
+    /* Emissions can come from any thread. */
+    GMutex lock;
+    uint argc;
+    GValue *pending;
+    guint signal_id;
+    bool scheduled;
+    gint64 last_flush;
+
+    static void Marshal(GClosure *closure,
+                        GValue   *g_return_value,
+                        uint argc, const GValue *g_argv,
+                        gpointer  invocation_hint,
+                        gpointer  marshal_data);
+
+    static gboolean Flush(gpointer data);
+    static void Finalize(gpointer data, GClosure *closure);
+};
+
+static void PendingValuesFree(GValue *values, uint argc) {
+    for (uint i = 0; i < argc; i++)
+        g_value_unset (&values[i]);
+    g_free (values);
+}
+
+void CoalescedClosure::Marshal(GClosure *base,
+                               GValue   *g_return_value,
+                               uint argc, const GValue *g_argv,
+                               gpointer  invocation_hint,
+                               gpointer  marshal_data) {
+    CoalescedClosure *closure = (CoalescedClosure *) base;
+    GSignalInvocationHint *hint = (GSignalInvocationHint *) invocation_hint;
+
+    GValue *values = g_new0 (GValue, argc);
+    for (uint i = 0; i < argc; i++) {
+        g_value_init (&values[i], G_VALUE_TYPE (&g_argv[i]));
+        g_value_copy (&g_argv[i], &values[i]);
+    }
+
+    g_mutex_lock (&closure->lock);
+
+    GValue *replaced = closure->pending;
+    uint replaced_argc = closure->argc;
+    closure->pending = values;
+    closure->argc = argc;
+    closure->signal_id = hint ? hint->signal_id : 0;
+
+    if (!closure->scheduled) {
+        GSource *source;
+        if (closure->interval_ms == 0) {
+            source = g_idle_source_new ();
+        } else {
+            gint64 elapsed = (g_get_monotonic_time () - closure->last_flush) / 1000;
+            source = g_timeout_source_new (elapsed >= closure->interval_ms ? 0 : closure->interval_ms - elapsed);
+        }
+        g_source_set_callback (source, CoalescedClosure::Flush, g_closure_ref (base), (GDestroyNotify) g_closure_unref);
+        g_source_attach (source, NULL);
+        g_source_unref (source);
+        closure->scheduled = true;
+    }
+
+    g_mutex_unlock (&closure->lock);
+
+    /* Unset outside the lock: dropping the last reference of an object
+     * can run anything. */
+    if (replaced)
+        PendingValuesFree (replaced, replaced_argc);
+}
+
+gboolean CoalescedClosure::Flush(gpointer data) {
+    CoalescedClosure *closure = (CoalescedClosure *) data;
+
+    g_mutex_lock (&closure->lock);
+    GValue *values = closure->pending;
+    uint argc = closure->argc;
+    GSignalInvocationHint hint = { closure->signal_id, 0, G_SIGNAL_RUN_FIRST };
+    closure->pending = NULL;
+    closure->scheduled = false;
+    closure->last_flush = g_get_monotonic_time ();
+    g_mutex_unlock (&closure->lock);
+
+    if (values == NULL)
+        return G_SOURCE_REMOVE;
+
+    /* Emissions that were still pending when the handler got
+     * disconnected are dropped. */
+    if (!closure->base.is_invalid)
+        g_closure_invoke (closure->target, NULL, argc, values, &hint);
+
+    PendingValuesFree (values, argc);
+    return G_SOURCE_REMOVE;
+}
+
+void CoalescedClosure::Finalize(gpointer data, GClosure *base) {
+    CoalescedClosure *closure = (CoalescedClosure *) base;
+    if (closure->pending)
+        PendingValuesFree (closure->pending, closure->argc);
+    g_mutex_clear (&closure->lock);
+    g_closure_invalidate (closure->target);
+    g_closure_unref (closure->target);
+}
+
+GClosure *MakeCoalescedClosure(GClosure *target, guint interval_ms) {
+    CoalescedClosure *closure = (CoalescedClosure *) g_closure_new_simple (sizeof (*closure), NULL);
+    closure->target = target;
+    closure->interval_ms = interval_ms;
+    g_mutex_init (&closure->lock);
+
+    g_closure_ref (target);
+    g_closure_sink (target);
+
+    GClosure *gclosure = &closure->base;
+    g_closure_set_marshal (gclosure, CoalescedClosure::Marshal);
+    g_closure_add_finalize_notifier (gclosure, NULL, CoalescedClosure::Finalize);
+    return gclosure;
+}
+
 };
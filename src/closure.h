@@ -8,4 +8,14 @@ namespace GNodeJS {
 
 GClosure *MakeClosure(v8::Isolate *isolate, v8::Local<v8::Function> function);
 
+/* Same as above, but with the converters for the signal's instance,
+ * parameters and return value resolved up front. */
+GClosure *MakeClosure(v8::Isolate *isolate, v8::Local<v8::Function> function, guint signal_id);
+
+/* Wraps target so that bursts of emissions reach it merged into one,
+ * with the values of the last: once the default main context is idle,
+ * or at most once per interval_ms when that is not 0. Takes target;
+ * only for signals without a return value. */
+GClosure *MakeCoalescedClosure(GClosure *target, guint interval_ms);
+
 };
@@ -0,0 +1,196 @@
+
+#include "dispatch.h"
+#include "isolate.h"
+#include "trace.h"
+
+#include <uv.h>
+
+using namespace v8;
+
+namespace GNodeJS {
+
+/* Marks a closed queue; never dereferenced. */
+#define QUEUE_CLOSED ((DispatchItem *) GSIZE_TO_POINTER (1))
+
+struct Dispatcher {
+    /* Only used by the drain, which stops with the isolate */
+    IsolateData *data;
+    GThread *thread;
+    uv_async_t *async;
+
+    /* Treiber stack of pending items, newest first. Producers push with
+     * a compare-and-swap; the JS thread takes the whole stack at once
+     * and reverses it, so items still run in the order they came in. */
+    DispatchItem *queue;
+    /* Producers between a successful push and their uv_async_send */
+    gint n_senders;
+};
+
+static DispatchItem *QueueTake(Dispatcher *dispatcher, DispatchItem *replacement) {
+    DispatchItem *head;
+    do {
+        head = (DispatchItem *) g_atomic_pointer_get (&dispatcher->queue);
+        if (head == QUEUE_CLOSED)
+            return NULL;
+    } while (!g_atomic_pointer_compare_and_exchange (&dispatcher->queue, head, replacement));
+    return head;
+}
+
+static DispatchItem *QueueReverse(DispatchItem *item) {
+    DispatchItem *reversed = NULL;
+    while (item) {
+        DispatchItem *next = item->next;
+        item->next = reversed;
+        reversed = item;
+        item = next;
+    }
+    return reversed;
+}
+
+static void DispatchDrain(uv_async_t *handle) {
+    Dispatcher *dispatcher = (Dispatcher *) handle->data;
+    Isolate *isolate = dispatcher->data->isolate;
+
+    DispatchItem *item = QueueReverse (QueueTake (dispatcher, NULL));
+    if (item == NULL)
+        return;
+
+    guint64 start = TraceEnabled () ? TraceNow () : 0;
+    int n_items = 0;
+
+    {
+        TopLevelScope top_level_scope (dispatcher->data);
+
+        while (item) {
+            DispatchItem *next = item->next;
+            HandleScope scope (isolate);
+            item->run (item, false);
+            item = next;
+            n_items++;
+        }
+    }
+
+    if (start) {
+        char *name = g_strdup_printf ("dispatch (%d)", n_items);
+        TraceEvent ("dispatch", name, start, TraceNow ());
+        g_free (name);
+    }
+}
+
+static void DispatchAsyncClosed(uv_handle_t *handle) {
+    g_free (handle);
+}
+
+Dispatcher *DispatcherNew(IsolateData *data) {
+    Dispatcher *dispatcher = g_new0 (Dispatcher, 1);
+    dispatcher->data = data;
+    dispatcher->thread = g_thread_self ();
+
+#if NODE_MAJOR_VERSION >= 10
+    uv_loop_t *loop = node::GetCurrentEventLoop (data->isolate);
+#else
+    uv_loop_t *loop = uv_default_loop ();
+#endif
+
+    dispatcher->async = g_new0 (uv_async_t, 1);
+    uv_async_init (loop, dispatcher->async, DispatchDrain);
+    dispatcher->async->data = dispatcher;
+    /* Pending work from other threads does not keep the process alive
+     * on its own, same as the GLib sources it usually comes from. */
+    uv_unref ((uv_handle_t *) dispatcher->async);
+
+    return dispatcher;
+}
+
+void DispatcherClose(Dispatcher *dispatcher) {
+    DispatchItem *item = QueueTake (dispatcher, QUEUE_CLOSED);
+
+    /* Nothing can be pushed anymore; wait out those already past their
+     * push before the handle goes away under their uv_async_send. */
+    while (g_atomic_int_get (&dispatcher->n_senders) > 0)
+        g_thread_yield ();
+
+    uv_close ((uv_handle_t *) dispatcher->async, DispatchAsyncClosed);
+    dispatcher->async = NULL;
+
+    for (item = QueueReverse (item); item; ) {
+        DispatchItem *next = item->next;
+        item->run (item, true);
+        item = next;
+    }
+}
+
+bool DispatcherIsJSThread(Dispatcher *dispatcher) {
+    return g_thread_self () == dispatcher->thread;
+}
+
+bool DispatchPush(Dispatcher *dispatcher, DispatchItem *item) {
+    DispatchItem *head;
+
+    g_atomic_int_inc (&dispatcher->n_senders);
+
+    do {
+        head = (DispatchItem *) g_atomic_pointer_get (&dispatcher->queue);
+        if (head == QUEUE_CLOSED) {
+            g_atomic_int_add (&dispatcher->n_senders, -1);
+            return false;
+        }
+        item->next = head;
+    } while (!g_atomic_pointer_compare_and_exchange (&dispatcher->queue, head, item));
+
+    /* Only the first item of a batch needs to wake the loop; the rest
+     * are picked up by the same drain. */
+    if (head == NULL)
+        uv_async_send (dispatcher->async);
+
+    g_atomic_int_add (&dispatcher->n_senders, -1);
+    return true;
+}
+
+struct WaitItem {
+    DispatchItem base;
+    DispatchItem *item;
+    GMutex mutex;
+    GCond cond;
+    bool done;
+    bool ran;
+};
+
+static void WaitItemRun(DispatchItem *base, bool cancelled) {
+    WaitItem *wait = (WaitItem *) base;
+
+    wait->item->run (wait->item, cancelled);
+
+    /* The waiter owns the memory and may free it as soon as it sees
+     * done, so nothing touches it after the unlock. */
+    g_mutex_lock (&wait->mutex);
+    wait->ran = !cancelled;
+    wait->done = true;
+    g_cond_signal (&wait->cond);
+    g_mutex_unlock (&wait->mutex);
+}
+
+bool DispatchAndWait(Dispatcher *dispatcher, DispatchItem *item) {
+    g_assert (!DispatcherIsJSThread (dispatcher));
+
+    WaitItem wait;
+    wait.base.run = WaitItemRun;
+    wait.item = item;
+    wait.done = false;
+    wait.ran = false;
+    g_mutex_init (&wait.mutex);
+    g_cond_init (&wait.cond);
+
+    bool queued = DispatchPush (dispatcher, &wait.base);
+
+    g_mutex_lock (&wait.mutex);
+    while (queued && !wait.done)
+        g_cond_wait (&wait.cond, &wait.mutex);
+    g_mutex_unlock (&wait.mutex);
+
+    g_mutex_clear (&wait.mutex);
+    g_cond_clear (&wait.cond);
+    return wait.ran;
+}
+
+};
@@ -0,0 +1,42 @@
+
+#pragma once
+
+#include <node.h>
+#include <glib.h>
+
+namespace GNodeJS {
+
+/* Work handed to the JS thread of an isolate by any other thread. Items
+ * go onto a lock-free queue and a uv_async_t wakes the isolate's loop,
+ * which runs everything queued so far in one batch.
+ *
+ * run() is called exactly once for every item that was queued, on the
+ * JS thread inside a TopLevelScope and a HandleScope of its own, or with cancelled set when the
+ * isolate went away first (from whichever thread closed it; no V8 then).
+ * It owns the item from there on. */
+struct DispatchItem {
+    DispatchItem *next;
+    void (*run)(DispatchItem *item, bool cancelled);
+};
+
+struct Dispatcher;
+struct IsolateData;
+
+/* On the JS thread */
+Dispatcher *DispatcherNew(IsolateData *data);
+/* Cancels whatever is still queued. The dispatcher itself stays around
+ * for threads that still hold it; pushes simply fail from then on. */
+void DispatcherClose(Dispatcher *dispatcher);
+
+bool DispatcherIsJSThread(Dispatcher *dispatcher);
+
+/* Any thread. Returns false, without calling run(), when the dispatcher
+ * is closed. */
+bool DispatchPush(Dispatcher *dispatcher, DispatchItem *item);
+
+/* Pushes the item and blocks until it ran. Returns false when it was
+ * cancelled or could not be queued. Deadlocks if the JS thread is itself
+ * waiting for the caller, so it is only used when a result is needed. */
+bool DispatchAndWait(Dispatcher *dispatcher, DispatchItem *item);
+
+};
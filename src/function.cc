@@ -1,253 +1,1644 @@
 
 #include "function.h"
+#include "dispatch.h"
 #include "value.h"
 #include "gobject.h"
+#include "isolate.h"
+#include "trace.h"
 
 #include <girffi.h>
+#include <string.h>
+#include <uv.h>
 
 using namespace v8;
 
 namespace GNodeJS {
 
-struct FunctionInfo {
-    GIFunctionInfo *info;
-    GIFunctionInvoker invoker;
-};
+struct CallbackPlan;
 
 struct Parameter {
     enum {
-        NORMAL, ARRAY, SKIP,
+        NORMAL, ARRAY, CALLBACK, SKIP,
     } type;
+
+    GIDirection direction;
+    GITransfer transfer;
+    GITypeTag type_tag;
+    bool may_be_null;
+    bool caller_allocates;
+    int array_length_idx;
+
+    GITypeInfo *type_info;
+
+    /* For GI_TYPE_TAG_INTERFACE arguments, the interface is resolved up
+     * front so the invoker can hand it straight to the GIBaseInfo
+     * converter instead of looking it up on every call. */
+    GIBaseInfo *interface_info;
+
+    /* For CALLBACK arguments: where the user data and destroy notify go,
+     * if anywhere, and the shared plan for calling back into JS. */
+    GIScopeType scope;
+    int closure_idx;
+    int destroy_idx;
+    CallbackPlan *callback_plan;
 };
 
-static void FunctionInvoker(const FunctionCallbackInfo<Value> &args) {
-    Isolate *isolate = args.GetIsolate();
-    FunctionInfo *func = (FunctionInfo *) External::Cast (*args.Data ())->Value ();
+static void ParameterInit(Parameter *param, GIArgInfo *arg_info) {
+    param->type = Parameter::NORMAL;
+    param->direction = g_arg_info_get_direction (arg_info);
+    param->transfer = g_arg_info_get_ownership_transfer (arg_info);
+    param->may_be_null = g_arg_info_may_be_null (arg_info);
+    param->caller_allocates = g_arg_info_is_caller_allocates (arg_info);
+    param->type_info = g_arg_info_get_type (arg_info);
+    param->type_tag = g_type_info_get_tag (param->type_info);
+    param->array_length_idx = g_type_info_get_array_length (param->type_info);
+    param->interface_info = NULL;
+    param->closure_idx = g_arg_info_get_closure (arg_info);
+    param->destroy_idx = g_arg_info_get_destroy (arg_info);
+    param->scope = g_arg_info_get_scope (arg_info);
+    param->callback_plan = NULL;
 
-    GIBaseInfo *info = func->info;
-    GError *error = NULL;
+    if (param->type_tag == GI_TYPE_TAG_INTERFACE) {
+        param->interface_info = g_type_info_get_interface (param->type_info);
+        if (g_base_info_get_type (param->interface_info) == GI_INFO_TYPE_CALLBACK &&
+            param->direction == GI_DIRECTION_IN)
+            param->type = Parameter::CALLBACK;
+    }
+}
+
+static void ParameterClear(Parameter *param) {
+    g_base_info_unref (param->type_info);
+    if (param->interface_info)
+        g_base_info_unref (param->interface_info);
+}
+
+/* Marks the arguments that JS never sees: array lengths, and the user
+ * data and destroy notify of callbacks. These may point backwards as
+ * well as forwards, so it is done in a second pass. */
+static void ParametersMarkSkipped(Parameter *parameters, int n_parameters, int return_array_length_idx) {
+    for (int i = 0; i < n_parameters; i++) {
+        Parameter *param = &parameters[i];
+        if (param->array_length_idx >= 0) {
+            if (param->type != Parameter::SKIP)
+                param->type = Parameter::ARRAY;
+            parameters[param->array_length_idx].type = Parameter::SKIP;
+        }
+
+        if (param->type == Parameter::CALLBACK) {
+            if (param->closure_idx >= 0)
+                parameters[param->closure_idx].type = Parameter::SKIP;
+            if (param->destroy_idx >= 0)
+                parameters[param->destroy_idx].type = Parameter::SKIP;
+        }
+    }
+    if (return_array_length_idx >= 0)
+        parameters[return_array_length_idx].type = Parameter::SKIP;
+}
+
+static long GetArrayLength(Parameter *param, GIArgument *arg);
+
+/* Calling JS from C. Every callback type (GCompareFunc,
+ * GAsyncReadyCallback, ...) gets one CallbackPlan with its arguments
+ * read from the typelib, shared by all functions that take it. Each
+ * JS function passed as a callback is bound to a Trampoline, which owns
+ * an ffi_closure. Trampolines are returned to their plan's pool once
+ * their scope ends, so that a comparator passed to a sort function on
+ * every call reuses the same closure instead of allocating one. */
+struct Trampoline {
+    CallbackPlan *plan;
+    Trampoline *next_free;
+
+    ffi_cif cif;
+    ffi_closure *closure;
+
+    Isolate *isolate;
+    Persistent<Function> fn;
+    /* Current when the callback was handed out; entered for every call,
+     * since calls from the main loop have none */
+    Persistent<Context> context;
+    GIScopeType scope;
+};
+
+struct CallbackPlan {
+    GICallableInfo *info;
+    char *name;
+    /* NULL once the isolate is gone while trampolines were still out */
+    IsolateData *isolate_data;
+    /* Of that isolate; outlives it */
+    Dispatcher *dispatcher;
+
+    int n_args;
+    Parameter *parameters;
+    GITypeInfo *return_type;
+    GITransfer return_transfer;
+    bool may_return_null;
+
+    Trampoline *free_trampolines;
+    int n_free_trampolines;
+    /* Trampolines handed out and not yet released */
+    int n_live_trampolines;
+};
+
+/* Idle trampolines kept per callback type */
+#define MAX_FREE_TRAMPOLINES 16
 
-    int n_callable_args = g_callable_info_get_n_args ((GICallableInfo *) info);
-    int n_total_args = n_callable_args;
-    int n_in_args = 0;
+/* Plans are kept per isolate, in IsolateData.callback_plans, and live
+ * as long as it. Callbacks can only run JS on that isolate's thread. */
+static CallbackPlan *CallbackPlanGet(IsolateData *isolate_data, GICallableInfo *info) {
+    char *name = g_strdup_printf ("%s.%s", g_base_info_get_namespace (info), g_base_info_get_name (info));
 
-    Parameter call_parameters[n_callable_args];
+    if (isolate_data->callback_plans == NULL)
+        isolate_data->callback_plans = g_hash_table_new (g_str_hash, g_str_equal);
 
-    for (int i = 0; i < n_callable_args; i++) {
+    CallbackPlan *plan = (CallbackPlan *) g_hash_table_lookup (isolate_data->callback_plans, name);
+    if (plan) {
+        g_free (name);
+        return plan;
+    }
+
+    plan = g_new0 (CallbackPlan, 1);
+    plan->info = g_base_info_ref (info);
+    plan->name = name;
+    plan->isolate_data = isolate_data;
+    plan->dispatcher = isolate_data->dispatcher;
+    plan->return_type = g_callable_info_get_return_type (info);
+    plan->return_transfer = g_callable_info_get_caller_owns (info);
+    plan->may_return_null = g_callable_info_may_return_null (info);
+
+    plan->n_args = g_callable_info_get_n_args (info);
+    plan->parameters = g_new0 (Parameter, plan->n_args);
+    for (int i = 0; i < plan->n_args; i++) {
         GIArgInfo arg_info;
-        g_callable_info_load_arg ((GICallableInfo *) info, i, &arg_info);
+        g_callable_info_load_arg (info, i, &arg_info);
+        ParameterInit (&plan->parameters[i], &arg_info);
+    }
+
+    ParametersMarkSkipped (plan->parameters, plan->n_args, g_type_info_get_array_length (plan->return_type));
+
+    /* The user data pointer means nothing to JS; it is marked as its
+     * own closure. Other gpointers are real arguments, like the items
+     * of a GCompareFunc. */
+    for (int i = 0; i < plan->n_args; i++) {
+        Parameter *param = &plan->parameters[i];
+        if (param->closure_idx == i)
+            param->type = Parameter::SKIP;
+    }
+
+    g_hash_table_insert (isolate_data->callback_plans, plan->name, plan);
+    return plan;
+}
+
+static void CallbackPlanFree(CallbackPlan *plan) {
+    for (int i = 0; i < plan->n_args; i++)
+        ParameterClear (&plan->parameters[i]);
+    g_free (plan->parameters);
+    g_base_info_unref (plan->return_type);
+    g_base_info_unref (plan->info);
+    g_free (plan->name);
+    g_free (plan);
+}
+
+/* libffi wants integer return values widened to a full register. */
+static void StoreFFIReturn(GITypeInfo *type_info, GIArgument *arg, void *result) {
+    GITypeTag tag = g_type_info_get_tag (type_info);
+
+    if (g_type_info_is_pointer (type_info)) {
+        *(gpointer *) result = arg->v_pointer;
+        return;
+    }
+
+    switch (tag) {
+    case GI_TYPE_TAG_VOID:
+        break;
+    case GI_TYPE_TAG_BOOLEAN:
+        *(ffi_sarg *) result = arg->v_boolean;
+        break;
+    case GI_TYPE_TAG_INT8:
+        *(ffi_sarg *) result = arg->v_int8;
+        break;
+    case GI_TYPE_TAG_UINT8:
+        *(ffi_arg *) result = arg->v_uint8;
+        break;
+    case GI_TYPE_TAG_INT16:
+        *(ffi_sarg *) result = arg->v_int16;
+        break;
+    case GI_TYPE_TAG_UINT16:
+        *(ffi_arg *) result = arg->v_uint16;
+        break;
+    case GI_TYPE_TAG_INT32:
+        *(ffi_sarg *) result = arg->v_int32;
+        break;
+    case GI_TYPE_TAG_UINT32:
+    case GI_TYPE_TAG_UNICHAR:
+        *(ffi_arg *) result = arg->v_uint32;
+        break;
+    case GI_TYPE_TAG_INT64:
+        *(gint64 *) result = arg->v_int64;
+        break;
+    case GI_TYPE_TAG_UINT64:
+        *(guint64 *) result = arg->v_uint64;
+        break;
+    case GI_TYPE_TAG_FLOAT:
+        *(gfloat *) result = arg->v_float;
+        break;
+    case GI_TYPE_TAG_DOUBLE:
+        *(gdouble *) result = arg->v_double;
+        break;
+    case GI_TYPE_TAG_GTYPE:
+        *(GType *) result = arg->v_size;
+        break;
+    case GI_TYPE_TAG_INTERFACE:
+        /* Enums and flags; everything else is a pointer. */
+        *(ffi_sarg *) result = arg->v_int32;
+        break;
+    default:
+        *(gpointer *) result = arg->v_pointer;
+        break;
+    }
+}
+
+static void TrampolineRelease(Trampoline *trampoline) {
+    CallbackPlan *plan = trampoline->plan;
+    /* Handles of an isolate that is gone are left alone. */
+    if (plan->isolate_data) {
+        trampoline->fn.Reset ();
+        trampoline->context.Reset ();
+    }
+    plan->n_live_trampolines--;
+
+    if (plan->isolate_data == NULL || plan->n_free_trampolines >= MAX_FREE_TRAMPOLINES) {
+        g_callable_info_free_closure (plan->info, trampoline->closure);
+        delete trampoline;
+        return;
+    }
+
+    trampoline->next_free = plan->free_trampolines;
+    plan->free_trampolines = trampoline;
+    plan->n_free_trampolines++;
+}
+
+/* Release of a trampoline whose destroy notify came from another thread */
+struct TrampolineReleaseItem {
+    DispatchItem base;
+    Trampoline *trampoline;
+};
+
+static void TrampolineReleaseRun(DispatchItem *item, bool cancelled) {
+    TrampolineReleaseItem *release = (TrampolineReleaseItem *) item;
+    /* A cancelled one is left behind with its isolate. */
+    if (!cancelled)
+        TrampolineRelease (release->trampoline);
+    delete release;
+}
+
+static void TrampolineDestroyNotify(gpointer data) {
+    Trampoline *trampoline = (Trampoline *) data;
+
+    if (!DispatcherIsJSThread (trampoline->plan->dispatcher)) {
+        TrampolineReleaseItem *release = new TrampolineReleaseItem ();
+        release->base.run = TrampolineReleaseRun;
+        release->trampoline = trampoline;
+        if (!DispatchPush (trampoline->plan->dispatcher, &release->base))
+            delete release;
+        return;
+    }
+
+    TrampolineRelease (trampoline);
+}
+
+static void TrampolineInvoke(Trampoline *trampoline, void *result, void **args) {
+    CallbackPlan *plan = trampoline->plan;
+    Isolate *isolate = trampoline->isolate;
+
+    HandleScope scope (isolate);
+    Local<Context> context = Local<Context>::New (isolate, trampoline->context);
+    Context::Scope context_scope (context);
+
+    #ifndef __linux__
+        Local<Value>* argv = new Local<Value>[plan->n_args];
+    #else
+        Local<Value> argv[plan->n_args];
+    #endif
+    int argc = 0;
+
+    for (int i = 0; i < plan->n_args; i++) {
+        Parameter *param = &plan->parameters[i];
+        if (param->type == Parameter::SKIP)
+            continue;
+
+        /* Out arguments of callbacks are not supported yet. */
+        if (param->direction != GI_DIRECTION_IN) {
+            argv[argc++] = Undefined (isolate);
+            continue;
+        }
+
+        long length = -1;
+        if (param->array_length_idx >= 0)
+            length = GetArrayLength (&plan->parameters[param->array_length_idx], (GIArgument *) args[param->array_length_idx]);
+
+        argv[argc++] = GIArgumentToV8 (isolate, param->type_info, (GIArgument *) args[i], length, param->transfer);
+    }
+
+    Local<Function> fn = Local<Function>::New (isolate, trampoline->fn);
+    Local<Object> this_obj = context->Global ();
+
+    TryCatch try_catch;
+    Local<Value> return_value = fn->Call (this_obj, argc, argv);
+
+    #ifndef __linux__
+        delete[] argv;
+    #endif
+
+    /* Empty after an exception, including one still pending from an
+     * earlier invocation during the same call. */
+    GIArgument return_arg;
+    return_arg.v_uint64 = 0;
+    if (!return_value.IsEmpty () && g_type_info_get_tag (plan->return_type) != GI_TYPE_TAG_VOID)
+        V8ToGIArgument (isolate, plan->return_type, &return_arg, return_value, plan->may_return_null);
+    StoreFFIReturn (plan->return_type, &return_arg, result);
+
+    GIScopeType scope_type = trampoline->scope;
+    if (scope_type == GI_SCOPE_TYPE_ASYNC)
+        TrampolineRelease (trampoline);
+
+    /* Call-scoped callbacks run inside a JS call, so the exception can
+     * simply continue to the caller once the native function returns.
+     * Anything else was called from the main loop. */
+    if (try_catch.HasCaught ()) {
+        if (scope_type == GI_SCOPE_TYPE_CALL)
+            try_catch.ReThrow ();
+        else
+            node::FatalException (isolate, try_catch);
+    }
+}
+
+/* A call from another thread, run on the JS thread while the caller
+ * waits. The arguments stay valid meanwhile, so they are not copied. */
+struct TrampolineCallItem {
+    DispatchItem base;
+    Trampoline *trampoline;
+    void *result;
+    void **args;
+};
+
+static void TrampolineCallRun(DispatchItem *item, bool cancelled) {
+    TrampolineCallItem *call = (TrampolineCallItem *) item;
+    if (!cancelled)
+        TrampolineInvoke (call->trampoline, call->result, call->args);
+}
+
+static void TrampolineCall(ffi_cif *cif, void *result, void **args, void *data) {
+    Trampoline *trampoline = (Trampoline *) data;
+    CallbackPlan *plan = trampoline->plan;
+
+    if (DispatcherIsJSThread (plan->dispatcher)) {
+        if (plan->isolate_data != NULL) {
+            TrampolineInvoke (trampoline, result, args);
+            return;
+        }
+    } else if (trampoline->scope != GI_SCOPE_TYPE_CALL) {
+        /* Call-scoped callbacks are left out: the JS thread is most
+         * likely blocked in the very call that runs them, and waiting
+         * for it would never end. */
+        TrampolineCallItem call;
+        call.base.run = TrampolineCallRun;
+        call.trampoline = trampoline;
+        call.result = result;
+        call.args = args;
+        if (DispatchAndWait (plan->dispatcher, &call.base))
+            return;
+    }
+
+    g_critical ("%s: JS callback invoked from another thread during a call or after its isolate is gone, ignoring it", plan->name);
+    memset (result, 0, MAX (cif->rtype->size, sizeof (ffi_arg)));
+}
+
+static Trampoline *TrampolineAcquire(Isolate *isolate, Parameter *param, Local<Function> fn) {
+    CallbackPlan *plan = param->callback_plan;
+    Trampoline *trampoline = plan->free_trampolines;
+
+    plan->n_live_trampolines++;
+
+    if (trampoline) {
+        plan->free_trampolines = trampoline->next_free;
+        plan->n_free_trampolines--;
+    } else {
+        trampoline = new Trampoline ();
+        trampoline->plan = plan;
+        trampoline->closure = g_callable_info_prepare_closure (plan->info, &trampoline->cif, TrampolineCall, trampoline);
+#if GI_CHECK_VERSION (1, 72, 0)
+        /* The closure itself is writable data; C jumps to this. */
+        TraceRegisterCode (g_callable_info_get_closure_native_address (plan->info, trampoline->closure),
+                           FFI_TRAMPOLINE_SIZE, plan->name);
+#endif
+    }
+
+    trampoline->isolate = isolate;
+    trampoline->fn.Reset (isolate, fn);
+    trampoline->context.Reset (isolate, isolate->GetCurrentContext ());
+    /* Whoever takes a destroy notify will call it, whatever the scope. */
+    trampoline->scope = param->destroy_idx >= 0 ? GI_SCOPE_TYPE_NOTIFIED : param->scope;
+    return trampoline;
+}
+
+/* FunctionInfo holds the call plan for a function: everything the
+ * invoker needs to know about the arguments is read from the typelib
+ * once, on the first call, and never changes afterwards. Deferring it
+ * keeps building whole classes cheap, since most methods are never
+ * called. */
+struct FunctionInfo {
+    GIFunctionInfo *info;
+    /* Of the isolate the function was made in */
+    IsolateData *isolate_data;
+    GIFunctionInvoker invoker;
+    bool prepared;
+
+    int n_callable_args;
+    int n_total_args;
+    int n_in_args;
+    int n_out_args;
+    bool is_method;
+    bool can_throw;
+    bool has_callbacks;
 
-        GITypeInfo type_info;
-        g_arg_info_load_type (&arg_info, &type_info);
+    GIBaseInfo *container;
+    GITypeInfo *return_type;
+    GITransfer return_transfer;
+    int return_array_length_idx;
+    bool has_return_value;
+    Parameter *parameters;
 
-        int array_length_idx = g_type_info_get_array_length (&type_info);
-        if (array_length_idx >= 0) {
-            call_parameters[i].type = Parameter::ARRAY;
-            call_parameters[array_length_idx].type = Parameter::SKIP;
+    /* Only set while profiling; see FunctionProfile below. */
+    struct FunctionProfile *profile;
+    /* "Namespace.Container.name", for profiles and traces */
+    char *name;
+
+    /* Held by the function template, its fn.async function, and each
+     * asynchronous call in flight. Only touched on the JS thread. */
+    int ref_count;
+
+    /* fn.async, made on first access; weak, so that it goes once JS
+     * drops it and a later access makes it again. */
+    Persistent<Function> async_function;
+
+    /* For foo_async functions with a matching foo_finish: where the
+     * GAsyncReadyCallback goes, or -1, and the finish function. */
+    int async_ready_idx;
+    struct FunctionInfo *finish;
+};
+
+static FunctionInfo *FunctionInfoNew(IsolateData *isolate_data, GIBaseInfo *info) {
+    FunctionInfo *func = g_new0 (FunctionInfo, 1);
+    func->info = g_base_info_ref (info);
+    func->isolate_data = isolate_data;
+    func->ref_count = 1;
+    func->async_ready_idx = -1;
+    return func;
+}
+
+static void FunctionInfoUnref(FunctionInfo *func);
+
+static const char * FunctionInfoGetName(FunctionInfo *func) {
+    if (func->name)
+        return func->name;
+
+    GIBaseInfo *container = g_base_info_get_container (func->info);
+    if (container)
+        func->name = g_strdup_printf ("%s.%s.%s", g_base_info_get_namespace (func->info),
+                                      g_base_info_get_name (container), g_base_info_get_name (func->info));
+    else
+        func->name = g_strdup_printf ("%s.%s", g_base_info_get_namespace (func->info),
+                                      g_base_info_get_name (func->info));
+    return func->name;
+}
+
+/* The opt-in profiler. Times are in nanoseconds and split into the
+ * three phases of a call: converting the JS arguments (marshal-in), the
+ * native call itself, and converting the results back (marshal-out).
+ * "allocations" counts the buffers the marshaller had to create for the
+ * call: copied strings, arrays and lists, and the out-arguments array. */
+struct FunctionProfile {
+    guint64 calls;
+    guint64 allocations;
+    guint64 in_time, ffi_time, out_time;
+    guint64 in_max, ffi_max, out_max;
+};
+
+struct FunctionProfileSample {
+    guint64 start;
+    guint64 ffi_start;
+    guint64 ffi_end;
+    guint64 allocations;
+};
+
+/* Each isolate profiles on its own; the FunctionInfos that have a
+ * profile are in its IsolateData.profiled_functions. */
+static void FunctionProfileRecord(FunctionInfo *func, FunctionProfileSample *sample, guint64 end) {
+    FunctionProfile *profile = func->profile;
+
+    if (profile == NULL) {
+        IsolateData *isolate_data = func->isolate_data;
+        if (isolate_data->profiled_functions == NULL)
+            isolate_data->profiled_functions = g_ptr_array_new ();
+        profile = func->profile = g_new0 (FunctionProfile, 1);
+        g_ptr_array_add (isolate_data->profiled_functions, func);
+    }
+
+    /* Calls that failed before reaching ffi_call are all marshal-in. */
+    if (sample->ffi_start == 0)
+        sample->ffi_start = sample->ffi_end = end;
+
+    guint64 in_time = sample->ffi_start - sample->start;
+    guint64 ffi_time = sample->ffi_end - sample->ffi_start;
+    guint64 out_time = end - sample->ffi_end;
+
+    profile->calls++;
+    profile->allocations += sample->allocations;
+    profile->in_time += in_time;
+    profile->ffi_time += ffi_time;
+    profile->out_time += out_time;
+    profile->in_max = MAX (profile->in_max, in_time);
+    profile->ffi_max = MAX (profile->ffi_max, ffi_time);
+    profile->out_max = MAX (profile->out_max, out_time);
+}
+
+static void FunctionProfileForget(FunctionInfo *func) {
+    if (func->profile == NULL)
+        return;
+
+    g_ptr_array_remove_fast (func->isolate_data->profiled_functions, func);
+    g_free (func->profile);
+    func->profile = NULL;
+}
+
+void SetFunctionProfilingEnabled(Isolate *isolate, bool enabled) {
+    IsolateData *isolate_data = GetIsolateData (isolate);
+    GPtrArray *profiled_functions = isolate_data->profiled_functions;
+
+    if (profiled_functions) {
+        for (guint i = 0; i < profiled_functions->len; i++) {
+            FunctionInfo *func = (FunctionInfo *) g_ptr_array_index (profiled_functions, i);
+            g_free (func->profile);
+            func->profile = NULL;
+        }
+        g_ptr_array_set_size (profiled_functions, 0);
+    }
+
+    isolate_data->profiling_enabled = enabled;
+}
+
+static Local<Number> NsToMs(Isolate *isolate, guint64 ns) {
+    return Number::New (isolate, ns / 1e6);
+}
+
+Local<Array> GetFunctionProfile(Isolate *isolate) {
+    Local<Array> rows = Array::New (isolate);
+    GPtrArray *profiled_functions = GetIsolateData (isolate)->profiled_functions;
+    if (profiled_functions == NULL)
+        return rows;
+
+    for (guint i = 0; i < profiled_functions->len; i++) {
+        FunctionInfo *func = (FunctionInfo *) g_ptr_array_index (profiled_functions, i);
+        FunctionProfile *profile = func->profile;
+
+        Local<Object> row = Object::New (isolate);
+        row->Set (String::NewFromUtf8 (isolate, "name"), String::NewFromUtf8 (isolate, FunctionInfoGetName (func)));
+        row->Set (String::NewFromUtf8 (isolate, "calls"), Number::New (isolate, profile->calls));
+        row->Set (String::NewFromUtf8 (isolate, "allocations"), Number::New (isolate, profile->allocations));
+        row->Set (String::NewFromUtf8 (isolate, "inTime"), NsToMs (isolate, profile->in_time));
+        row->Set (String::NewFromUtf8 (isolate, "ffiTime"), NsToMs (isolate, profile->ffi_time));
+        row->Set (String::NewFromUtf8 (isolate, "outTime"), NsToMs (isolate, profile->out_time));
+        row->Set (String::NewFromUtf8 (isolate, "inMax"), NsToMs (isolate, profile->in_max));
+        row->Set (String::NewFromUtf8 (isolate, "ffiMax"), NsToMs (isolate, profile->ffi_max));
+        row->Set (String::NewFromUtf8 (isolate, "outMax"), NsToMs (isolate, profile->out_max));
+        rows->Set (i, row);
+    }
+
+    return rows;
+}
+
+static bool IsAsyncReadyCallback(GIBaseInfo *info) {
+    return (strcmp (g_base_info_get_namespace (info), "Gio") == 0 &&
+            strcmp (g_base_info_get_name (info), "AsyncReadyCallback") == 0);
+}
+
+/* Looks up foo_finish next to foo_async: in the same class, interface
+ * or struct, or in the namespace for plain functions. */
+static GIFunctionInfo *FindFinishFunction(GIFunctionInfo *info) {
+    const char *name = g_base_info_get_name (info);
+    if (!g_str_has_suffix (name, "_async"))
+        return NULL;
+
+    char *finish_name = g_strdup_printf ("%.*s_finish", (int) (strlen (name) - strlen ("_async")), name);
+    GIBaseInfo *container = g_base_info_get_container (info);
+    GIFunctionInfo *finish = NULL;
+
+    if (container) {
+        switch (g_base_info_get_type (container)) {
+        case GI_INFO_TYPE_OBJECT:
+            finish = g_object_info_find_method ((GIObjectInfo *) container, finish_name);
+            break;
+        case GI_INFO_TYPE_INTERFACE:
+            finish = g_interface_info_find_method ((GIInterfaceInfo *) container, finish_name);
+            break;
+        case GI_INFO_TYPE_STRUCT:
+            finish = g_struct_info_find_method ((GIStructInfo *) container, finish_name);
+            break;
+        case GI_INFO_TYPE_UNION:
+            finish = g_union_info_find_method ((GIUnionInfo *) container, finish_name);
+            break;
+        default:
+            break;
         }
+    } else {
+        GIBaseInfo *found = g_irepository_find_by_name (NULL, g_base_info_get_namespace (info), finish_name);
+        if (found && g_base_info_get_type (found) == GI_INFO_TYPE_FUNCTION)
+            finish = (GIFunctionInfo *) found;
+        else if (found)
+            g_base_info_unref (found);
     }
 
-    for (int i = 0; i < n_callable_args; i++) {
+    g_free (finish_name);
+    return finish;
+}
+
+static bool FunctionInfoPrepare(FunctionInfo *func, GError **error) {
+    GIFunctionInfo *info = func->info;
+
+    if (!g_function_info_prep_invoker (info, &func->invoker, error))
+        return false;
+
+    GIFunctionInfoFlags flags = g_function_info_get_flags (info);
+    func->is_method = ((flags & GI_FUNCTION_IS_METHOD) != 0 &&
+                       (flags & GI_FUNCTION_IS_CONSTRUCTOR) == 0);
+    func->can_throw = g_callable_info_can_throw_gerror (info);
+    /* Owned like the other infos here, which get_container () alone
+     * would not give. */
+    func->container = func->is_method ? g_base_info_ref (g_base_info_get_container (info)) : NULL;
+    func->return_type = g_callable_info_get_return_type (info);
+    func->return_transfer = g_callable_info_get_caller_owns (info);
+    func->return_array_length_idx = g_type_info_get_array_length (func->return_type);
+    func->has_return_value = (g_type_info_get_tag (func->return_type) != GI_TYPE_TAG_VOID ||
+                              g_type_info_is_pointer (func->return_type));
+
+    func->n_callable_args = g_callable_info_get_n_args (info);
+    func->parameters = g_new0 (Parameter, func->n_callable_args);
+
+    for (int i = 0; i < func->n_callable_args; i++) {
         GIArgInfo arg_info;
+        g_callable_info_load_arg (info, i, &arg_info);
+        ParameterInit (&func->parameters[i], &arg_info);
+    }
+
+    ParametersMarkSkipped (func->parameters, func->n_callable_args, func->return_array_length_idx);
+
+    func->has_callbacks = false;
+    for (int i = 0; i < func->n_callable_args; i++) {
+        Parameter *param = &func->parameters[i];
+        if (param->type == Parameter::CALLBACK) {
+            param->callback_plan = CallbackPlanGet (func->isolate_data, param->interface_info);
+            func->has_callbacks = true;
 
-        if (call_parameters[i].type == Parameter::SKIP)
+            if (func->async_ready_idx < 0 && IsAsyncReadyCallback (param->interface_info)) {
+                GIFunctionInfo *finish_info = FindFinishFunction (info);
+                if (finish_info) {
+                    func->async_ready_idx = i;
+                    func->finish = FunctionInfoNew (func->isolate_data, finish_info);
+                    g_base_info_unref (finish_info);
+                }
+            }
+        }
+    }
+
+    func->n_in_args = 0;
+    func->n_out_args = 0;
+    for (int i = 0; i < func->n_callable_args; i++) {
+        Parameter *param = &func->parameters[i];
+        if (param->type == Parameter::SKIP)
             continue;
+        if (param->direction == GI_DIRECTION_IN || param->direction == GI_DIRECTION_INOUT)
+            func->n_in_args++;
+        if (param->direction == GI_DIRECTION_OUT || param->direction == GI_DIRECTION_INOUT)
+            func->n_out_args++;
+    }
+
+    func->n_total_args = func->n_callable_args;
+    if (func->is_method)
+        func->n_total_args++;
+    if (func->can_throw)
+        func->n_total_args++;
+
+    func->prepared = true;
+    return true;
+}
+
+static void FunctionInfoFree(FunctionInfo *func) {
+    FunctionProfileForget (func);
+    g_free (func->name);
+
+    if (!func->prepared)
+        goto out;
+
+    for (int i = 0; i < func->n_callable_args; i++)
+        ParameterClear (&func->parameters[i]);
+    g_free (func->parameters);
+
+    if (func->container)
+        g_base_info_unref (func->container);
+    g_base_info_unref (func->return_type);
+
+    if (func->finish)
+        FunctionInfoUnref (func->finish);
 
-        g_callable_info_load_arg ((GICallableInfo *) info, i, &arg_info);
+    g_function_invoker_destroy (&func->invoker);
+
+ out:
+    g_base_info_unref (func->info);
+    g_free (func);
+}
+
+static FunctionInfo *FunctionInfoRef(FunctionInfo *func) {
+    func->ref_count++;
+    return func;
+}
 
-        if (g_arg_info_get_direction (&arg_info) == GI_DIRECTION_IN ||
-            g_arg_info_get_direction (&arg_info) == GI_DIRECTION_INOUT)
-            n_in_args++;
+static void FunctionInfoUnref(FunctionInfo *func) {
+    if (--func->ref_count == 0)
+        FunctionInfoFree (func);
+}
+
+/* Returns true if the argument borrows the JS value's memory, in which
+ * case it must not be freed after the call. Typed arrays are always
+ * copied unless allow_borrow is set. */
+static bool V8ToParameter(Isolate *isolate, Parameter *param, GIArgument *arg, Local<Value> value,
+                          size_t *length_p = NULL, bool allow_borrow = true) {
+    if (param->type_tag == GI_TYPE_TAG_ARRAY &&
+        param->direction == GI_DIRECTION_IN &&
+        param->transfer == GI_TRANSFER_NOTHING) {
+        bool borrowed = false;
+        if (V8TypedArrayToGIArgument (param->type_info, arg, value, length_p, allow_borrow ? &borrowed : NULL))
+            return borrowed;
     }
 
-    if (args.Length() < n_in_args) {
-        isolate->ThrowException (Exception::TypeError (String::NewFromUtf8 (isolate, "Not enough arguments.")));
-        return;
+    if (param->interface_info && !value->IsNull () && !value->IsUndefined ()) {
+        V8ToGIArgument (isolate, param->interface_info, arg, value);
+
+        /* The callee takes over a boxed passed with full transfer, but
+         * the wrapper still owns its memory; give the callee a copy. */
+        GIInfoType type = g_base_info_get_type (param->interface_info);
+        if (param->direction == GI_DIRECTION_IN &&
+            param->transfer == GI_TRANSFER_EVERYTHING &&
+            (type == GI_INFO_TYPE_STRUCT || type == GI_INFO_TYPE_UNION || type == GI_INFO_TYPE_BOXED) &&
+            arg->v_pointer != NULL) {
+            GType gtype = g_registered_type_info_get_g_type ((GIRegisteredTypeInfo *) param->interface_info);
+            if (gtype != G_TYPE_NONE)
+                arg->v_pointer = g_boxed_copy (gtype, arg->v_pointer);
+        }
+    } else
+        V8ToGIArgument (isolate, param->type_info, arg, value, param->may_be_null, length_p);
+
+    return false;
+}
+
+static long GetArrayLength(Parameter *param, GIArgument *arg) {
+    switch (param->type_tag) {
+    case GI_TYPE_TAG_INT8:
+        return arg->v_int8;
+    case GI_TYPE_TAG_UINT8:
+        return arg->v_uint8;
+    case GI_TYPE_TAG_INT16:
+        return arg->v_int16;
+    case GI_TYPE_TAG_UINT16:
+        return arg->v_uint16;
+    case GI_TYPE_TAG_INT32:
+        return arg->v_int32;
+    case GI_TYPE_TAG_UINT32:
+        return arg->v_uint32;
+    case GI_TYPE_TAG_INT64:
+        return arg->v_int64;
+    case GI_TYPE_TAG_UINT64:
+        return arg->v_uint64;
+    default:
+        g_assert_not_reached ();
     }
+}
 
-    gboolean is_method = ((g_function_info_get_flags (info) & GI_FUNCTION_IS_METHOD) != 0 &&
-                          (g_function_info_get_flags (info) & GI_FUNCTION_IS_CONSTRUCTOR) == 0);
-    if (is_method)
-        n_total_args++;
+/* In arguments are passed by value; everything else lives in out_values
+ * and the callee gets a pointer to it. */
+static GIArgument * GetArgumentSlot(FunctionInfo *func, int i, GIArgument *callable_values, GIArgument *out_values) {
+    if (func->parameters[i].direction == GI_DIRECTION_IN)
+        return &callable_values[i];
+    else
+        return &out_values[i];
+}
 
-    gboolean can_throw = g_callable_info_can_throw_gerror (info);
-    if (can_throw)
-        n_total_args++;
+static long GetArrayLength(FunctionInfo *func, int length_idx, GIArgument *callable_values, GIArgument *out_values) {
+    GIArgument *arg = GetArgumentSlot (func, length_idx, callable_values, out_values);
+    return GetArrayLength (&func->parameters[length_idx], arg);
+}
+
+/* Whether the marshaller has to make a copy of this argument. */
+static bool ParameterAllocates(Parameter *param) {
+    switch (param->type_tag) {
+    case GI_TYPE_TAG_UTF8:
+    case GI_TYPE_TAG_FILENAME:
+    case GI_TYPE_TAG_ARRAY:
+    case GI_TYPE_TAG_GLIST:
+    case GI_TYPE_TAG_GSLIST:
+    case GI_TYPE_TAG_GHASH:
+        return true;
+    default:
+        return false;
+    }
+}
 
-    GIArgument total_arg_values[n_total_args];
+/* Storage for one invocation. Synchronous calls keep it on the stack,
+ * asynchronous ones on the heap until the worker is done. */
+struct CallFrame {
+    GIArgument *total_arg_values;
     GIArgument *callable_arg_values;
+    /* Storage for out and inout arguments; the callee gets a pointer. */
+    GIArgument *out_arg_values;
+    bool *borrowed;
+    /* Call-scoped trampolines, released once the call returns */
+    Trampoline **trampolines;
+    /* Set when foo_async was called without a callback */
+    struct AsyncReadyPromise *promise;
+    void **ffi_arg_pointers;
+    GIArgument return_value;
+    GError *error;
+};
+
+static void CallFrameInvoke(FunctionInfo *func, CallFrame *frame, FunctionProfileSample *sample);
+static Local<Value> CallFrameMarshalOut(Isolate *isolate, FunctionInfo *func, CallFrame *frame,
+                                        FunctionProfileSample *sample);
+
+static bool FunctionInfoEnsurePrepared(Isolate *isolate, FunctionInfo *func) {
+    GError *error = NULL;
+
+    if (func->prepared || FunctionInfoPrepare (func, &error))
+        return true;
 
-    if (is_method) {
-        GIBaseInfo *container = g_base_info_get_container (func->info);
-        V8ToGIArgument (isolate, container, &total_arg_values[0], args.This ());
-        callable_arg_values = &total_arg_values[1];
+    isolate->ThrowException (Exception::Error (String::NewFromUtf8 (isolate, error->message)));
+    g_error_free (error);
+    return false;
+}
+
+static Local<Value> GErrorToV8(Isolate *isolate, GError *error) {
+    return Exception::TypeError (String::NewFromUtf8 (isolate, error->message));
+}
+
+/* Calls foo_finish with the source object and result handed to the
+ * GAsyncReadyCallback of foo_async. The finish function's other in
+ * arguments, if any, are passed as zero. */
+static Local<Value> CallFinish(Isolate *isolate, FunctionInfo *func, GObject *source, GAsyncResult *result, GError **error) {
+    GIArgument total_arg_values[func->n_total_args];
+    GIArgument out_arg_values[func->n_callable_args];
+    void *ffi_arg_pointers[func->n_total_args];
+
+    CallFrame frame = {};
+    frame.total_arg_values = total_arg_values;
+    frame.out_arg_values = out_arg_values;
+    frame.ffi_arg_pointers = ffi_arg_pointers;
+
+    if (func->is_method) {
+        total_arg_values[0].v_pointer = source;
+        frame.callable_arg_values = &total_arg_values[1];
     } else {
-        callable_arg_values = &total_arg_values[0];
+        frame.callable_arg_values = &total_arg_values[0];
+    }
+
+    bool result_set = false;
+    int i = 0;
+    for (; i < func->n_callable_args; i++) {
+        Parameter *param = &func->parameters[i];
+
+        if (param->direction != GI_DIRECTION_IN) {
+            frame.callable_arg_values[i].v_pointer = &out_arg_values[i];
+            out_arg_values[i].v_uint64 = 0;
+        } else if (!result_set && param->type_tag == GI_TYPE_TAG_INTERFACE) {
+            frame.callable_arg_values[i].v_pointer = result;
+            result_set = true;
+        } else {
+            frame.callable_arg_values[i].v_uint64 = 0;
+        }
     }
 
-    int in_arg = 0, i = 0;
-    for (; i < n_callable_args; i++) {
-        if (call_parameters[i].type == Parameter::SKIP)
+    if (func->can_throw)
+        frame.callable_arg_values[i].v_pointer = &frame.error;
+
+    for (int i = 0; i < func->n_total_args; i++)
+        ffi_arg_pointers[i] = &total_arg_values[i];
+
+    CallFrameInvoke (func, &frame, NULL);
+
+    if (frame.error) {
+        g_propagate_error (error, frame.error);
+        return Local<Value> ();
+    }
+
+    return CallFrameMarshalOut (isolate, func, &frame, NULL);
+}
+
+/* Calling foo_async without its callback returns a Promise, settled
+ * with what foo_finish returns. GIO always completes from a main loop,
+ * never before foo_async has returned. */
+struct AsyncReadyPromise {
+    Isolate *isolate;
+    /* Of that isolate, which outlives it */
+    Dispatcher *dispatcher;
+    FunctionInfo *finish;
+    Persistent<Context> context;
+    Persistent<Promise::Resolver> resolver;
+};
+
+static AsyncReadyPromise *AsyncReadyPromiseNew(Isolate *isolate, FunctionInfo *finish) {
+    AsyncReadyPromise *promise = new AsyncReadyPromise ();
+    promise->isolate = isolate;
+    promise->dispatcher = GetIsolateData (isolate)->dispatcher;
+    promise->finish = FunctionInfoRef (finish);
+    promise->context.Reset (isolate, isolate->GetCurrentContext ());
+    promise->resolver.Reset (isolate, Promise::Resolver::New (isolate));
+    return promise;
+}
+
+static void AsyncReadyPromiseFree(AsyncReadyPromise *promise) {
+    promise->context.Reset ();
+    promise->resolver.Reset ();
+    FunctionInfoUnref (promise->finish);
+    delete promise;
+}
+
+static void AsyncReadyPromiseSettle(AsyncReadyPromise *promise, GObject *source, GAsyncResult *result) {
+    Isolate *isolate = promise->isolate;
+    FunctionInfo *finish = promise->finish;
+    HandleScope scope (isolate);
+
+    Local<Context> context = Local<Context>::New (isolate, promise->context);
+    Context::Scope context_scope (context);
+    Local<Promise::Resolver> resolver = Local<Promise::Resolver>::New (isolate, promise->resolver);
+
+    GError *error = NULL;
+
+    if (!finish->prepared && !FunctionInfoPrepare (finish, &error)) {
+        resolver->Reject (Exception::Error (String::NewFromUtf8 (isolate, error->message)));
+        g_error_free (error);
+    } else {
+        TryCatch try_catch;
+        Local<Value> value = CallFinish (isolate, finish, source, result, &error);
+
+        if (error) {
+            resolver->Reject (GErrorToV8 (isolate, error));
+            g_error_free (error);
+        } else if (try_catch.HasCaught ()) {
+            resolver->Reject (try_catch.Exception ());
+        } else {
+            resolver->Resolve (value);
+        }
+    }
+
+    AsyncReadyPromiseFree (promise);
+
+    /* We are not called from JS, so nobody else will run the reactions. */
+    isolate->RunMicrotasks ();
+}
+
+/* A completion on another thread than the Promise's: the default main
+ * context only runs on the main thread, while foo_async may have been
+ * called from a worker. */
+struct AsyncReadyItem {
+    DispatchItem base;
+    AsyncReadyPromise *promise;
+    GObject *source;
+    GAsyncResult *result;
+};
+
+static void AsyncReadyItemRun(DispatchItem *item, bool cancelled) {
+    AsyncReadyItem *ready = (AsyncReadyItem *) item;
+
+    /* With the isolate gone, so are the promise's handles. */
+    if (!cancelled)
+        AsyncReadyPromiseSettle (ready->promise, ready->source, ready->result);
+
+    if (ready->source)
+        g_object_unref (ready->source);
+    g_object_unref (ready->result);
+    delete ready;
+}
+
+static void AsyncReadyPromiseCallback(GObject *source, GAsyncResult *result, gpointer user_data) {
+    AsyncReadyPromise *promise = (AsyncReadyPromise *) user_data;
+    Dispatcher *dispatcher = promise->dispatcher;
+
+    if (DispatcherIsJSThread (dispatcher)) {
+        AsyncReadyPromiseSettle (promise, source, result);
+        return;
+    }
+
+    AsyncReadyItem *ready = new AsyncReadyItem ();
+    ready->base.run = AsyncReadyItemRun;
+    ready->promise = promise;
+    ready->source = source ? (GObject *) g_object_ref (source) : NULL;
+    ready->result = (GAsyncResult *) g_object_ref (result);
+
+    if (!DispatchPush (dispatcher, &ready->base))
+        AsyncReadyItemRun (&ready->base, true);
+}
+
+static bool CallFrameMarshalCallback(Isolate *isolate, FunctionInfo *func, CallFrame *frame, int i, Local<Value> value) {
+    Parameter *param = &func->parameters[i];
+    Trampoline *trampoline = NULL;
+
+    if (i == func->async_ready_idx && value->IsUndefined ()) {
+        frame->promise = AsyncReadyPromiseNew (isolate, func->finish);
+        frame->callable_arg_values[i].v_pointer = (gpointer) AsyncReadyPromiseCallback;
+        if (param->closure_idx >= 0)
+            frame->callable_arg_values[param->closure_idx].v_pointer = frame->promise;
+        if (param->destroy_idx >= 0)
+            frame->callable_arg_values[param->destroy_idx].v_pointer = NULL;
+        return true;
+    }
+
+    if (value->IsFunction ()) {
+        trampoline = TrampolineAcquire (isolate, param, Local<Function>::Cast (value));
+    } else if (!param->may_be_null || !(value->IsNull () || value->IsUndefined ())) {
+        isolate->ThrowException (Exception::TypeError (String::NewFromUtf8 (isolate, "Expected a function.")));
+        return false;
+    }
+
+    frame->callable_arg_values[i].v_pointer = trampoline ? trampoline->closure : NULL;
+
+    if (param->closure_idx >= 0)
+        frame->callable_arg_values[param->closure_idx].v_pointer = trampoline;
+    if (param->destroy_idx >= 0)
+        frame->callable_arg_values[param->destroy_idx].v_pointer = trampoline ? (gpointer) TrampolineDestroyNotify : NULL;
+
+    /* All of them, in case a later argument fails; only call-scoped
+     * ones are released after the call. */
+    frame->trampolines[i] = trampoline;
+
+    return true;
+}
+
+/* Releases what CallFrameMarshalIn made of the first n_args arguments
+ * when it fails partway. Unlike after a call, trampolines of any scope
+ * go, and strings and arrays whatever their transfer: C never saw them. */
+static void CallFrameFreeMarshalled(FunctionInfo *func, CallFrame *frame, int n_args) {
+    for (int i = 0; i < n_args; i++) {
+        Parameter *param = &func->parameters[i];
+
+        if (param->type == Parameter::CALLBACK) {
+            if (frame->trampolines[i])
+                TrampolineRelease (frame->trampolines[i]);
             continue;
+        }
+
+        if (param->direction == GI_DIRECTION_IN && param->type != Parameter::SKIP && !frame->borrowed[i])
+            FreeGIArgument (param->type_info, &frame->callable_arg_values[i]);
+    }
+}
+
+/* Converts self and args[first_arg..] into the frame. Typed arrays may
+ * only lend their memory to the call if allow_borrow is set. sample is
+ * NULL unless profiling or tracing is enabled. */
+static bool CallFrameMarshalIn(Isolate *isolate, FunctionInfo *func, CallFrame *frame,
+                               Local<Value> self, const FunctionCallbackInfo<Value> &args, int first_arg,
+                               bool allow_borrow, FunctionProfileSample *sample) {
+    /* Set before any early return; callers check them on failure. */
+    frame->error = NULL;
+    frame->promise = NULL;
+
+    /* The callback of foo_async may be left out to get a Promise. */
+    int n_required_args = func->async_ready_idx >= 0 ? func->n_in_args - 1 : func->n_in_args;
+
+    if (args.Length() - first_arg < n_required_args) {
+        isolate->ThrowException (Exception::TypeError (String::NewFromUtf8 (isolate, "Not enough arguments.")));
+        return false;
+    }
+
+    GIArgument *callable_arg_values;
+    GIArgument *out_arg_values = frame->out_arg_values;
+    TryCatch try_catch;
+
+    if (func->is_method) {
+        V8ToGIArgument (isolate, func->container, &frame->total_arg_values[0], self);
+        callable_arg_values = &frame->total_arg_values[1];
+    } else {
+        callable_arg_values = &frame->total_arg_values[0];
+    }
+    frame->callable_arg_values = callable_arg_values;
+
+    if (try_catch.HasCaught ()) {
+        try_catch.ReThrow ();
+        return false;
+    }
+
+    int in_arg = first_arg, i = 0;
+    for (; i < func->n_callable_args; i++) {
+        Parameter *param = &func->parameters[i];
+        frame->borrowed[i] = false;
+        frame->trampolines[i] = NULL;
 
-        GIArgInfo arg_info = {};
-        g_callable_info_load_arg ((GICallableInfo *) info, i, &arg_info);
-        GIDirection direction = g_arg_info_get_direction (&arg_info);
+        if (param->direction != GI_DIRECTION_IN)
+            callable_arg_values[i].v_pointer = &out_arg_values[i];
 
-        if (direction == GI_DIRECTION_OUT) {
-            if (g_arg_info_is_caller_allocates (&arg_info)) {
+        if (param->direction == GI_DIRECTION_OUT) {
+            if (param->caller_allocates)
                 assert (0);
-            } else {
-                callable_arg_values[i].v_pointer = NULL;
+            out_arg_values[i].v_uint64 = 0;
+            continue;
+        }
+
+        if (param->type == Parameter::SKIP)
+            continue;
+
+        GIArgument *arg = GetArgumentSlot (func, i, callable_arg_values, out_arg_values);
+
+        if (param->type == Parameter::CALLBACK) {
+            if (!CallFrameMarshalCallback (isolate, func, frame, i, args[in_arg])) {
+                CallFrameFreeMarshalled (func, frame, i);
+                try_catch.ReThrow ();
+                return false;
             }
+        } else if (param->type == Parameter::ARRAY) {
+            size_t array_length;
+            frame->borrowed[i] = V8ToParameter (isolate, param, arg, args[in_arg], &array_length, allow_borrow);
+
+            int length_idx = param->array_length_idx;
+            Parameter *length_param = &func->parameters[length_idx];
+            GIArgument *length_arg = GetArgumentSlot (func, length_idx, callable_arg_values, out_arg_values);
+
+            Local<Value> array_length_value = Integer::New (isolate, array_length);
+            V8ToGIArgument (isolate, length_param->type_info, length_arg, array_length_value, false);
         } else {
-            if (call_parameters[i].type == Parameter::ARRAY) {
-                GITypeInfo type_info;
-                g_arg_info_load_type (&arg_info, &type_info);
-                bool may_be_null = g_arg_info_may_be_null (&arg_info);
-                size_t array_length;
-                V8ToGIArgument (isolate, &type_info, &callable_arg_values[i], args[in_arg], may_be_null, &array_length);
-
-                Local<Value> array_length_value = Integer::New (isolate, array_length);
-
-                int array_length_pos = g_type_info_get_array_length (&type_info);
-                GIArgInfo array_length_arg;
-                g_callable_info_load_arg ((GICallableInfo *) info, array_length_pos, &array_length_arg);
-
-                {
-                    GITypeInfo type_info;
-                    g_arg_info_load_type (&array_length_arg, &type_info);
-                    V8ToGIArgument (isolate, &type_info, &callable_arg_values[array_length_pos], array_length_value, false);
-                }
-            } else {
-                GITypeInfo type_info;
-                g_arg_info_load_type (&arg_info, &type_info);
-                bool may_be_null = g_arg_info_may_be_null (&arg_info);
-                V8ToGIArgument (isolate, &type_info, &callable_arg_values[i], args[in_arg], may_be_null);
-            }
+            frame->borrowed[i] = V8ToParameter (isolate, param, arg, args[in_arg], NULL, allow_borrow);
+        }
 
-            in_arg++;
+        /* Whatever this argument got is left alone; it failed halfway. */
+        if (try_catch.HasCaught ()) {
+            CallFrameFreeMarshalled (func, frame, i);
+            try_catch.ReThrow ();
+            return false;
         }
+
+        if (sample && !frame->borrowed[i] && ParameterAllocates (param))
+            sample->allocations++;
+
+        in_arg++;
     }
 
-    if (can_throw)
-        callable_arg_values[i].v_pointer = &error;
+    if (func->can_throw)
+        callable_arg_values[i].v_pointer = &frame->error;
 
-    void *ffi_arg_pointers[n_total_args];
-    for (int i = 0; i < n_total_args; i++)
-        ffi_arg_pointers[i] = &total_arg_values[i];
+    for (int i = 0; i < func->n_total_args; i++)
+        frame->ffi_arg_pointers[i] = &frame->total_arg_values[i];
+
+    return true;
+}
+
+/* Does not touch V8, so it can run on any thread. */
+static void CallFrameInvoke(FunctionInfo *func, CallFrame *frame, FunctionProfileSample *sample) {
+    if (sample)
+        sample->ffi_start = uv_hrtime ();
 
-    GIArgument return_value;
     ffi_call (&func->invoker.cif, FFI_FN (func->invoker.native_address),
-              &return_value, ffi_arg_pointers);
+              &frame->return_value, frame->ffi_arg_pointers);
 
-    for (int i = 0; i < n_callable_args; i++) {
-        GIArgInfo arg_info;
-        g_callable_info_load_arg ((GICallableInfo *) info, i, &arg_info);
-        GIDirection direction = g_arg_info_get_direction (&arg_info);
-        if (direction == GI_DIRECTION_OUT) {
-            /* XXX: Process out value. */
-        } else {
-            GITypeInfo type_info;
-            g_arg_info_load_type (&arg_info, &type_info);
-            FreeGIArgument (&type_info, &callable_arg_values[i]);
+    if (sample)
+        sample->ffi_end = uv_hrtime ();
+}
+
+static void CallFrameFreeIn(FunctionInfo *func, CallFrame *frame) {
+    for (int i = 0; i < func->n_callable_args; i++) {
+        Parameter *param = &func->parameters[i];
+
+        if (param->type == Parameter::CALLBACK) {
+            /* Others may be gone already, so the scope comes from the
+             * parameter, as in TrampolineAcquire. */
+            if (frame->trampolines[i] && param->destroy_idx < 0 && param->scope == GI_SCOPE_TYPE_CALL)
+                TrampolineRelease (frame->trampolines[i]);
+            continue;
         }
+
+        if (param->direction == GI_DIRECTION_IN && !frame->borrowed[i] && param->transfer != GI_TRANSFER_EVERYTHING)
+            FreeGIArgument (param->type_info, &frame->callable_arg_values[i]);
+    }
+}
+
+/* Converts the return value and out arguments of a call that did not
+ * fail. */
+static Local<Value> CallFrameMarshalOut(Isolate *isolate, FunctionInfo *func, CallFrame *frame,
+                                        FunctionProfileSample *sample) {
+    GIArgument *callable_arg_values = frame->callable_arg_values;
+    GIArgument *out_arg_values = frame->out_arg_values;
+
+    long return_length = -1;
+    if (func->return_array_length_idx >= 0)
+        return_length = GetArrayLength (func, func->return_array_length_idx,
+                                        callable_arg_values, out_arg_values);
+
+    Local<Value> return_js = GIArgumentToV8 (isolate, func->return_type, &frame->return_value,
+                                             return_length, func->return_transfer);
+
+    if (func->n_out_args == 0)
+        return return_js;
+
+    /* With out arguments, the return value (if any) and the out values
+     * are returned together as an array, unless there is only one. */
+    Local<Array> results = Array::New (isolate);
+    int n_results = 0;
+
+    if (sample)
+        sample->allocations++;
+
+    if (func->has_return_value)
+        results->Set (n_results++, return_js);
+
+    for (int i = 0; i < func->n_callable_args; i++) {
+        Parameter *param = &func->parameters[i];
+        if (param->direction == GI_DIRECTION_IN || param->type == Parameter::SKIP)
+            continue;
+
+        long length = -1;
+        if (param->array_length_idx >= 0)
+            length = GetArrayLength (func, param->array_length_idx, callable_arg_values, out_arg_values);
+
+        results->Set (n_results++, GIArgumentToV8 (isolate, param->type_info, &out_arg_values[i],
+                                                   length, param->transfer));
     }
 
-    if (error) {
-        isolate->ThrowException (Exception::TypeError (String::NewFromUtf8 (isolate, error->message)));
+    if (n_results == 1)
+        return results->Get (0);
+    else
+        return results;
+}
+
+static void FunctionCall(const FunctionCallbackInfo<Value> &args, FunctionInfo *func, FunctionProfileSample *sample) {
+    Isolate *isolate = args.GetIsolate();
+
+    if (!FunctionInfoEnsurePrepared (isolate, func))
+        return;
+
+    GIArgument total_arg_values[func->n_total_args];
+    GIArgument out_arg_values[func->n_callable_args];
+    bool borrowed[func->n_callable_args];
+    Trampoline *trampolines[func->n_callable_args];
+    void *ffi_arg_pointers[func->n_total_args];
+
+    CallFrame frame = {};
+    frame.total_arg_values = total_arg_values;
+    frame.out_arg_values = out_arg_values;
+    frame.borrowed = borrowed;
+    frame.trampolines = trampolines;
+    frame.ffi_arg_pointers = ffi_arg_pointers;
+
+    if (!CallFrameMarshalIn (isolate, func, &frame, args.This (), args, 0, true, sample)) {
+        if (frame.promise)
+            AsyncReadyPromiseFree (frame.promise);
         return;
     }
 
-    GITypeInfo return_value_type;
-    g_callable_info_load_return_type ((GICallableInfo *) info, &return_value_type);
-    args.GetReturnValue ().Set (GIArgumentToV8 (isolate, &return_value_type, &return_value));
+    /* Taken before the call, as the callback frees the promise. */
+    Local<Value> promise;
+    if (frame.promise)
+        promise = Local<Promise::Resolver>::New (isolate, frame.promise->resolver)->GetPromise ();
+
+    CallFrameInvoke (func, &frame, sample);
+    CallFrameFreeIn (func, &frame);
+
+    if (frame.error) {
+        isolate->ThrowException (GErrorToV8 (isolate, frame.error));
+        g_error_free (frame.error);
+        return;
+    }
+
+    if (!promise.IsEmpty ())
+        args.GetReturnValue ().Set (promise);
+    else
+        args.GetReturnValue ().Set (CallFrameMarshalOut (isolate, func, &frame, sample));
 }
 
-static void FunctionDestroyed(const WeakCallbackData<FunctionTemplate, FunctionInfo> &data) {
+static void FunctionInvoker(const FunctionCallbackInfo<Value> &args) {
+    FunctionInfo *func = (FunctionInfo *) External::Cast (*args.Data ())->Value ();
+
+    bool profiling_enabled = func->isolate_data->profiling_enabled;
+
+    if (G_LIKELY (!profiling_enabled && !TraceEnabled ())) {
+        FunctionCall (args, func, NULL);
+        return;
+    }
+
+    FunctionProfileSample sample = { 0, };
+    sample.start = uv_hrtime ();
+    FunctionCall (args, func, &sample);
+    guint64 end = uv_hrtime ();
+
+    if (TraceEnabled ()) {
+        TraceEvent ("gi", FunctionInfoGetName (func), sample.start, end);
+        if (sample.ffi_start)
+            TraceEvent ("gi", "ffi_call", sample.ffi_start, sample.ffi_end);
+    }
+
+    if (profiling_enabled)
+        FunctionProfileRecord (func, &sample, end);
+}
+
+/* fn.async(...): the arguments are converted on the JS thread, the
+ * native call runs on the uv threadpool, and the returned Promise is
+ * settled with the converted results or the GError back on the JS
+ * thread. For methods, the instance is the first argument, as in
+ * file.load_contents.async(file, null). */
+struct AsyncCall {
+    uv_work_t req;
+    Isolate *isolate;
+    FunctionInfo *func;
+    CallFrame frame;
+
+    Persistent<Context> context;
+    Persistent<Promise::Resolver> resolver;
+    /* The instance and the arguments, so nothing the frame points into
+     * is collected while the call runs. */
+    Persistent<Array> args;
+
+    bool profiled;
+    FunctionProfileSample sample;
+    /* Set if tracing; looked up up front since the worker can't. */
+    const char *trace_name;
+};
+
+static AsyncCall *AsyncCallNew(Isolate *isolate, FunctionInfo *func) {
+    AsyncCall *call = new AsyncCall ();
+    call->req.data = call;
+    call->isolate = isolate;
+    call->func = FunctionInfoRef (func);
+
+    call->frame.total_arg_values = g_new0 (GIArgument, func->n_total_args);
+    call->frame.out_arg_values = g_new0 (GIArgument, func->n_callable_args);
+    call->frame.borrowed = g_new0 (bool, func->n_callable_args);
+    call->frame.trampolines = g_new0 (Trampoline *, func->n_callable_args);
+    call->frame.ffi_arg_pointers = g_new0 (void *, func->n_total_args);
+
+    call->profiled = func->isolate_data->profiling_enabled;
+    call->trace_name = TraceEnabled () ? FunctionInfoGetName (func) : NULL;
+    if (call->profiled || call->trace_name)
+        call->sample.start = uv_hrtime ();
+
+    return call;
+}
+
+static void AsyncCallFree(AsyncCall *call) {
+    g_free (call->frame.total_arg_values);
+    g_free (call->frame.out_arg_values);
+    g_free (call->frame.borrowed);
+    g_free (call->frame.trampolines);
+    g_free (call->frame.ffi_arg_pointers);
+
+    call->context.Reset ();
+    call->resolver.Reset ();
+    call->args.Reset ();
+
+    FunctionInfoUnref (call->func);
+    delete call;
+}
+
+static void AsyncCallWork(uv_work_t *req) {
+    AsyncCall *call = (AsyncCall *) req->data;
+    bool sampled = call->profiled || call->trace_name;
+
+    CallFrameInvoke (call->func, &call->frame, sampled ? &call->sample : NULL);
+
+    if (call->trace_name)
+        TraceEvent ("gi", call->trace_name, call->sample.ffi_start, call->sample.ffi_end);
+}
+
+static void AsyncCallDone(uv_work_t *req, int status) {
+    AsyncCall *call = (AsyncCall *) req->data;
+    Isolate *isolate = call->isolate;
+    FunctionInfo *func = call->func;
+    HandleScope scope (isolate);
+
+    Local<Context> context = Local<Context>::New (isolate, call->context);
+    Context::Scope context_scope (context);
+    Local<Promise::Resolver> resolver = Local<Promise::Resolver>::New (isolate, call->resolver);
+
+    CallFrameFreeIn (func, &call->frame);
+
+    if (call->frame.error) {
+        resolver->Reject (GErrorToV8 (isolate, call->frame.error));
+        g_error_free (call->frame.error);
+    } else {
+        TryCatch try_catch;
+        Local<Value> result = CallFrameMarshalOut (isolate, func, &call->frame, call->profiled ? &call->sample : NULL);
+        if (try_catch.HasCaught ())
+            resolver->Reject (try_catch.Exception ());
+        else
+            resolver->Resolve (result);
+    }
+
+    if (call->profiled)
+        FunctionProfileRecord (func, &call->sample, uv_hrtime ());
+
+    AsyncCallFree (call);
+
+    /* We are not called from JS, so nobody else will run the reactions. */
+    isolate->RunMicrotasks ();
+}
+
+static void AsyncFunctionInvoker(const FunctionCallbackInfo<Value> &args) {
+    Isolate *isolate = args.GetIsolate ();
+    FunctionInfo *func = (FunctionInfo *) External::Cast (*args.Data ())->Value ();
+
+    if (!FunctionInfoEnsurePrepared (isolate, func))
+        return;
+
+    /* Call-scoped callbacks would run JS on the worker thread. */
+    if (func->has_callbacks) {
+        isolate->ThrowException (Exception::TypeError (String::NewFromUtf8 (isolate, "Functions that take callbacks cannot be called asynchronously.")));
+        return;
+    }
+
+    Local<Value> self = func->is_method ? args[0] : args.This ();
+    int first_arg = func->is_method ? 1 : 0;
+
+    AsyncCall *call = AsyncCallNew (isolate, func);
+
+    /* Structs made from object literals belong to their wrappers, which
+     * only the handle scope would keep alive otherwise. */
+    IsolateData *data = GetIsolateData (isolate);
+    Local<Array> made_structs = Array::New (isolate);
+    Local<Array> *outer_made_structs = data->made_structs;
+    data->made_structs = &made_structs;
+
+    /* The frame outlives this call, so typed arrays are copied rather
+     * than lent: JS could modify or detach them meanwhile. */
+    bool ok = CallFrameMarshalIn (isolate, func, &call->frame, self, args, first_arg, false,
+                                  call->profiled ? &call->sample : NULL);
+    data->made_structs = outer_made_structs;
+    if (!ok) {
+        AsyncCallFree (call);
+        return;
+    }
+
+    Local<Array> kept_args = Array::New (isolate, args.Length () + 2);
+    kept_args->Set (0, args.This ());
+    for (int i = 0; i < args.Length (); i++)
+        kept_args->Set (i + 1, args[i]);
+    kept_args->Set (args.Length () + 1, made_structs);
+    call->args.Reset (isolate, kept_args);
+
+    Local<Promise::Resolver> resolver = Promise::Resolver::New (isolate);
+    call->resolver.Reset (isolate, resolver);
+    call->context.Reset (isolate, isolate->GetCurrentContext ());
+
+    /* AsyncCallDone must run on this isolate's own loop. */
+#if NODE_MAJOR_VERSION >= 10
+    uv_loop_t *loop = node::GetCurrentEventLoop (isolate);
+#else
+    uv_loop_t *loop = uv_default_loop ();
+#endif
+    uv_queue_work (loop, &call->req, AsyncCallWork, AsyncCallDone);
+
+    args.GetReturnValue ().Set (resolver->GetPromise ());
+}
+
+static void AsyncFunctionDestroyed(const WeakCallbackData<Function, FunctionInfo> &data) {
     FunctionInfo *func = data.GetParameter ();
-    g_base_info_unref (func->info);
-    g_function_invoker_destroy (&func->invoker);
-    g_free (func);
+    func->async_function.Reset ();
+    FunctionInfoUnref (func);
 }
 
-Local<Function> MakeFunction(Isolate *isolate, GIBaseInfo *info) {
-    FunctionInfo *func = g_new0 (FunctionInfo, 1);
-    func->info = g_base_info_ref (info);
+static void AsyncFunctionGetter(Local<String> name, const PropertyCallbackInfo<Value> &info) {
+    Isolate *isolate = info.GetIsolate ();
+    FunctionInfo *func = (FunctionInfo *) External::Cast (*info.Data ())->Value ();
 
-    g_function_info_prep_invoker (func->info, &func->invoker, NULL);
+    if (func->async_function.IsEmpty ()) {
+        Local<Function> fn = Function::New (isolate, AsyncFunctionInvoker, External::New (isolate, func));
+        FunctionInfoRef (func);
 
-    Local<FunctionTemplate> tpl = FunctionTemplate::New (isolate, FunctionInvoker, External::New (isolate, func));
-    Local<Function> fn = tpl->GetFunction ();
+        func->async_function.Reset (isolate, fn);
+        func->async_function.SetWeak (func, AsyncFunctionDestroyed);
+    }
+
+    info.GetReturnValue ().Set (Local<Function>::New (isolate, func->async_function));
+}
+
+/* Idle trampolines and their plans go with the isolate. Plans with
+ * trampolines still held by C are orphaned instead, and those
+ * trampolines ignore any later call. */
+void FunctionIsolateCleanup(IsolateData *data) {
+    if (data->callback_plans) {
+        GHashTableIter iter;
+        gpointer value;
+        g_hash_table_iter_init (&iter, data->callback_plans);
+        while (g_hash_table_iter_next (&iter, NULL, &value)) {
+            CallbackPlan *plan = (CallbackPlan *) value;
+
+            while (plan->free_trampolines) {
+                Trampoline *trampoline = plan->free_trampolines;
+                plan->free_trampolines = trampoline->next_free;
+                g_callable_info_free_closure (plan->info, trampoline->closure);
+                delete trampoline;
+            }
+            plan->n_free_trampolines = 0;
+
+            if (plan->n_live_trampolines == 0)
+                CallbackPlanFree (plan);
+            else
+                plan->isolate_data = NULL;
+        }
+
+        g_hash_table_destroy (data->callback_plans);
+        data->callback_plans = NULL;
+    }
+
+    /* The FunctionInfos themselves belong to templates of the isolate. */
+    if (data->profiled_functions) {
+        g_ptr_array_unref (data->profiled_functions);
+        data->profiled_functions = NULL;
+    }
+}
+
+static void FunctionDestroyed(const WeakCallbackData<FunctionTemplate, FunctionInfo> &data) {
+    FunctionInfo *func = data.GetParameter ();
+    FunctionInfoUnref (func);
+}
+
+Local<FunctionTemplate> MakeFunctionTemplate(Isolate *isolate, GIBaseInfo *info) {
+    FunctionInfo *func = FunctionInfoNew (GetIsolateData (isolate), info);
+
+    Local<External> data = External::New (isolate, func);
+    Local<FunctionTemplate> tpl = FunctionTemplate::New (isolate, FunctionInvoker, data);
+    tpl->SetNativeDataProperty (String::NewFromUtf8 (isolate, "async"), AsyncFunctionGetter, NULL, data,
+                                (PropertyAttribute) (ReadOnly | DontEnum));
 
     Persistent<FunctionTemplate> persistent(isolate, tpl);
     persistent.SetWeak (func, FunctionDestroyed);
 
+    const char *function_name = g_base_info_get_name (info);
+    tpl->SetClassName (String::NewFromUtf8 (isolate, function_name));
+
+    return tpl;
+}
+
+Local<Function> MakeFunction(Isolate *isolate, GIBaseInfo *info) {
+    Local<FunctionTemplate> tpl = MakeFunctionTemplate (isolate, info);
+    Local<Function> fn = tpl->GetFunction ();
+
     const char *function_name = g_base_info_get_name (info);
     fn->SetName (String::NewFromUtf8 (isolate, function_name));
 
     return fn;
 }
 
-#if 0
-class TrampolineInfo {
-    ffi_cif cif;
-    ffi_closure *closure;
-    Persistent<Function> persistent;
-    GICallableInfo *info;
-    GIScopeType scope_type;
+/* A method not made yet: the accessor standing in for it builds the
+ * function on first access and replaces itself with it, so that a class
+ * costs one accessor per method until its methods are used. */
+struct LazyMethod {
+    GIFunctionInfo *info;
+    Persistent<External> persistent;
+};
 
-    TrampolineInfo(Local<Function>  function,
-                   GICallableInfo   *info,
-                   GIScopeType       scope_type);
+static void LazyMethodDestroyed(const WeakCallbackData<External, LazyMethod> &data) {
+    LazyMethod *method = data.GetParameter ();
+    g_base_info_unref (method->info);
+    method->persistent.Reset ();
+    delete method;
+}
 
-    void Dispose();
-    static void Call(ffi_cif *cif, void *result, void **args, void *data);
-    void *GetClosure();
-};
+static void LazyMethodGetter(Local<String> name, const PropertyCallbackInfo<Value> &info) {
+    Isolate *isolate = info.GetIsolate ();
+    LazyMethod *method = (LazyMethod *) External::Cast (*info.Data ())->Value ();
 
-void TrampolineInfo::Dispose() {
-    persistent = nullptr;
-    g_base_info_unref (info);
-    g_callable_info_free_closure (info, closure);
-};
+    /* The holder is the prototype or the constructor the accessor was
+     * installed on, whichever object it was reached through. */
+    Local<Function> fn = MakeFunction (isolate, method->info);
+    info.Holder ()->DefineOwnProperty (isolate->GetCurrentContext (), name, fn);
+    info.GetReturnValue ().Set (fn);
+}
 
-void TrampolineInfo::Call(ffi_cif *cif,
-                          void *result,
-                          void **args,
-                          void *data) {
-    TrampolineInfo *trampoline = (TrampolineInfo *) data;
+/* Assigning replaces the method on the object assigned to, as it would
+ * for a plain data property. */
+static void LazyMethodSetter(Local<String> name, Local<Value> value, const PropertyCallbackInfo<void> &info) {
+    Isolate *isolate = info.GetIsolate ();
+    info.This ()->DefineOwnProperty (isolate->GetCurrentContext (), name, value);
+}
 
-    int argc = g_callable_info_get_n_args (trampoline->info);
-    Local<Value> argv[argc];
+void DefineMethod(Isolate *isolate, Local<FunctionTemplate> class_tpl, GIFunctionInfo *info) {
+    const char *function_name = g_base_info_get_name (info);
+    GIFunctionInfoFlags flags = g_function_info_get_flags (info);
+    Local<String> name = String::NewFromUtf8 (isolate, function_name);
 
-    for (int i = 0; i < argc; i++) {
-        GIArgInfo arg_info;
-        g_callable_info_load_arg (trampoline->info, i, &arg_info);
-        GITypeInfo type_info;
-        g_arg_info_load_type (&arg_info, &type_info);
-        argv[i] = GIArgumentToV8 (&type_info, (GIArgument *) &args[i]);
-    }
-
-    Local<Function> func = trampoline->func;
-    /* Provide a bogus "this" function. Any interested callers should
-     * bind their callbacks to what they're intersted in... */
-    Local<Object> this_obj = func;
-    Local<Value> return_value = func->Call (this_obj, argc, argv);
-    GITypeInfo type_info;
-    g_callable_info_load_return_type (trampoline->info, &type_info);
-    V8ToGIArgument (&type_info, (GIArgument *) &result, return_value,
-                    g_callable_info_may_return_null (trampoline->info));
-}
-
-TrampolineInfo::TrampolineInfo(Local<Function>   function,
-                               GICallableInfo   *info,
-                               GIScopeType       scope_type) {
-    this->closure = g_callable_info_prepare_closure (info, &cif, Call, this);
-    this->func = Persistent<Function>::New (function);
-    this->info = g_base_info_ref (info);
-    this->scope_type = scope_type;
+    LazyMethod *method = new LazyMethod ();
+    method->info = (GIFunctionInfo *) g_base_info_ref (info);
+
+    Local<External> data = External::New (isolate, method);
+    method->persistent.Reset (isolate, data);
+    method->persistent.SetWeak (method, LazyMethodDestroyed);
+
+    if (flags & GI_FUNCTION_IS_METHOD)
+        class_tpl->PrototypeTemplate ()->SetNativeDataProperty (name, LazyMethodGetter, LazyMethodSetter, data);
+    else
+        class_tpl->SetNativeDataProperty (name, LazyMethodGetter, LazyMethodSetter, data);
 }
-#endif
 
 };
@@ -8,5 +8,16 @@
 namespace GNodeJS {
 
 v8::Local<v8::Function> MakeFunction(v8::Isolate *isolate, GIBaseInfo *base_info);
+v8::Local<v8::FunctionTemplate> MakeFunctionTemplate(v8::Isolate *isolate, GIBaseInfo *base_info);
+
+/* Installs a method on the class' PrototypeTemplate, or a static
+ * function on the class template itself. The function is only made
+ * the first time it is accessed. */
+void DefineMethod(v8::Isolate *isolate, v8::Local<v8::FunctionTemplate> class_tpl, GIFunctionInfo *info);
+
+/* Per-function call profiling, off by default and per isolate.
+ * Enabling or disabling it discards what was collected so far. */
+void SetFunctionProfilingEnabled(v8::Isolate *isolate, bool enabled);
+v8::Local<v8::Array> GetFunctionProfile(v8::Isolate *isolate);
 
 };
@@ -6,9 +6,12 @@
 #include "boxed.h"
 #include "function.h"
 #include "gobject.h"
+#include "isolate.h"
 #include "loop.h"
+#include "trace.h"
 
 #include <string.h>
+#include <uv.h>
 
 using namespace v8;
 
@@ -89,13 +92,37 @@ static void Bootstrap(const FunctionCallbackInfo<Value> &args) {
     args.GetReturnValue ().Set (module_obj);
 }
 
+static Local<Value> MakeConstantValue(Isolate *isolate, GIConstantInfo *info);
+
 static void GetConstantValue(const FunctionCallbackInfo<Value> &args) {
     Isolate *isolate = args.GetIsolate ();
     GIBaseInfo *info = (GIBaseInfo *) GNodeJS::BoxedFromWrapper (args[0]);
-    GITypeInfo *type_info = g_constant_info_get_type ((GIConstantInfo *) info);
-    GIArgument garg;
-    g_constant_info_get_value ((GIConstantInfo *) info, &garg);
-    args.GetReturnValue ().Set (GNodeJS::GIArgumentToV8 (isolate, type_info, &garg));
+    args.GetReturnValue ().Set (MakeConstantValue (isolate, (GIConstantInfo *) info));
+}
+
+/* For gpointer arguments that point to a GObject. Checking an unknown
+ * pointer with G_IS_OBJECT would read through it, which crashes on
+ * anything else; so it is only taken when it is an object wrapped in
+ * this isolate, or when the caller asserts that it is a GObject
+ * (args[1]), in which case a wrong pointer is the caller's bug. */
+static void ObjectFromPointer(const FunctionCallbackInfo<Value> &args) {
+    Isolate *isolate = args.GetIsolate ();
+
+    if (!args[0]->IsExternal ()) {
+        isolate->ThrowException (Exception::TypeError (String::NewFromUtf8 (isolate, "Expected a pointer.")));
+        return;
+    }
+
+    GObject *gobject = (GObject *) External::Cast (*args[0])->Value ();
+    GHashTable *objects = GNodeJS::GetIsolateData (isolate)->objects;
+    bool known = objects && g_hash_table_contains (objects, gobject);
+
+    if (!known && !args[1]->BooleanValue ()) {
+        isolate->ThrowException (Exception::TypeError (String::NewFromUtf8 (isolate, "Not a known GObject; pass true as the second argument if it is one.")));
+        return;
+    }
+
+    args.GetReturnValue ().Set (GNodeJS::WrapperFromGObject (isolate, gobject));
 }
 
 static void MakeFunction(const FunctionCallbackInfo<Value> &args) {
@@ -119,66 +146,223 @@ static void MakeBoxed(const FunctionCallbackInfo<Value> &args) {
 static void ObjectPropertyGetter(const FunctionCallbackInfo<Value> &args) {
     Isolate *isolate = args.GetIsolate ();
     GObject *gobject = GNodeJS::GObjectFromWrapper (args[0]);
-    String::Utf8Value prop_name_v (args[1]->ToString ());
-    const char *prop_name = *prop_name_v;
-
-    GParamSpec *pspec = g_object_class_find_property (G_OBJECT_GET_CLASS (gobject), prop_name);
-    GValue value = {};
-    g_value_init (&value, G_PARAM_SPEC_VALUE_TYPE (pspec));
-
-    g_object_get_property (gobject, prop_name, &value);
-
-    args.GetReturnValue ().Set (GNodeJS::GValueToV8 (isolate, &value));
+    String::Utf8Value prop_name (args[1]->ToString ());
+    args.GetReturnValue ().Set (GNodeJS::GetObjectProperty (isolate, gobject, *prop_name));
 }
 
 static void ObjectPropertySetter(const FunctionCallbackInfo<Value> &args) {
     GObject *gobject = GNodeJS::GObjectFromWrapper (args[0]);
-    String::Utf8Value prop_name_v (args[1]->ToString ());
-    const char *prop_name = *prop_name_v;
-
-    GParamSpec *pspec = g_object_class_find_property (G_OBJECT_GET_CLASS (gobject), prop_name);
-    GValue value = {};
-    g_value_init (&value, G_PARAM_SPEC_VALUE_TYPE (pspec));
-
-    GNodeJS::V8ToGValue (&value, args[2]);
-
-    g_object_set_property (gobject, prop_name, &value);
+    String::Utf8Value prop_name (args[1]->ToString ());
+    GNodeJS::SetObjectProperty (gobject, *prop_name, args[2]);
 }
 
 static void BoxedFieldGetter(const FunctionCallbackInfo<Value> &args) {
     Isolate *isolate = args.GetIsolate ();
     void *boxed = GNodeJS::BoxedFromWrapper (args[0]);
     GIFieldInfo *field_info = (GIFieldInfo *) GNodeJS::BoxedFromWrapper (args[1]);
-    GIArgument argument;
-    GITypeInfo *type_info = g_field_info_get_type (field_info);
-    if (!g_field_info_get_field (field_info, boxed, &argument)) {
-        isolate->ThrowException (Exception::Error (String::NewFromUtf8 (isolate, "Could not get boxed field")));
-        goto out;
-    }
-    args.GetReturnValue ().Set (GNodeJS::GIArgumentToV8 (isolate, type_info, &argument));
-
- out:
-    g_base_info_unref (type_info);
+    Local<Value> value = GNodeJS::GetBoxedField (isolate, boxed, field_info);
+    if (!value.IsEmpty ())
+        args.GetReturnValue ().Set (value);
 }
 
 static void BoxedFieldSetter(const FunctionCallbackInfo<Value> &args) {
     Isolate *isolate = args.GetIsolate ();
     void *boxed = GNodeJS::BoxedFromWrapper (args[0]);
     GIFieldInfo *field_info = (GIFieldInfo *) GNodeJS::BoxedFromWrapper (args[1]);
-    GIArgument argument;
-    GITypeInfo *type_info = g_field_info_get_type (field_info);
-    GNodeJS::V8ToGIArgument (isolate, type_info, &argument, args[2], true);
-    if (!g_field_info_set_field (field_info, boxed, &argument))
-        isolate->ThrowException (Exception::Error (String::NewFromUtf8 (isolate, "Could not set boxed field")));
-    g_base_info_unref (type_info);
+    GNodeJS::SetBoxedField (isolate, boxed, field_info, args[2]);
+}
+
+static Local<Value> MakeEnumObject(Isolate *isolate, GIEnumInfo *info) {
+    Local<Object> enum_obj = Object::New (isolate);
+
+    int n_values = g_enum_info_get_n_values (info);
+    for (int i = 0; i < n_values; i++) {
+        GIValueInfo *value_info = g_enum_info_get_value (info, i);
+        char *value_name = g_ascii_strup (g_base_info_get_name ((GIBaseInfo *) value_info), -1);
+        gint64 value = g_value_info_get_value (value_info);
+        enum_obj->Set (String::NewFromUtf8 (isolate, value_name), Number::New (isolate, value));
+        g_free (value_name);
+        g_base_info_unref ((GIBaseInfo *) value_info);
+    }
+
+    return enum_obj;
+}
+
+static Local<Value> MakeConstantValue(Isolate *isolate, GIConstantInfo *info) {
+    GITypeInfo *type_info = g_constant_info_get_type (info);
+    GIArgument garg;
+    g_constant_info_get_value (info, &garg);
+    Local<Value> value = GNodeJS::GIArgumentToV8 (isolate, type_info, &garg);
+    g_constant_info_free_value (info, &garg);
+    g_base_info_unref ((GIBaseInfo *) type_info);
+    return value;
+}
+
+/* Mirrors makeInfo() in lib/index.js, but without going through the
+ * GIRepository bindings for every piece of metadata. */
+static Local<Value> BuildInfo(Isolate *isolate, GIBaseInfo *info) {
+    GIInfoType type = g_base_info_get_type (info);
+
+    switch (type) {
+    case GI_INFO_TYPE_ENUM:
+    case GI_INFO_TYPE_FLAGS:
+        return MakeEnumObject (isolate, (GIEnumInfo *) info);
+    case GI_INFO_TYPE_CONSTANT:
+        return MakeConstantValue (isolate, (GIConstantInfo *) info);
+    case GI_INFO_TYPE_FUNCTION:
+        return GNodeJS::MakeFunction (isolate, info);
+    case GI_INFO_TYPE_OBJECT:
+        return GNodeJS::MakeClass (isolate, info);
+    case GI_INFO_TYPE_BOXED:
+    case GI_INFO_TYPE_STRUCT:
+    case GI_INFO_TYPE_UNION:
+        return GNodeJS::MakeBoxed (isolate, info);
+    default:
+        return Undefined (isolate);
+    }
+}
+
+static void BuildClass(const FunctionCallbackInfo<Value> &args) {
+    Isolate *isolate = args.GetIsolate ();
+    GIBaseInfo *info = (GIBaseInfo *) GNodeJS::BoxedFromWrapper (args[0]);
+    args.GetReturnValue ().Set (BuildInfo (isolate, info));
+}
+
+/* Every typelib is loaded through here, so that GTypes found without
+ * introspection data so far get looked up again. */
+static bool RequireNamespace(Isolate *isolate, const char *ns, const char *version) {
+    GIRepository *repo = g_irepository_get_default ();
+    GError *error = NULL;
+
+    bool was_loaded = g_irepository_is_registered (repo, ns, version);
+    g_irepository_require (repo, ns, version, (GIRepositoryLoadFlags) 0, &error);
+    if (error) {
+        isolate->ThrowException (Exception::TypeError (String::NewFromUtf8 (isolate, error->message)));
+        g_error_free (error);
+        return false;
+    }
+
+    if (!was_loaded)
+        GNodeJS::ForgetUnknownGTypes ();
+    return true;
+}
+
+static void Require(const FunctionCallbackInfo<Value> &args) {
+    String::Utf8Value ns (args[0]->ToString ());
+    String::Utf8Value version (args[1]);
+    RequireNamespace (args.GetIsolate (), *ns, args[1]->IsString () ? *version : NULL);
+}
+
+static void BuildNamespace(const FunctionCallbackInfo<Value> &args) {
+    Isolate *isolate = args.GetIsolate ();
+
+    GIRepository *repo = g_irepository_get_default ();
+
+    String::Utf8Value ns_v (args[0]->ToString ());
+    const char *ns = *ns_v;
+    String::Utf8Value version_v (args[1]);
+    const char *version = args[1]->IsString () ? *version_v : NULL;
+
+    if (!RequireNamespace (isolate, ns, version))
+        return;
+
+    Local<Object> module_obj = Object::New (isolate);
+
+    int n = g_irepository_get_n_infos (repo, ns);
+    for (int i = 0; i < n; i++) {
+        GIBaseInfo *info = g_irepository_get_info (repo, ns, i);
+        const char *name = g_base_info_get_name (info);
+        module_obj->Set (String::NewFromUtf8 (isolate, name), BuildInfo (isolate, info));
+        g_base_info_unref (info);
+    }
+
+    args.GetReturnValue ().Set (module_obj);
 }
 
 static void StartLoop(const FunctionCallbackInfo<Value> &args) {
-    GNodeJS::StartLoop ();
+#if NODE_MAJOR_VERSION >= 10
+    /* The loop drives the default uv loop and GLib's default context;
+     * workers have neither. */
+    Isolate *isolate = args.GetIsolate ();
+    if (node::GetCurrentEventLoop (isolate) != uv_default_loop ()) {
+        isolate->ThrowException (Exception::Error (String::NewFromUtf8 (isolate, "The main loop can only be started on the main thread.")));
+        return;
+    }
+#endif
+
+    GNodeJS::IsolateData *data = GNodeJS::GetIsolateData (args.GetIsolate ());
+    String::Utf8Value mode (args[0]);
+    if (args[0]->IsString () && strcmp (*mode, "uv") == 0)
+        GNodeJS::StartLoop (data, GNodeJS::LOOP_MODE_UV);
+    else
+        GNodeJS::StartLoop (data, GNodeJS::LOOP_MODE_GLIB);
+}
+
+static void StopLoop(const FunctionCallbackInfo<Value> &args) {
+    GNodeJS::StopLoop ();
+}
+
+static void SetLoopStatsEnabled(const FunctionCallbackInfo<Value> &args) {
+    GNodeJS::SetLoopStatsEnabled (args[0]->BooleanValue ());
 }
 
-void InitModule(Local<Object> exports, Local<Value> module, void *priv) {
-    Isolate *isolate = Isolate::GetCurrent ();
+static void SetFunctionProfilingEnabled(const FunctionCallbackInfo<Value> &args) {
+    GNodeJS::SetFunctionProfilingEnabled (args.GetIsolate (), args[0]->BooleanValue ());
+}
+
+static void GetFunctionProfile(const FunctionCallbackInfo<Value> &args) {
+    args.GetReturnValue ().Set (GNodeJS::GetFunctionProfile (args.GetIsolate ()));
+}
+
+static void StartTracing(const FunctionCallbackInfo<Value> &args) {
+    Isolate *isolate = args.GetIsolate ();
+    String::Utf8Value path (args[0]);
+    GError *error = NULL;
+
+    if (!GNodeJS::StartTracing (*path, args[1]->BooleanValue (), &error)) {
+        isolate->ThrowException (Exception::Error (String::NewFromUtf8 (isolate, error->message)));
+        g_error_free (error);
+    }
+}
+
+static void StopTracing(const FunctionCallbackInfo<Value> &args) {
+    GNodeJS::StopTracing ();
+}
+
+static Local<Array> MakeHistogram(Isolate *isolate, const guint64 *buckets) {
+    Local<Array> array = Array::New (isolate, LOOP_STATS_N_BUCKETS);
+    for (int i = 0; i < LOOP_STATS_N_BUCKETS; i++)
+        array->Set (i, Number::New (isolate, buckets[i]));
+    return array;
+}
+
+static void GetLoopStats(const FunctionCallbackInfo<Value> &args) {
+    Isolate *isolate = args.GetIsolate ();
+    const GNodeJS::LoopStats *stats = GNodeJS::GetLoopStats ();
+
+    if (stats == NULL) {
+        args.GetReturnValue ().SetNull ();
+        return;
+    }
+
+    Local<Object> obj = Object::New (isolate);
+    obj->Set (String::NewFromUtf8 (isolate, "prepares"), Number::New (isolate, stats->prepares));
+    obj->Set (String::NewFromUtf8 (isolate, "dispatches"), Number::New (isolate, stats->dispatches));
+    obj->Set (String::NewFromUtf8 (isolate, "spuriousWakeups"), Number::New (isolate, stats->spurious_wakeups));
+    obj->Set (String::NewFromUtf8 (isolate, "uvTime"), Number::New (isolate, stats->uv_us / 1000.0));
+    obj->Set (String::NewFromUtf8 (isolate, "glibTime"), Number::New (isolate, stats->glib_us / 1000.0));
+    obj->Set (String::NewFromUtf8 (isolate, "pollTime"), Number::New (isolate, stats->poll_us / 1000.0));
+    obj->Set (String::NewFromUtf8 (isolate, "infiniteTimeouts"), Number::New (isolate, stats->infinite_timeouts));
+    obj->Set (String::NewFromUtf8 (isolate, "timeouts"), MakeHistogram (isolate, stats->timeouts));
+    obj->Set (String::NewFromUtf8 (isolate, "dispatchDurations"), MakeHistogram (isolate, stats->dispatch_durations));
+    args.GetReturnValue ().Set (obj);
+}
+
+/* Context aware, so that worker_threads can load it too; every
+ * isolate gets its own GNodeJS::IsolateData. */
+void InitModule(Local<Object> exports, Local<Value> module, Local<Context> context, void *priv) {
+    Isolate *isolate = context->GetIsolate ();
+    GNodeJS::IsolateDataInit (context);
 
     /* XXX: This is an ugly collection of random bits and pieces. We should organize
      * this functionality a lot better and clean it up. */
@@ -187,6 +371,7 @@ void InitModule(Local<Object> exports, Local<Value> module, void *priv) {
     exports->Set (String::NewFromUtf8 (isolate, "MakeFunction"), FunctionTemplate::New (isolate, MakeFunction)->GetFunction ());
 
     exports->Set (String::NewFromUtf8 (isolate, "MakeClass"), FunctionTemplate::New (isolate, MakeClass)->GetFunction ());
+    exports->Set (String::NewFromUtf8 (isolate, "ObjectFromPointer"), FunctionTemplate::New (isolate, ObjectFromPointer)->GetFunction ());
     exports->Set (String::NewFromUtf8 (isolate, "ObjectPropertyGetter"), FunctionTemplate::New (isolate, ObjectPropertyGetter)->GetFunction ());
     exports->Set (String::NewFromUtf8 (isolate, "ObjectPropertySetter"), FunctionTemplate::New (isolate, ObjectPropertySetter)->GetFunction ());
 
@@ -194,7 +379,18 @@ void InitModule(Local<Object> exports, Local<Value> module, void *priv) {
     exports->Set (String::NewFromUtf8 (isolate, "BoxedFieldGetter"), FunctionTemplate::New (isolate, BoxedFieldGetter)->GetFunction ());
     exports->Set (String::NewFromUtf8 (isolate, "BoxedFieldSetter"), FunctionTemplate::New (isolate, BoxedFieldSetter)->GetFunction ());
 
+    exports->Set (String::NewFromUtf8 (isolate, "Require"), FunctionTemplate::New (isolate, Require)->GetFunction ());
+    exports->Set (String::NewFromUtf8 (isolate, "BuildClass"), FunctionTemplate::New (isolate, BuildClass)->GetFunction ());
+    exports->Set (String::NewFromUtf8 (isolate, "BuildNamespace"), FunctionTemplate::New (isolate, BuildNamespace)->GetFunction ());
+
     exports->Set (String::NewFromUtf8 (isolate, "StartLoop"), FunctionTemplate::New (isolate, StartLoop)->GetFunction ());
+    exports->Set (String::NewFromUtf8 (isolate, "StopLoop"), FunctionTemplate::New (isolate, StopLoop)->GetFunction ());
+    exports->Set (String::NewFromUtf8 (isolate, "SetLoopStatsEnabled"), FunctionTemplate::New (isolate, SetLoopStatsEnabled)->GetFunction ());
+    exports->Set (String::NewFromUtf8 (isolate, "GetLoopStats"), FunctionTemplate::New (isolate, GetLoopStats)->GetFunction ());
+    exports->Set (String::NewFromUtf8 (isolate, "SetFunctionProfilingEnabled"), FunctionTemplate::New (isolate, SetFunctionProfilingEnabled)->GetFunction ());
+    exports->Set (String::NewFromUtf8 (isolate, "GetFunctionProfile"), FunctionTemplate::New (isolate, GetFunctionProfile)->GetFunction ());
+    exports->Set (String::NewFromUtf8 (isolate, "StartTracing"), FunctionTemplate::New (isolate, StartTracing)->GetFunction ());
+    exports->Set (String::NewFromUtf8 (isolate, "StopTracing"), FunctionTemplate::New (isolate, StopTracing)->GetFunction ());
 }
 
-NODE_MODULE(gi, InitModule)
+NODE_MODULE_CONTEXT_AWARE(gi, InitModule)
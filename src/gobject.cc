@@ -4,26 +4,51 @@
 #include "function.h"
 #include "value.h"
 #include "closure.h"
+#include "isolate.h"
+#include "trace.h"
+
+#include <string.h>
+#include <uv.h>
 
 using namespace v8;
 
 namespace GNodeJS {
 
+/* Throws and returns false on an unknown property or a value that
+ * fails to convert. */
 static bool InitGParameterFromProperty(GParameter    *parameter,
                                        void          *klass,
                                        Local<String> name,
                                        Local<Value>  value) {
+    Isolate *isolate = Isolate::GetCurrent ();
     String::Utf8Value name_str (name);
     GParamSpec *pspec = g_object_class_find_property (G_OBJECT_CLASS (klass), *name_str);
-    if (pspec == NULL)
+    if (pspec == NULL) {
+        char *message = g_strdup_printf ("Unknown property %s.", *name_str);
+        isolate->ThrowException (Exception::TypeError (String::NewFromUtf8 (isolate, message)));
+        g_free (message);
         return false;
+    }
 
     parameter->name = pspec->name;
     g_value_init (&parameter->value, G_PARAM_SPEC_VALUE_TYPE (pspec));
+
+    TryCatch try_catch;
     V8ToGValue (&parameter->value, value);
+    if (try_catch.HasCaught ()) {
+        try_catch.ReThrow ();
+        return false;
+    }
     return true;
 }
 
+static void FreeGParameters(GParameter *parameters, int n_parameters) {
+    for (int i = 0; i < n_parameters; i++)
+        if (G_IS_VALUE (&parameters[i].value))
+            g_value_unset (&parameters[i].value);
+    g_free (parameters);
+}
+
 static bool InitGParametersFromProperty(GParameter    **parameters_p,
                                         int            *n_parameters_p,
                                         void           *klass,
@@ -36,8 +61,10 @@ static bool InitGParametersFromProperty(GParameter    **parameters_p,
         Local<Value> name = properties->Get (i);
         Local<Value> value = property_hash->Get (name);
 
-        if (!InitGParameterFromProperty (&parameters[i], klass, name->ToString (), value))
+        if (!InitGParameterFromProperty (&parameters[i], klass, name->ToString (), value)) {
+            FreeGParameters (parameters, n_parameters);
             return false;
+        }
     }
 
     *parameters_p = parameters;
@@ -47,16 +74,22 @@ static bool InitGParametersFromProperty(GParameter    **parameters_p,
 
 static void ToggleNotify(gpointer user_data, GObject *gobject, gboolean toggle_down);
 
-static G_DEFINE_QUARK(gnode_js_object, gnode_js_object);
-
+/* Each isolate keeps its wrapper under a qdata key of its own, and
+ * passes its IsolateData to the toggle notify. */
 static void AssociateGObject(Isolate *isolate, Local<Object> object, GObject *gobject) {
+    IsolateData *data = GetIsolateData (isolate);
+
     object->SetAlignedPointerInInternalField (0, gobject);
 
     g_object_ref_sink (gobject);
-    g_object_add_toggle_ref (gobject, ToggleNotify, NULL);
+    g_object_add_toggle_ref (gobject, ToggleNotify, data);
 
     Persistent<Object> *persistent = new Persistent<Object>(isolate, object);
-    g_object_set_qdata (gobject, gnode_js_object_quark (), persistent);
+    g_object_set_qdata (gobject, data->object_quark, persistent);
+
+    if (data->objects == NULL)
+        data->objects = g_hash_table_new (NULL, NULL);
+    g_hash_table_add (data->objects, gobject);
 }
 
 static void GObjectConstructor(const FunctionCallbackInfo<Value> &args) {
@@ -88,6 +121,12 @@ static void GObjectConstructor(const FunctionCallbackInfo<Value> &args) {
 
         GObject *gobject;
         GIBaseInfo *info = (GIBaseInfo *) External::Cast (*args.Data ())->Value ();
+
+        if (info == NULL) {
+            isolate->ThrowException (Exception::TypeError (String::NewFromUtf8 (isolate, "Cannot construct a type without introspection data.")));
+            return;
+        }
+
         GType gtype = g_registered_type_info_get_g_type ((GIRegisteredTypeInfo *) info);
         void *klass = g_type_class_ref (gtype);
 
@@ -97,80 +136,359 @@ static void GObjectConstructor(const FunctionCallbackInfo<Value> &args) {
         if (args[0]->IsObject ()) {
             Local<Object> property_hash = args[0]->ToObject ();
 
-            if (!InitGParametersFromProperty (&parameters, &n_parameters, klass, property_hash)) {
-                isolate->ThrowException (Exception::TypeError (String::NewFromUtf8 (isolate, "Unable to make GParameters.")));
+            if (!InitGParametersFromProperty (&parameters, &n_parameters, klass, property_hash))
                 goto out;
-            }
         }
 
         gobject = (GObject *) g_object_newv (gtype, n_parameters, parameters);
         AssociateGObject (isolate, self, gobject);
 
     out:
-        g_free (parameters);
+        FreeGParameters (parameters, n_parameters);
         g_type_class_unref (klass);
     }
 }
 
-static G_DEFINE_QUARK(gnode_js_template, gnode_js_template);
-
-static void SignalConnectInternal(const FunctionCallbackInfo<Value> &args, bool after) {
+/* coalesce_interval is -1 for a plain handler, and otherwise the
+ * interval passed to MakeCoalescedClosure. */
+static void SignalConnectInternal(const FunctionCallbackInfo<Value> &args, bool after, int coalesce_interval) {
     Isolate *isolate = args.GetIsolate ();
     GObject *gobject = GObjectFromWrapper (args.This ());
 
     String::Utf8Value signal_name (args[0]->ToString ());
     Local<Function> callback = Local<Function>::Cast (args[1]->ToObject ());
-    GClosure *gclosure = MakeClosure (isolate, callback);
 
-    ulong handler_id = g_signal_connect_closure (gobject, *signal_name, gclosure, after);
+    guint signal_id;
+    GQuark detail;
+    if (!g_signal_parse_name (*signal_name, G_OBJECT_TYPE (gobject), &signal_id, &detail, TRUE)) {
+        char *message = g_strdup_printf ("Unknown signal %s.", *signal_name);
+        isolate->ThrowException (Exception::TypeError (String::NewFromUtf8 (isolate, message)));
+        g_free (message);
+        return;
+    }
+
+    if (coalesce_interval >= 0) {
+        GSignalQuery query;
+        g_signal_query (signal_id, &query);
+        if ((query.return_type & ~G_SIGNAL_TYPE_STATIC_SCOPE) != G_TYPE_NONE) {
+            isolate->ThrowException (Exception::TypeError (String::NewFromUtf8 (isolate, "Signals with a return value cannot be coalesced.")));
+            return;
+        }
+    }
+
+    GClosure *gclosure = MakeClosure (isolate, callback, signal_id);
+    if (coalesce_interval >= 0)
+        gclosure = MakeCoalescedClosure (gclosure, coalesce_interval);
+
+    ulong handler_id = g_signal_connect_closure_by_id (gobject, signal_id, detail, gclosure, after);
     args.GetReturnValue ().Set(Integer::NewFromUnsigned (isolate, handler_id));
 }
 
 static void SignalConnect(const FunctionCallbackInfo<Value> &args) {
-    SignalConnectInternal (args, false);
+    SignalConnectInternal (args, false, -1);
+}
+
+/* Interval of the 'frame' policy, for 60 frames per second */
+#define COALESCE_FRAME_MS 16
+
+/* obj.connectCoalesced(signal, callback, policy): for signals that fire
+ * far more often than JS cares about. Emissions are merged natively and
+ * the callback gets the arguments of the last one, either once the main
+ * loop is idle ('idle'), once per frame ('frame'), or at most policy
+ * times per second (a number). */
+static void SignalConnectCoalesced(const FunctionCallbackInfo<Value> &args) {
+    Isolate *isolate = args.GetIsolate ();
+    Local<Value> policy = args[2];
+    String::Utf8Value policy_name (policy);
+    int interval;
+
+    if (policy->IsNumber () && policy->NumberValue () > 0) {
+        interval = MAX ((int) (1000 / policy->NumberValue ()), 1);
+    } else if (policy->IsString () && strcmp (*policy_name, "idle") == 0) {
+        interval = 0;
+    } else if (policy->IsString () && strcmp (*policy_name, "frame") == 0) {
+        interval = COALESCE_FRAME_MS;
+    } else {
+        isolate->ThrowException (Exception::TypeError (String::NewFromUtf8 (isolate, "Expected 'idle', 'frame' or a number of calls per second.")));
+        return;
+    }
+
+    SignalConnectInternal (args, false, interval);
+}
+
+/* obj.setProperties({ ... }): sets all properties with notifications
+ * frozen, so listeners see one batch of notify emissions at the end. */
+static void SetProperties(const FunctionCallbackInfo<Value> &args) {
+    Isolate *isolate = args.GetIsolate ();
+    GObject *gobject = GObjectFromWrapper (args.This ());
+
+    if (!args[0]->IsObject ()) {
+        isolate->ThrowException (Exception::TypeError (String::NewFromUtf8 (isolate, "Expected an object.")));
+        return;
+    }
+
+    GParameter *parameters = NULL;
+    int n_parameters = 0;
+    Local<Object> property_hash = args[0]->ToObject ();
+
+    /* Nothing is set unless every value converts. */
+    if (!InitGParametersFromProperty (&parameters, &n_parameters, G_OBJECT_GET_CLASS (gobject), property_hash))
+        return;
+
+    g_object_freeze_notify (gobject);
+    for (int i = 0; i < n_parameters; i++)
+        g_object_set_property (gobject, parameters[i].name, &parameters[i].value);
+    g_object_thaw_notify (gobject);
+
+    FreeGParameters (parameters, n_parameters);
+}
+
+/* obj.getProperties([ ... ]): reads all named properties into one object. */
+static void GetProperties(const FunctionCallbackInfo<Value> &args) {
+    Isolate *isolate = args.GetIsolate ();
+    GObject *gobject = GObjectFromWrapper (args.This ());
+
+    if (!args[0]->IsArray ()) {
+        isolate->ThrowException (Exception::TypeError (String::NewFromUtf8 (isolate, "Expected an array.")));
+        return;
+    }
+
+    Local<Array> names = Local<Array>::Cast (args[0]->ToObject ());
+    Local<Object> result = Object::New (isolate);
+    GObjectClass *klass = G_OBJECT_GET_CLASS (gobject);
+
+    int n_names = names->Length ();
+    for (int i = 0; i < n_names; i++) {
+        Local<String> name = names->Get (i)->ToString ();
+        String::Utf8Value name_str (name);
+
+        GParamSpec *pspec = g_object_class_find_property (klass, *name_str);
+        if (pspec == NULL) {
+            char *message = g_strdup_printf ("Unknown property %s.", *name_str);
+            isolate->ThrowException (Exception::TypeError (String::NewFromUtf8 (isolate, message)));
+            g_free (message);
+            return;
+        }
+
+        GValue value = {};
+        g_value_init (&value, G_PARAM_SPEC_VALUE_TYPE (pspec));
+        g_object_get_property (gobject, pspec->name, &value);
+        result->Set (name, GValueToV8 (isolate, &value));
+        g_value_unset (&value);
+    }
+
+    args.GetReturnValue ().Set (result);
 }
 
 static Local<FunctionTemplate> GetBaseClassTemplate(Isolate *isolate) {
     Local<FunctionTemplate> tpl = FunctionTemplate::New (isolate);
     Local<ObjectTemplate> proto = tpl->PrototypeTemplate ();
     proto->Set (String::NewFromUtf8 (isolate, "connect"), FunctionTemplate::New (isolate, SignalConnect)->GetFunction ());
+    proto->Set (String::NewFromUtf8 (isolate, "connectCoalesced"), FunctionTemplate::New (isolate, SignalConnectCoalesced)->GetFunction ());
+    proto->Set (String::NewFromUtf8 (isolate, "setProperties"), FunctionTemplate::New (isolate, SetProperties)->GetFunction ());
+    proto->Set (String::NewFromUtf8 (isolate, "getProperties"), FunctionTemplate::New (isolate, GetProperties)->GetFunction ());
     return tpl;
 }
 
-static Local<FunctionTemplate> GetClassTemplateFromGI(Isolate *isolate, GIBaseInfo *info);
+Local<Value> GetObjectProperty(Isolate *isolate, GObject *gobject, const char *prop_name) {
+    GParamSpec *pspec = g_object_class_find_property (G_OBJECT_GET_CLASS (gobject), prop_name);
+    GValue value = {};
+    g_value_init (&value, G_PARAM_SPEC_VALUE_TYPE (pspec));
 
-static void ClassDestroyed(const WeakCallbackData<FunctionTemplate, GIBaseInfo> &data) {
-    GIBaseInfo *info = data.GetParameter ();
-    GType gtype = g_registered_type_info_get_g_type ((GIRegisteredTypeInfo *) info);
+    g_object_get_property (gobject, prop_name, &value);
 
-    void *type_data = g_type_get_qdata (gtype, gnode_js_template_quark ());
-    assert (type_data != NULL);
-    Persistent<FunctionTemplate> *persistent = (Persistent<FunctionTemplate> *) type_data;
-    delete persistent;
+    Local<Value> result = GValueToV8 (isolate, &value);
+    g_value_unset (&value);
+    return result;
+}
+
+void SetObjectProperty(GObject *gobject, const char *prop_name, Local<Value> v8_value) {
+    GParamSpec *pspec = g_object_class_find_property (G_OBJECT_GET_CLASS (gobject), prop_name);
+    GValue value = {};
+    g_value_init (&value, G_PARAM_SPEC_VALUE_TYPE (pspec));
+
+    /* A value that failed to convert must not reach the object. */
+    TryCatch try_catch;
+    V8ToGValue (&value, v8_value);
+    if (try_catch.HasCaught ())
+        try_catch.ReThrow ();
+    else
+        g_object_set_property (gobject, prop_name, &value);
+
+    g_value_unset (&value);
+}
+
+/* Everything a property accessor needs. Only the name is known when the
+ * class template is built; the pspec and converters are resolved from
+ * the object's class the first time the property is used, and from then
+ * on reading or writing it is a single g_object_get/set_property, with
+ * no V8 string conversion or pspec lookup on our side. */
+struct PropertyAccessor {
+    const char *name;
+    GParamSpec *pspec;
+    GValueToV8Func to_v8;
+    V8ToGValueFunc from_v8;
+    Persistent<External> persistent;
+};
+
+static bool PropertyAccessorResolve(Isolate *isolate, PropertyAccessor *accessor, GObject *gobject) {
+    if (accessor->pspec)
+        return true;
+
+    GParamSpec *pspec = g_object_class_find_property (G_OBJECT_GET_CLASS (gobject), accessor->name);
+    if (pspec == NULL) {
+        char *message = g_strdup_printf ("Unknown property %s.", accessor->name);
+        isolate->ThrowException (Exception::TypeError (String::NewFromUtf8 (isolate, message)));
+        g_free (message);
+        return false;
+    }
+
+    GType value_type = G_PARAM_SPEC_VALUE_TYPE (pspec);
+    accessor->pspec = g_param_spec_ref (pspec);
+    accessor->to_v8 = GetGValueToV8Func (value_type);
+    accessor->from_v8 = GetV8ToGValueFunc (value_type);
+    return true;
+}
+
+static void PropertyGetter(Local<String> name, const PropertyCallbackInfo<Value> &info) {
+    Isolate *isolate = info.GetIsolate ();
+    PropertyAccessor *accessor = (PropertyAccessor *) External::Cast (*info.Data ())->Value ();
+    GObject *gobject = GObjectFromWrapper (info.This ());
+
+    /* Write-only properties read as undefined */
+    if (!PropertyAccessorResolve (isolate, accessor, gobject) || !(accessor->pspec->flags & G_PARAM_READABLE))
+        return;
+
+    GValue value = {};
+    g_value_init (&value, G_PARAM_SPEC_VALUE_TYPE (accessor->pspec));
+    g_object_get_property (gobject, accessor->pspec->name, &value);
+
+    info.GetReturnValue ().Set (accessor->to_v8 (isolate, &value));
+    g_value_unset (&value);
+}
 
-    g_type_set_qdata (gtype, gnode_js_template_quark (), NULL);
-    g_base_info_unref (info);
+static void PropertySetter(Local<String> name, Local<Value> v8_value, const PropertyCallbackInfo<void> &info) {
+    Isolate *isolate = info.GetIsolate ();
+    PropertyAccessor *accessor = (PropertyAccessor *) External::Cast (*info.Data ())->Value ();
+    GObject *gobject = GObjectFromWrapper (info.This ());
+
+    if (!PropertyAccessorResolve (isolate, accessor, gobject))
+        return;
+
+    GValue value = {};
+    g_value_init (&value, G_PARAM_SPEC_VALUE_TYPE (accessor->pspec));
+
+    TryCatch try_catch;
+    accessor->from_v8 (&value, v8_value);
+    if (try_catch.HasCaught ())
+        try_catch.ReThrow ();
+    else
+        g_object_set_property (gobject, accessor->pspec->name, &value);
+
+    g_value_unset (&value);
+}
+
+static void PropertyAccessorDestroyed(const WeakCallbackData<External, PropertyAccessor> &data) {
+    PropertyAccessor *accessor = data.GetParameter ();
+    if (accessor->pspec)
+        g_param_spec_unref (accessor->pspec);
+    accessor->persistent.Reset ();
+    delete accessor;
+}
+
+/* The readable and writable flags come from the typelib, so that the
+ * class itself doesn't have to be initialized yet. */
+static void DefineClassProperty(Isolate *isolate, Local<ObjectTemplate> proto, GIPropertyInfo *prop_info) {
+    const char *prop_name = g_base_info_get_name ((GIBaseInfo *) prop_info);
+    GParamFlags flags = g_property_info_get_flags (prop_info);
+
+    bool readable = (flags & G_PARAM_READABLE);
+    bool writable = (flags & G_PARAM_WRITABLE) && !(flags & G_PARAM_CONSTRUCT_ONLY);
+    if (!readable && !writable)
+        return;
+
+    PropertyAccessor *accessor = new PropertyAccessor ();
+    accessor->name = g_intern_string (prop_name);
+
+    Local<External> data = External::New (isolate, accessor);
+    accessor->persistent.Reset (isolate, data);
+    accessor->persistent.SetWeak (accessor, PropertyAccessorDestroyed);
+
+    char *js_name = g_strdelimit (g_strdup (prop_name), "-", '_');
+    Local<String> name = String::NewFromUtf8 (isolate, js_name);
+    g_free (js_name);
+
+    if (writable)
+        proto->SetAccessor (name, PropertyGetter, PropertySetter, data);
+    else
+        proto->SetAccessor (name, PropertyGetter, NULL, data, DEFAULT, ReadOnly);
 }
 
+/* Methods of an interface go on the prototype of every class that
+ * implements it, unless the class has a method of the same name. */
+static void DefineInterfaceMethods(Isolate *isolate, Local<FunctionTemplate> tpl,
+                                   GIInterfaceInfo *iface_info, GIObjectInfo *info) {
+    int n_methods = g_interface_info_get_n_methods (iface_info);
+    for (int i = 0; i < n_methods; i++) {
+        GIFunctionInfo *meth_info = g_interface_info_get_method (iface_info, i);
+        const char *name = g_base_info_get_name ((GIBaseInfo *) meth_info);
+        GIFunctionInfo *own_info = info ? g_object_info_find_method (info, name) : NULL;
+
+        if (own_info)
+            g_base_info_unref ((GIBaseInfo *) own_info);
+        else if (g_function_info_get_flags (meth_info) & GI_FUNCTION_IS_METHOD)
+            DefineMethod (isolate, tpl, meth_info);
+
+        g_base_info_unref ((GIBaseInfo *) meth_info);
+    }
+}
+
+static void DefineClassMembers(Isolate *isolate, Local<FunctionTemplate> tpl, GIObjectInfo *info) {
+    int n_methods = g_object_info_get_n_methods (info);
+    for (int i = 0; i < n_methods; i++) {
+        GIFunctionInfo *meth_info = g_object_info_get_method (info, i);
+        DefineMethod (isolate, tpl, meth_info);
+        g_base_info_unref ((GIBaseInfo *) meth_info);
+    }
+
+    int n_interfaces = g_object_info_get_n_interfaces (info);
+    for (int i = 0; i < n_interfaces; i++) {
+        GIInterfaceInfo *iface_info = g_object_info_get_interface (info, i);
+        DefineInterfaceMethods (isolate, tpl, iface_info, info);
+        g_base_info_unref ((GIBaseInfo *) iface_info);
+    }
+
+    Local<ObjectTemplate> proto = tpl->PrototypeTemplate ();
+
+    int n_properties = g_object_info_get_n_properties (info);
+    for (int i = 0; i < n_properties; i++) {
+        GIPropertyInfo *prop_info = g_object_info_get_property (info, i);
+        DefineClassProperty (isolate, proto, prop_info);
+        g_base_info_unref ((GIBaseInfo *) prop_info);
+    }
+}
+
+static Local<FunctionTemplate> GetClassTemplateFromGI(Isolate *isolate, GIBaseInfo *info);
+
 static Local<FunctionTemplate> GetClassTemplate(Isolate *isolate, GIBaseInfo *info, GType gtype) {
-    void *data = g_type_get_qdata (gtype, gnode_js_template_quark ());
+    IsolateData *data = GetIsolateData (isolate);
+    Local<FunctionTemplate> cached = GetCachedTemplate (data, gtype);
 
-    if (data) {
-        Persistent<FunctionTemplate> *persistent = (Persistent<FunctionTemplate> *) data;
-        Local<FunctionTemplate> tpl = Local<FunctionTemplate>::New (isolate, *persistent);
-        return tpl;
+    if (!cached.IsEmpty ()) {
+        return cached;
     } else {
         Local<FunctionTemplate> tpl = FunctionTemplate::New (isolate, GObjectConstructor, External::New (isolate, info));
-
-        Persistent<FunctionTemplate> *persistent = new Persistent<FunctionTemplate>(isolate, tpl);
-        persistent->SetWeak (g_base_info_ref (info), ClassDestroyed);
-        g_type_set_qdata (gtype, gnode_js_template_quark (), persistent);
+        CacheTemplate (data, gtype, info, tpl);
 
         const char *class_name = g_base_info_get_name (info);
         tpl->SetClassName (String::NewFromUtf8 (isolate, class_name));
 
         tpl->InstanceTemplate ()->SetInternalFieldCount (1);
 
+        /* Methods, static functions and property accessors all go on the
+         * template before it is first instantiated. */
+        DefineClassMembers (isolate, tpl, info);
+
         GIObjectInfo *parent_info = g_object_info_get_parent (info);
         if (parent_info) {
             Local<FunctionTemplate> parent_tpl = GetClassTemplateFromGI (isolate, (GIBaseInfo *) parent_info);
@@ -188,10 +506,83 @@ static Local<FunctionTemplate> GetClassTemplateFromGI(Isolate *isolate, GIBaseIn
     return GetClassTemplate (isolate, info, gtype);
 }
 
+/* What g_irepository_find_by_gtype said about a GType, memoized in its
+ * qdata; the cache keeps the reference. Types it knows nothing about get
+ * a marker, so that they cost one lookup and not one per wrapper. The
+ * marker records the typelib generation it was set in, and is only
+ * trusted until another typelib is loaded. */
+static G_DEFINE_QUARK(gnode_js_info, gnode_js_info);
+static G_DEFINE_QUARK(gnode_js_info_generation, gnode_js_info_generation);
+static char not_introspected;
+static gint typelib_generation = 1;
+
+void ForgetUnknownGTypes() {
+    g_atomic_int_inc (&typelib_generation);
+}
+
+static GIBaseInfo * FindInfoByGType(GType gtype) {
+    void *data = g_type_get_qdata (gtype, gnode_js_info_quark ());
+    guint generation = g_atomic_int_get (&typelib_generation);
+
+    if (data == &not_introspected &&
+        GPOINTER_TO_UINT (g_type_get_qdata (gtype, gnode_js_info_generation_quark ())) == generation)
+        return NULL;
+    if (data && data != &not_introspected)
+        return (GIBaseInfo *) data;
+
+    GIBaseInfo *info = g_irepository_find_by_gtype (NULL, gtype);
+    g_type_set_qdata (gtype, gnode_js_info_generation_quark (), GUINT_TO_POINTER (generation));
+    g_type_set_qdata (gtype, gnode_js_info_quark (), info ? (void *) info : (void *) &not_introspected);
+    return info;
+}
+
+static Local<FunctionTemplate> GetClassTemplateFromGType(Isolate *isolate, GType gtype);
+
+/* Types without introspection data, like GLocalFile or the private
+ * implementations behind many factories, get a template of their own
+ * that inherits from the nearest introspected ancestor and adds the
+ * methods of the introspected interfaces that ancestor doesn't have. */
+static Local<FunctionTemplate> GetPrivateClassTemplate(Isolate *isolate, GType gtype) {
+    Local<FunctionTemplate> tpl = FunctionTemplate::New (isolate, GObjectConstructor, External::New (isolate, NULL));
+    CacheTemplate (GetIsolateData (isolate), gtype, NULL, tpl);
+
+    tpl->SetClassName (String::NewFromUtf8 (isolate, g_type_name (gtype)));
+    tpl->InstanceTemplate ()->SetInternalFieldCount (1);
+
+    GType parent_gtype = g_type_parent (gtype);
+
+    guint n_interfaces;
+    GType *interfaces = g_type_interfaces (gtype, &n_interfaces);
+    for (guint i = 0; i < n_interfaces; i++) {
+        if (parent_gtype != 0 && g_type_is_a (parent_gtype, interfaces[i]))
+            continue;
+
+        GIBaseInfo *iface_info = FindInfoByGType (interfaces[i]);
+        if (iface_info && g_base_info_get_type (iface_info) == GI_INFO_TYPE_INTERFACE)
+            DefineInterfaceMethods (isolate, tpl, (GIInterfaceInfo *) iface_info, NULL);
+    }
+    g_free (interfaces);
+
+    if (parent_gtype != 0)
+        tpl->Inherit (GetClassTemplateFromGType (isolate, parent_gtype));
+    else
+        tpl->Inherit (GetBaseClassTemplate (isolate));
+
+    return tpl;
+}
+
+/* Every type along the way ends up with a cached template, so the
+ * next object of any of them is wrapped without a lookup. */
 static Local<FunctionTemplate> GetClassTemplateFromGType(Isolate *isolate, GType gtype) {
-    GIRepository *repo = g_irepository_get_default ();
-    GIBaseInfo *info = g_irepository_find_by_gtype (repo, gtype);
-    return GetClassTemplate (isolate, info, gtype);
+    Local<FunctionTemplate> cached = GetCachedTemplate (GetIsolateData (isolate), gtype);
+    if (!cached.IsEmpty ())
+        return cached;
+
+    GIBaseInfo *info = FindInfoByGType (gtype);
+    if (info && g_base_info_get_type (info) == GI_INFO_TYPE_OBJECT)
+        return GetClassTemplate (isolate, info, gtype);
+    else
+        return GetPrivateClassTemplate (isolate, gtype);
 }
 
 Local<Function> MakeClass(Isolate *isolate, GIBaseInfo *info) {
@@ -199,24 +590,88 @@ Local<Function> MakeClass(Isolate *isolate, GIBaseInfo *info) {
     return tpl->GetFunction ();
 }
 
+/* Most at a time, so a big tree going away is spread over several loop
+ * iterations */
+#define RELEASE_BATCH_SIZE 64
+
+/* Drops the toggle ref of an object whose wrapper was collected, which
+ * is the last reference unless native code took one meanwhile. */
+static void ReleaseGObject(IsolateData *data, GObject *gobject) {
+    /* Wrapped again in the meantime: the new wrapper has a toggle ref of
+     * its own, and keeps the entry. */
+    if (g_object_get_qdata (gobject, data->object_quark) == NULL)
+        g_hash_table_remove (data->objects, gobject);
+    g_object_remove_toggle_ref (gobject, ToggleNotify, data);
+}
+
+static void ReleaseIdle(uv_idle_t *handle) {
+    IsolateData *data = (IsolateData *) handle->data;
+    GPtrArray *pending = data->pending_releases;
+    guint64 start = TraceEnabled () ? TraceNow () : 0;
+    TopLevelScope top_level_scope (data);
+
+    /* Dispose handlers can run JS and collect more wrappers, so take
+     * the objects off one by one. */
+    for (int i = 0; i < RELEASE_BATCH_SIZE && pending->len > 0; i++) {
+        GObject *gobject = (GObject *) g_ptr_array_index (pending, pending->len - 1);
+        g_ptr_array_remove_index (pending, pending->len - 1);
+        ReleaseGObject (data, gobject);
+    }
+
+    if (pending->len == 0)
+        uv_idle_stop (handle);
+
+    if (start)
+        TraceEvent ("gc", "release GObjects", start, TraceNow ());
+}
+
+static void ReleaseIdleClosed(uv_handle_t *handle) {
+    g_free (handle);
+}
+
 static void ObjectDestroyed(const WeakCallbackData<Object, GObject> &data) {
     GObject *gobject = data.GetParameter ();
+    IsolateData *isolate_data = GetIsolateData (data.GetIsolate ());
 
-    void *type_data = g_object_get_qdata (gobject, gnode_js_object_quark ());
+    void *type_data = g_object_get_qdata (gobject, isolate_data->object_quark);
     assert (type_data != NULL);
     Persistent<Object> *persistent = (Persistent<Object> *) type_data;
     delete persistent;
 
     /* We're destroying the wrapper object, so make sure to clear out
      * the qdata that points back to us. */
-    g_object_set_qdata (gobject, gnode_js_object_quark (), NULL);
+    g_object_set_qdata (gobject, isolate_data->object_quark, NULL);
+
+    /* Dropping the reference can dispose a whole widget tree, which has
+     * no business running inside a GC pause. It is queued instead, and
+     * an idle handle releases the queue in batches. */
+    if (isolate_data->release_idle == NULL) {
+#if NODE_MAJOR_VERSION >= 10
+        uv_loop_t *loop = node::GetCurrentEventLoop (data.GetIsolate ());
+#else
+        uv_loop_t *loop = uv_default_loop ();
+#endif
+        isolate_data->pending_releases = g_ptr_array_new ();
+        isolate_data->release_idle = g_new0 (uv_idle_t, 1);
+        uv_idle_init (loop, isolate_data->release_idle);
+        isolate_data->release_idle->data = isolate_data;
+    }
 
-    g_object_unref (gobject);
+    /* The handle stays referenced while it is started, i.e. while the
+     * queue has anything in it: when GLib runs the show, uv is only
+     * iterated while its loop is alive. */
+    if (isolate_data->pending_releases->len == 0)
+        uv_idle_start (isolate_data->release_idle, ReleaseIdle);
+    g_ptr_array_add (isolate_data->pending_releases, gobject);
 }
 
 static void ToggleNotify(gpointer user_data, GObject *gobject, gboolean toggle_down) {
-    void *data = g_object_get_qdata (gobject, gnode_js_object_quark ());
-    assert (data != NULL);
+    IsolateData *isolate_data = (IsolateData *) user_data;
+    void *data = g_object_get_qdata (gobject, isolate_data->object_quark);
+
+    /* The wrapper is gone and the release is queued. */
+    if (data == NULL)
+        return;
 
     Persistent<Object> *persistent = (Persistent<Object> *) data;
 
@@ -232,7 +687,10 @@ static void ToggleNotify(gpointer user_data, GObject *gobject, gboolean toggle_d
 }
 
 Local<Value> WrapperFromGObject(Isolate *isolate, GObject *gobject) {
-    void *data = g_object_get_qdata (gobject, gnode_js_object_quark ());
+    if (gobject == NULL)
+        return Null (isolate);
+
+    void *data = g_object_get_qdata (gobject, GetIsolateData (isolate)->object_quark);
 
     if (data) {
         /* Easy case: we already have an object. */
@@ -252,6 +710,48 @@ Local<Value> WrapperFromGObject(Isolate *isolate, GObject *gobject) {
     }
 }
 
+/* Lets go of every GObject the isolate still holds. */
+void GObjectIsolateCleanup(IsolateData *data) {
+    if (data->release_idle) {
+        while (data->pending_releases->len > 0) {
+            GObject *gobject = (GObject *) g_ptr_array_index (data->pending_releases, data->pending_releases->len - 1);
+            g_ptr_array_remove_index (data->pending_releases, data->pending_releases->len - 1);
+            ReleaseGObject (data, gobject);
+        }
+        g_ptr_array_unref (data->pending_releases);
+        data->pending_releases = NULL;
+
+        uv_close ((uv_handle_t *) data->release_idle, ReleaseIdleClosed);
+        data->release_idle = NULL;
+    }
+
+    if (data->objects == NULL)
+        return;
+
+    GHashTableIter iter;
+    gpointer key;
+    g_hash_table_iter_init (&iter, data->objects);
+    while (g_hash_table_iter_next (&iter, &key, NULL)) {
+        GObject *gobject = G_OBJECT (key);
+        Persistent<Object> *persistent = (Persistent<Object> *) g_object_get_qdata (gobject, data->object_quark);
+
+        g_hash_table_iter_remove (&iter);
+
+        /* The toggle ref goes first, so the unref doesn't notify. */
+        g_object_remove_toggle_ref (gobject, ToggleNotify, data);
+
+        if (persistent) {
+            g_object_set_qdata (gobject, data->object_quark, NULL);
+            persistent->Reset ();
+            delete persistent;
+            g_object_unref (gobject);
+        }
+    }
+
+    g_hash_table_destroy (data->objects);
+    data->objects = NULL;
+}
+
 GObject * GObjectFromWrapper(Local<Value> value) {
     Local<Object> object = value->ToObject ();
     void *data = object->GetAlignedPointerFromInternalField (0);
@@ -12,4 +12,11 @@ v8::Local<v8::Function> MakeClass(v8::Isolate *isolate, GIBaseInfo *info);
 v8::Local<v8::Value> WrapperFromGObject(v8::Isolate *isolate, GObject *object);
 GObject * GObjectFromWrapper(v8::Local<v8::Value> value);
 
+v8::Local<v8::Value> GetObjectProperty(v8::Isolate *isolate, GObject *gobject, const char *prop_name);
+void SetObjectProperty(GObject *gobject, const char *prop_name, v8::Local<v8::Value> value);
+
+/* Called when a typelib is loaded: types found without introspection
+ * data so far are looked up again. */
+void ForgetUnknownGTypes();
+
 };
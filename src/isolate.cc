@@ -0,0 +1,128 @@
+
+#include "isolate.h"
+#include "dispatch.h"
+
+using namespace v8;
+
+namespace GNodeJS {
+
+/* Node runs every isolate on a thread of its own for the isolate's
+ * whole life, so the data can simply hang off the thread. */
+static GPrivate isolate_data_key;
+
+static void TemplateFree(gpointer data) {
+    Persistent<FunctionTemplate> *persistent = (Persistent<FunctionTemplate> *) data;
+    persistent->Reset ();
+    delete persistent;
+}
+
+static void IsolateDataFree(void *user_data) {
+    IsolateData *data = (IsolateData *) user_data;
+
+    /* Whatever other threads still queued refers to the rest. */
+    DispatcherClose (data->dispatcher);
+
+    /* Wrappers first: they may reference anything below. */
+    GObjectIsolateCleanup (data);
+    BoxedIsolateCleanup (data);
+    FunctionIsolateCleanup (data);
+
+    g_hash_table_destroy (data->templates);
+    g_hash_table_destroy (data->struct_templates);
+    g_ptr_array_unref (data->template_infos);
+    data->struct_array_template.Reset ();
+    data->context.Reset ();
+
+    if (g_private_get (&isolate_data_key) == data)
+        g_private_set (&isolate_data_key, NULL);
+
+    delete data;
+}
+
+IsolateData *IsolateDataInit(Local<Context> context) {
+    Isolate *isolate = context->GetIsolate ();
+    IsolateData *data = (IsolateData *) g_private_get (&isolate_data_key);
+    if (data) {
+        g_assert (data->isolate == isolate);
+        return data;
+    }
+
+    data = new IsolateData ();
+    data->isolate = isolate;
+    data->context.Reset (isolate, context);
+    data->thread = g_thread_self ();
+    data->dispatcher = DispatcherNew (data);
+    data->templates = g_hash_table_new_full (NULL, NULL, NULL, TemplateFree);
+    data->struct_templates = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, TemplateFree);
+    data->template_infos = g_ptr_array_new_with_free_func ((GDestroyNotify) g_base_info_unref);
+
+    char *quark_name = g_strdup_printf ("gnode_js_object_%p", (void *) isolate);
+    data->object_quark = g_quark_from_string (quark_name);
+    g_free (quark_name);
+
+    g_private_set (&isolate_data_key, data);
+
+#if NODE_MAJOR_VERSION > 10 || (NODE_MAJOR_VERSION == 10 && NODE_MINOR_VERSION >= 2)
+    node::AddEnvironmentCleanupHook (isolate, IsolateDataFree, data);
+#else
+    node::AtExit (IsolateDataFree, data);
+#endif
+
+    return data;
+}
+
+IsolateData *GetIsolateData(Isolate *isolate) {
+    IsolateData *data = (IsolateData *) g_private_get (&isolate_data_key);
+    g_assert (data != NULL && data->isolate == isolate);
+    return data;
+}
+
+TopLevelScope::TopLevelScope(IsolateData *data)
+    : handle_scope (data->isolate),
+      context_scope (Local<Context>::New (data->isolate, data->context)),
+#if NODE_MAJOR_VERSION >= 10
+      callback_scope (data->isolate, Object::New (data->isolate), { 0, 0 }),
+#endif
+      isolate (data->isolate) {
+}
+
+TopLevelScope::~TopLevelScope() {
+#if NODE_MAJOR_VERSION < 10
+    isolate->RunMicrotasks ();
+#endif
+}
+
+void ForwardException(Isolate *isolate, TryCatch &try_catch) {
+    if (StackTrace::CurrentStackTrace (isolate, 1)->GetFrameCount () > 0)
+        try_catch.ReThrow ();
+    else
+        node::FatalException (isolate, try_catch);
+}
+
+static Local<FunctionTemplate> TemplateFromCache(Isolate *isolate, void *cached) {
+    if (cached == NULL)
+        return Local<FunctionTemplate> ();
+    return Local<FunctionTemplate>::New (isolate, *(Persistent<FunctionTemplate> *) cached);
+}
+
+Local<FunctionTemplate> GetCachedTemplate(IsolateData *data, GType gtype) {
+    return TemplateFromCache (data->isolate, g_hash_table_lookup (data->templates, GSIZE_TO_POINTER (gtype)));
+}
+
+Local<FunctionTemplate> GetCachedTemplate(IsolateData *data, const char *struct_key) {
+    return TemplateFromCache (data->isolate, g_hash_table_lookup (data->struct_templates, struct_key));
+}
+
+void CacheTemplate(IsolateData *data, GType gtype, GIBaseInfo *info, Local<FunctionTemplate> tpl) {
+    g_hash_table_insert (data->templates, GSIZE_TO_POINTER (gtype), new Persistent<FunctionTemplate>(data->isolate, tpl));
+    if (info)
+        g_ptr_array_add (data->template_infos, g_base_info_ref (info));
+}
+
+void CacheTemplate(IsolateData *data, const char *struct_key, GIBaseInfo *info, Local<FunctionTemplate> tpl) {
+    g_hash_table_insert (data->struct_templates, g_strdup (struct_key), new Persistent<FunctionTemplate>(data->isolate, tpl));
+    if (info)
+        g_ptr_array_add (data->template_infos, g_base_info_ref (info));
+}
+
+};
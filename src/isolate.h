@@ -0,0 +1,98 @@
+
+#pragma once
+
+#include <node.h>
+#include <girepository.h>
+#include <uv.h>
+
+namespace GNodeJS {
+
+struct Dispatcher;
+
+/* Everything the addon keeps for one V8 isolate: the main thread's, or
+ * that of a worker_threads worker. Nothing in here is shared between
+ * isolates, and all of it is released by a cleanup hook when the
+ * isolate's environment goes away. */
+struct IsolateData {
+    v8::Isolate *isolate;
+    /* The context the module was loaded into */
+    v8::Persistent<v8::Context> context;
+    /* The thread the isolate runs JS on */
+    GThread *thread;
+    /* Hands work from other threads to that one */
+    Dispatcher *dispatcher;
+
+    /* GType -> Persistent<FunctionTemplate>, for classes and boxed types,
+     * and "Namespace.Name" -> Persistent<FunctionTemplate> for plain
+     * structs. Templates are held strongly and live as long as the
+     * isolate, along with the infos they were made from. */
+    GHashTable *templates;
+    GHashTable *struct_templates;
+    GPtrArray *template_infos;
+    v8::Persistent<v8::FunctionTemplate> struct_array_template;
+
+    /* Key of the wrapper in the qdata of GObjects wrapped here */
+    GQuark object_quark;
+    /* GObjects with a wrapper in this isolate */
+    GHashTable *objects;
+    /* GObjects whose wrapper was collected, released in batches by
+     * release_idle rather than inside the GC */
+    GPtrArray *pending_releases;
+    uv_idle_t *release_idle;
+    /* address -> BoxedInstance */
+    GHashTable *boxed_instances;
+    /* While arguments are marshalled for a call that outlives its
+     * handle scope: collects the wrappers of structs made from object
+     * literals, so the call can keep them alive. NULL otherwise. */
+    v8::Local<v8::Array> *made_structs;
+
+    /* "Namespace.Name" -> CallbackPlan */
+    GHashTable *callback_plans;
+
+    bool profiling_enabled;
+    /* FunctionInfos that have a profile */
+    GPtrArray *profiled_functions;
+};
+
+/* Sets up the data for the current isolate when the module is loaded
+ * into it; later loads get the same data back. */
+IsolateData *IsolateDataInit(v8::Local<v8::Context> context);
+
+/* The data of the isolate running on this thread */
+IsolateData *GetIsolateData(v8::Isolate *isolate);
+
+/* Brackets native callbacks that run JS with no JS up the stack, such
+ * as libuv handles and the GLib sources dispatched from them. Enters the
+ * module's context and, like node's own callbacks, runs the nextTick
+ * queue and the microtasks when it closes. */
+class TopLevelScope {
+public:
+    TopLevelScope(IsolateData *data);
+    ~TopLevelScope();
+
+private:
+    v8::HandleScope handle_scope;
+    v8::Context::Scope context_scope;
+#if NODE_MAJOR_VERSION >= 10
+    node::CallbackScope callback_scope;
+#endif
+    v8::Isolate *isolate;
+};
+
+/* Hands an exception caught around a call into JS on: back to the JS
+ * that caused the call if there is any, and to node's uncaught
+ * exception handling otherwise. */
+void ForwardException(v8::Isolate *isolate, v8::TryCatch &try_catch);
+
+/* Empty handles when nothing is cached yet */
+v8::Local<v8::FunctionTemplate> GetCachedTemplate(IsolateData *data, GType gtype);
+v8::Local<v8::FunctionTemplate> GetCachedTemplate(IsolateData *data, const char *struct_key);
+void CacheTemplate(IsolateData *data, GType gtype, GIBaseInfo *info, v8::Local<v8::FunctionTemplate> tpl);
+void CacheTemplate(IsolateData *data, const char *struct_key, GIBaseInfo *info, v8::Local<v8::FunctionTemplate> tpl);
+
+/* Cleanup of the per-isolate state each part of the addon keeps */
+void GObjectIsolateCleanup(IsolateData *data);
+void BoxedIsolateCleanup(IsolateData *data);
+void FunctionIsolateCleanup(IsolateData *data);
+
+};
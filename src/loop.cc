@@ -1,7 +1,10 @@
 
 #include "loop.h"
+#include "isolate.h"
+#include "trace.h"
 
 #include <glib.h>
+#include <string.h>
 #include <uv.h>
 
 /* Integration for the GLib main loop and uv's main loop */
@@ -9,13 +12,84 @@
 /* The way that this works is that we take uv's loop and nest it inside GLib's
  * mainloop, since nesting GLib inside uv seems to be fairly impossible until
  * either uv allows external sources to drive prepare/check, or until GLib
- * exposes an epoll fd to wait on... */
+ * exposes an epoll fd to wait on...
+ *
+ * For programs that never run a GLib main loop, there is also the reverse
+ * arrangement further down, where uv drives GLib's prepare/query/check/
+ * dispatch cycle by hand. */
 
 namespace GNodeJS {
 
+static bool stats_enabled;
+static LoopStats stats;
+
+/* Per-iteration bookkeeping. An iteration runs from one prepare to the
+ * next; whatever is not polling or dispatching the other side is
+ * charged to the side that owns the loop. */
+static gint64 iteration_start;
+static gint64 iteration_poll;
+static gint64 iteration_dispatch;
+
+static int StatsBucket (gint64 value) {
+    if (value <= 0)
+        return 0;
+    return MIN ((int) g_bit_storage ((gulong) value), LOOP_STATS_N_BUCKETS - 1);
+}
+
+static void StatsIteration (bool uv_owns_loop) {
+    gint64 now = g_get_monotonic_time ();
+
+    if (iteration_start != 0) {
+        gint64 owner = (now - iteration_start) - iteration_poll - iteration_dispatch;
+        if (owner < 0)
+            owner = 0;
+
+        if (uv_owns_loop) {
+            stats.uv_us += owner;
+            stats.glib_us += iteration_dispatch;
+        } else {
+            stats.glib_us += owner;
+            stats.uv_us += iteration_dispatch;
+        }
+        stats.poll_us += iteration_poll;
+    }
+
+    stats.prepares++;
+    iteration_start = now;
+    iteration_poll = 0;
+    iteration_dispatch = 0;
+}
+
+static void StatsTimeout (int timeout) {
+    if (timeout < 0)
+        stats.infinite_timeouts++;
+    else
+        stats.timeouts[StatsBucket (timeout)]++;
+}
+
+static void StatsDispatch (gint64 start) {
+    gint64 elapsed = g_get_monotonic_time () - start;
+    stats.dispatches++;
+    stats.dispatch_durations[StatsBucket (elapsed)]++;
+    iteration_dispatch += elapsed;
+}
+
+void SetLoopStatsEnabled(bool enabled) {
+    memset (&stats, 0, sizeof (stats));
+    iteration_start = 0;
+    stats_enabled = enabled;
+}
+
+const LoopStats *GetLoopStats() {
+    return stats_enabled ? &stats : NULL;
+}
+
 struct uv_loop_source {
     GSource source;
     uv_loop_t *loop;
+
+    /* When the timeout we last handed to GLib expires; for stats only */
+    gint64 wake_time;
 };
 
 static gboolean uv_loop_source_prepare (GSource *base, int *timeout) {
@@ -24,16 +98,34 @@ static gboolean uv_loop_source_prepare (GSource *base, int *timeout) {
 
     bool loop_alive = uv_loop_alive (source->loop);
 
+    if (stats_enabled)
+        StatsIteration (false);
+
     /* If the loop is dead, we can simply sleep forever until a GTK+ source
      * (presumably) wakes us back up again. */
-    if (!loop_alive)
+    if (!loop_alive) {
+        if (stats_enabled)
+            StatsTimeout (-1);
+        source->wake_time = 0;
         return FALSE;
+    }
 
     /* Otherwise, check the timeout. If the timeout is 0, that means we're
      * ready to go. Otherwise, keep sleeping until the timeout happens again. */
     int t = uv_backend_timeout (source->loop);
     *timeout = t;
 
+    if (stats_enabled) {
+        StatsTimeout (t);
+
+        /* GLib woke up on our timeout, yet uv has nothing due. This is
+         * mostly the millisecond rounding of both loops disagreeing. */
+        gint64 now = g_get_monotonic_time ();
+        if (source->wake_time != 0 && now >= source->wake_time && t > 0)
+            stats.spurious_wakeups++;
+        source->wake_time = t > 0 ? now + (gint64) t * 1000 : 0;
+    }
+
     if (t == 0)
         return TRUE;
     else
@@ -42,7 +134,20 @@ static gboolean uv_loop_source_prepare (GSource *base, int *timeout) {
 
 static gboolean uv_loop_source_dispatch (GSource *base, GSourceFunc callback, gpointer user_data) {
     struct uv_loop_source *source = (struct uv_loop_source *) base;
-    uv_run (source->loop, UV_RUN_NOWAIT);
+
+    guint64 trace_start = TraceEnabled () ? TraceNow () : 0;
+
+    if (stats_enabled) {
+        gint64 start = g_get_monotonic_time ();
+        uv_run (source->loop, UV_RUN_NOWAIT);
+        StatsDispatch (start);
+    } else {
+        uv_run (source->loop, UV_RUN_NOWAIT);
+    }
+
+    if (trace_start)
+        TraceEvent ("loop", "uv_run", trace_start, TraceNow ());
+
     return G_SOURCE_CONTINUE;
 }
 
@@ -55,6 +160,19 @@ static GSourceFuncs uv_loop_source_funcs = {
     NULL, NULL,
 };
 
+/* Only used to measure how long GLib blocks in poll () */
+static GPollFunc default_poll_func;
+
+static gint uv_loop_source_poll (GPollFD *fds, guint n_fds, gint timeout) {
+    if (!stats_enabled)
+        return default_poll_func (fds, n_fds, timeout);
+
+    gint64 start = g_get_monotonic_time ();
+    gint ret = default_poll_func (fds, n_fds, timeout);
+    iteration_poll += g_get_monotonic_time () - start;
+    return ret;
+}
+
 static GSource *uv_loop_source_new (uv_loop_t *loop) {
     struct uv_loop_source *source = (struct uv_loop_source *) g_source_new (&uv_loop_source_funcs, sizeof (*source));
     source->loop = loop;
@@ -64,9 +182,294 @@ static GSource *uv_loop_source_new (uv_loop_t *loop) {
     return &source->source;
 }
 
-void StartLoop() {
-    GSource *source = uv_loop_source_new (uv_default_loop ());
-    g_source_attach (source, NULL);
+/* The other way around: libuv drives the default GMainContext. This is
+ * for services that use GIO and friends without ever running Gtk.main().
+ *
+ * Each uv iteration mirrors one GLib iteration. A uv_prepare_t handle
+ * runs g_main_context_prepare/query just before uv polls: every fd that
+ * GLib wants to watch gets a uv_poll_t, and GLib's timeout becomes a
+ * uv_timer_t. The matching uv_check_t handle runs after the poll, hands
+ * the events back to g_main_context_check and dispatches. Only the
+ * prepare handle keeps the uv loop alive, until StopLoop() is called. */
+
+struct uv_glib_driver;
+
+struct glib_poll {
+    uv_poll_t handle;
+    struct uv_glib_driver *driver;
+    int fd;
+    int events;
+    gushort revents;
+    bool seen;
+};
+
+struct uv_glib_driver {
+    uv_loop_t *loop;
+    GMainContext *context;
+    /* Of the main thread's isolate, where the sources run JS */
+    IsolateData *isolate_data;
+
+    uv_prepare_t prepare;
+    uv_check_t check;
+    uv_timer_t timer;
+
+    gint max_priority;
+    bool timer_fired;
+    gint64 poll_start;
+    GPollFD *fds;
+    gint n_fds;
+    gint allocated_fds;
+
+    /* fd -> struct glib_poll */
+    GHashTable *polls;
+    /* Handles still closing; the last one to close frees the driver */
+    int n_closing;
+};
+
+static void glib_poll_closed (uv_handle_t *handle) {
+    g_free (handle->data);
+}
+
+static void glib_poll_cb (uv_poll_t *handle, int status, int events) {
+    struct glib_poll *poll = (struct glib_poll *) handle->data;
+
+    if (status < 0) {
+        poll->revents |= G_IO_ERR;
+        return;
+    }
+    if (events & UV_READABLE)
+        poll->revents |= G_IO_IN;
+    if (events & UV_PRIORITIZED)
+        poll->revents |= G_IO_PRI;
+    if (events & UV_WRITABLE)
+        poll->revents |= G_IO_OUT;
+    if (events & UV_DISCONNECT)
+        poll->revents |= G_IO_HUP;
+}
+
+static gboolean glib_poll_remove_unseen (gpointer key, gpointer value, gpointer user_data) {
+    struct glib_poll *poll = (struct glib_poll *) value;
+
+    if (poll->seen)
+        return FALSE;
+
+    uv_poll_stop (&poll->handle);
+    uv_close ((uv_handle_t *) &poll->handle, glib_poll_closed);
+    return TRUE;
+}
+
+static void uv_glib_driver_sync_polls (struct uv_glib_driver *driver) {
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_iter_init (&iter, driver->polls);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        struct glib_poll *poll = (struct glib_poll *) value;
+        poll->seen = false;
+        poll->events = 0;
+        poll->revents = 0;
+    }
+
+    /* Several GPollFDs may share one fd; their events are merged. */
+    for (int i = 0; i < driver->n_fds; i++) {
+        GPollFD *pfd = &driver->fds[i];
+        struct glib_poll *poll = (struct glib_poll *) g_hash_table_lookup (driver->polls, GINT_TO_POINTER (pfd->fd));
+
+        if (poll == NULL) {
+            poll = g_new0 (struct glib_poll, 1);
+            poll->driver = driver;
+            poll->fd = pfd->fd;
+            poll->handle.data = poll;
+            uv_poll_init (driver->loop, &poll->handle, pfd->fd);
+            uv_unref ((uv_handle_t *) &poll->handle);
+            g_hash_table_insert (driver->polls, GINT_TO_POINTER (pfd->fd), poll);
+        }
+
+        /* poll () reports hang-ups and errors whether asked for or not,
+         * and GLib sources count on that; uv only reports them on
+         * request, and errors as a failed status. */
+        poll->seen = true;
+        poll->events |= UV_DISCONNECT;
+        if (pfd->events & G_IO_IN)
+            poll->events |= UV_READABLE;
+        if (pfd->events & G_IO_PRI)
+            poll->events |= UV_PRIORITIZED;
+        if (pfd->events & G_IO_OUT)
+            poll->events |= UV_WRITABLE;
+    }
+
+    g_hash_table_foreach_remove (driver->polls, glib_poll_remove_unseen, NULL);
+
+    g_hash_table_iter_init (&iter, driver->polls);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        struct glib_poll *poll = (struct glib_poll *) value;
+        uv_poll_start (&poll->handle, poll->events, glib_poll_cb);
+    }
+}
+
+static void uv_glib_driver_timer_cb (uv_timer_t *handle) {
+    /* Waking uv up is enough to get to the check handle. */
+    struct uv_glib_driver *driver = (struct uv_glib_driver *) handle->data;
+    driver->timer_fired = true;
+}
+
+static void uv_glib_driver_prepare_cb (uv_prepare_t *handle) {
+    struct uv_glib_driver *driver = (struct uv_glib_driver *) handle->data;
+    gint timeout;
+
+    if (stats_enabled)
+        StatsIteration (true);
+
+    gboolean ready = g_main_context_prepare (driver->context, &driver->max_priority);
+
+    while ((driver->n_fds = g_main_context_query (driver->context, driver->max_priority, &timeout,
+                                                  driver->fds, driver->allocated_fds)) > driver->allocated_fds) {
+        driver->allocated_fds = driver->n_fds;
+        driver->fds = g_renew (GPollFD, driver->fds, driver->allocated_fds);
+    }
+
+    uv_glib_driver_sync_polls (driver);
+
+    if (ready)
+        timeout = 0;
+
+    driver->timer_fired = false;
+    if (timeout >= 0)
+        uv_timer_start (&driver->timer, uv_glib_driver_timer_cb, timeout, 0);
+    else
+        uv_timer_stop (&driver->timer);
+
+    if (stats_enabled) {
+        StatsTimeout (uv_backend_timeout (driver->loop));
+        driver->poll_start = g_get_monotonic_time ();
+    }
+}
+
+static void uv_glib_driver_check_cb (uv_check_t *handle) {
+    struct uv_glib_driver *driver = (struct uv_glib_driver *) handle->data;
+    bool woken = driver->timer_fired;
+
+    /* Not exact: this also counts uv's own timers and callbacks, which
+     * run between the poll and the check handle. */
+    if (stats_enabled)
+        iteration_poll += g_get_monotonic_time () - driver->poll_start;
+
+    for (int i = 0; i < driver->n_fds; i++) {
+        GPollFD *pfd = &driver->fds[i];
+        struct glib_poll *poll = (struct glib_poll *) g_hash_table_lookup (driver->polls, GINT_TO_POINTER (pfd->fd));
+        pfd->revents = poll ? (poll->revents & (pfd->events | G_IO_HUP | G_IO_ERR)) : 0;
+        woken = woken || pfd->revents != 0;
+    }
+
+    if (g_main_context_check (driver->context, driver->max_priority, driver->fds, driver->n_fds)) {
+        guint64 trace_start = TraceEnabled () ? TraceNow () : 0;
+        /* There is no JS below a check handle: handlers and callbacks
+         * need a context, and nextTick and microtasks a place to run. */
+        TopLevelScope top_level_scope (driver->isolate_data);
+
+        if (stats_enabled) {
+            gint64 start = g_get_monotonic_time ();
+            g_main_context_dispatch (driver->context);
+            StatsDispatch (start);
+        } else {
+            g_main_context_dispatch (driver->context);
+        }
+
+        if (trace_start)
+            TraceEvent ("loop", "g_main_context_dispatch", trace_start, TraceNow ());
+    } else if (stats_enabled && woken) {
+        /* Woken up on GLib's behalf, with nothing for it to do */
+        stats.spurious_wakeups++;
+    }
+}
+
+static struct uv_glib_driver *uv_glib_driver_new (uv_loop_t *loop, IsolateData *isolate_data) {
+    struct uv_glib_driver *driver = g_new0 (struct uv_glib_driver, 1);
+    driver->loop = loop;
+    driver->isolate_data = isolate_data;
+    driver->context = g_main_context_ref (g_main_context_default ());
+    driver->polls = g_hash_table_new (NULL, NULL);
+
+    g_main_context_acquire (driver->context);
+
+    uv_prepare_init (loop, &driver->prepare);
+    driver->prepare.data = driver;
+    uv_prepare_start (&driver->prepare, uv_glib_driver_prepare_cb);
+
+    uv_check_init (loop, &driver->check);
+    driver->check.data = driver;
+    uv_check_start (&driver->check, uv_glib_driver_check_cb);
+    uv_unref ((uv_handle_t *) &driver->check);
+
+    uv_timer_init (loop, &driver->timer);
+    driver->timer.data = driver;
+    uv_unref ((uv_handle_t *) &driver->timer);
+
+    return driver;
+}
+
+static gboolean glib_poll_remove_all (gpointer key, gpointer value, gpointer user_data) {
+    struct glib_poll *poll = (struct glib_poll *) value;
+    uv_poll_stop (&poll->handle);
+    uv_close ((uv_handle_t *) &poll->handle, glib_poll_closed);
+    return TRUE;
+}
+
+static void uv_glib_driver_closed (uv_handle_t *handle) {
+    struct uv_glib_driver *driver = (struct uv_glib_driver *) handle->data;
+    if (--driver->n_closing > 0)
+        return;
+
+    g_free (driver->fds);
+    g_free (driver);
+}
+
+static void uv_glib_driver_free (struct uv_glib_driver *driver) {
+    g_hash_table_foreach_remove (driver->polls, glib_poll_remove_all, NULL);
+    g_hash_table_destroy (driver->polls);
+
+    g_main_context_release (driver->context);
+    g_main_context_unref (driver->context);
+
+    /* libuv gives no order for close callbacks, and all three handles
+     * live in the driver. */
+    driver->n_closing = 3;
+    uv_close ((uv_handle_t *) &driver->prepare, uv_glib_driver_closed);
+    uv_close ((uv_handle_t *) &driver->check, uv_glib_driver_closed);
+    uv_close ((uv_handle_t *) &driver->timer, uv_glib_driver_closed);
+}
+
+static GSource *loop_source;
+static struct uv_glib_driver *loop_driver;
+
+void StartLoop(IsolateData *isolate_data, LoopMode mode) {
+    if (loop_source || loop_driver)
+        return;
+
+    if (mode == LOOP_MODE_UV) {
+        loop_driver = uv_glib_driver_new (uv_default_loop (), isolate_data);
+    } else {
+        loop_source = uv_loop_source_new (uv_default_loop ());
+        g_source_attach (loop_source, NULL);
+
+        default_poll_func = g_main_context_get_poll_func (NULL);
+        g_main_context_set_poll_func (NULL, uv_loop_source_poll);
+    }
+}
+
+void StopLoop() {
+    if (loop_source) {
+        g_source_destroy (loop_source);
+        g_source_unref (loop_source);
+        loop_source = NULL;
+
+        g_main_context_set_poll_func (NULL, default_poll_func);
+    }
+
+    if (loop_driver) {
+        uv_glib_driver_free (loop_driver);
+        loop_driver = NULL;
+    }
 }
 
 };
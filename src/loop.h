@@ -1,8 +1,49 @@
 
 #pragma once
 
+#include <glib.h>
+
 namespace GNodeJS {
 
-void StartLoop();
+enum LoopMode {
+    /* uv runs nested inside the GLib main loop (Gtk.main() et al). */
+    LOOP_MODE_GLIB,
+    /* uv drives the default GMainContext; no GLib main loop needed. */
+    LOOP_MODE_UV,
+};
+
+struct IsolateData;
+
+/* On the main thread; isolate_data is the main isolate's */
+void StartLoop(IsolateData *isolate_data, LoopMode mode = LOOP_MODE_GLIB);
+void StopLoop();
+
+#define LOOP_STATS_N_BUCKETS 16
+
+/* Opt-in counters for the bridge. Times are in microseconds; "uv" is
+ * time spent running uv callbacks, "glib" time spent dispatching GLib
+ * sources, and "poll" time spent blocked waiting for either. Histogram
+ * bucket i counts values in [2^(i-1), 2^i), bucket 0 counts zeroes and
+ * the last bucket everything above. */
+struct LoopStats {
+    guint64 prepares;
+    guint64 dispatches;
+    guint64 spurious_wakeups;
+
+    guint64 uv_us;
+    guint64 glib_us;
+    guint64 poll_us;
+
+    /* uv_backend_timeout () in milliseconds, -1 counted separately */
+    guint64 infinite_timeouts;
+    guint64 timeouts[LOOP_STATS_N_BUCKETS];
+
+    /* Duration of each dispatch of the other side, in microseconds */
+    guint64 dispatch_durations[LOOP_STATS_N_BUCKETS];
+};
+
+void SetLoopStatsEnabled(bool enabled);
+/* NULL unless stats are enabled */
+const LoopStats *GetLoopStats();
 
 };
@@ -0,0 +1,103 @@
+
+#include "trace.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <uv.h>
+
+namespace GNodeJS {
+
+gint tracing_enabled;
+
+/* Events may come from worker threads, so writes are serialized. */
+static GMutex trace_lock;
+static FILE *trace_file;
+static FILE *perf_map_file;
+static guint64 n_events;
+
+/* Trace viewers want small integer thread ids. */
+static GPrivate thread_id_key;
+static gint next_thread_id = 1;
+
+static int TraceThreadId() {
+    int id = GPOINTER_TO_INT (g_private_get (&thread_id_key));
+    if (id == 0) {
+        id = g_atomic_int_add (&next_thread_id, 1);
+        g_private_set (&thread_id_key, GINT_TO_POINTER (id));
+    }
+    return id;
+}
+
+guint64 TraceNow() {
+    return uv_hrtime ();
+}
+
+void TraceEvent(const char *category, const char *name, guint64 start, guint64 end) {
+    int tid = TraceThreadId ();
+
+    g_mutex_lock (&trace_lock);
+    if (trace_file) {
+        fprintf (trace_file,
+                 "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+                 n_events++ ? ",\n" : "",
+                 name, category, start / 1e3, (end - start) / 1e3, (int) getpid (), tid);
+    }
+    g_mutex_unlock (&trace_lock);
+}
+
+void TraceRegisterCode(const void *address, size_t size, const char *name) {
+    g_mutex_lock (&trace_lock);
+    if (perf_map_file) {
+        fprintf (perf_map_file, "%lx %lx %s\n", (unsigned long) address, (unsigned long) size, name);
+        fflush (perf_map_file);
+    }
+    g_mutex_unlock (&trace_lock);
+}
+
+bool StartTracing(const char *path, bool perf_map, GError **error) {
+    StopTracing ();
+
+    FILE *file = fopen (path, "w");
+    if (file == NULL) {
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+                     "Could not open %s: %s", path, g_strerror (errno));
+        return false;
+    }
+
+    /* The same file node's --perf-basic-prof writes to, hence appending. */
+    FILE *map_file = NULL;
+    if (perf_map) {
+        char *map_path = g_strdup_printf ("/tmp/perf-%d.map", (int) getpid ());
+        map_file = fopen (map_path, "a");
+        g_free (map_path);
+    }
+
+    g_mutex_lock (&trace_lock);
+    trace_file = file;
+    perf_map_file = map_file;
+    n_events = 0;
+    fputs ("{\"traceEvents\":[\n", trace_file);
+    g_mutex_unlock (&trace_lock);
+
+    g_atomic_int_set (&tracing_enabled, TRUE);
+    return true;
+}
+
+void StopTracing() {
+    g_atomic_int_set (&tracing_enabled, FALSE);
+
+    g_mutex_lock (&trace_lock);
+    if (trace_file) {
+        fputs ("\n],\"displayTimeUnit\":\"ns\"}\n", trace_file);
+        fclose (trace_file);
+        trace_file = NULL;
+    }
+    if (perf_map_file) {
+        fclose (perf_map_file);
+        perf_map_file = NULL;
+    }
+    g_mutex_unlock (&trace_lock);
+}
+
+};
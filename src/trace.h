@@ -0,0 +1,32 @@
+#pragma once
+
+#include <glib.h>
+#include <stddef.h>
+
+namespace GNodeJS {
+
+/* Optional tracing in the Chrome trace-event format (chrome://tracing,
+ * Perfetto), covering GI calls, signal handlers and main loop dispatch.
+ * Everything is a no-op unless tracing was started. */
+
+/* Written on the JS thread, read on any; hence atomic. */
+extern gint tracing_enabled;
+
+static inline bool TraceEnabled() {
+    return g_atomic_int_get (&tracing_enabled);
+}
+
+/* Monotonic time in nanoseconds */
+guint64 TraceNow();
+
+/* Records a complete event from start to end, as given by TraceNow (). */
+void TraceEvent(const char *category, const char *name, guint64 start, guint64 end);
+
+/* Adds generated code to the perf map, if one is being written, so that
+ * `perf` can symbolize it. */
+void TraceRegisterCode(const void *address, size_t size, const char *name);
+
+bool StartTracing(const char *path, bool perf_map, GError **error);
+void StopTracing();
+
+};
@@ -9,11 +9,430 @@ using namespace v8;
 
 namespace GNodeJS {
 
-Local<Value> GIArgumentToV8(Isolate *isolate, GITypeInfo *type_info, GIArgument *arg) {
+static gsize GetTypeTagSize(GITypeTag type_tag) {
+    switch (type_tag) {
+    case GI_TYPE_TAG_BOOLEAN:
+        return sizeof (gboolean);
+    case GI_TYPE_TAG_INT8:
+    case GI_TYPE_TAG_UINT8:
+        return sizeof (guint8);
+    case GI_TYPE_TAG_INT16:
+    case GI_TYPE_TAG_UINT16:
+        return sizeof (guint16);
+    case GI_TYPE_TAG_INT32:
+    case GI_TYPE_TAG_UINT32:
+    case GI_TYPE_TAG_UNICHAR:
+        return sizeof (guint32);
+    case GI_TYPE_TAG_INT64:
+    case GI_TYPE_TAG_UINT64:
+        return sizeof (guint64);
+    case GI_TYPE_TAG_FLOAT:
+        return sizeof (gfloat);
+    case GI_TYPE_TAG_DOUBLE:
+        return sizeof (gdouble);
+    case GI_TYPE_TAG_GTYPE:
+        return sizeof (GType);
+    default:
+        return sizeof (gpointer);
+    }
+}
+
+/* Whether elements of this type can be exposed to JS as a typed array. */
+static bool IsTypedArrayTag(GITypeTag type_tag) {
+    switch (type_tag) {
+    case GI_TYPE_TAG_INT8:
+    case GI_TYPE_TAG_UINT8:
+    case GI_TYPE_TAG_INT16:
+    case GI_TYPE_TAG_UINT16:
+    case GI_TYPE_TAG_INT32:
+    case GI_TYPE_TAG_UINT32:
+    case GI_TYPE_TAG_UNICHAR:
+    case GI_TYPE_TAG_FLOAT:
+    case GI_TYPE_TAG_DOUBLE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool IsTypedArrayFor(GITypeTag elem_tag, Local<Value> value) {
+    switch (elem_tag) {
+    case GI_TYPE_TAG_INT8:
+    case GI_TYPE_TAG_UINT8:
+        /* Bytes are bytes: Buffers, DataViews and any other view will do. */
+        return value->IsArrayBufferView ();
+    case GI_TYPE_TAG_INT16:
+        return value->IsInt16Array ();
+    case GI_TYPE_TAG_UINT16:
+        return value->IsUint16Array ();
+    case GI_TYPE_TAG_INT32:
+        return value->IsInt32Array ();
+    case GI_TYPE_TAG_UINT32:
+    case GI_TYPE_TAG_UNICHAR:
+        return value->IsUint32Array ();
+    case GI_TYPE_TAG_FLOAT:
+        return value->IsFloat32Array ();
+    case GI_TYPE_TAG_DOUBLE:
+        return value->IsFloat64Array ();
+    default:
+        return false;
+    }
+}
+
+static Local<Value> MakeTypedArray(Local<ArrayBuffer> buffer, GITypeTag elem_tag, size_t length) {
+    switch (elem_tag) {
+    case GI_TYPE_TAG_INT8:
+        return Int8Array::New (buffer, 0, length);
+    case GI_TYPE_TAG_UINT8:
+        return Uint8Array::New (buffer, 0, length);
+    case GI_TYPE_TAG_INT16:
+        return Int16Array::New (buffer, 0, length);
+    case GI_TYPE_TAG_UINT16:
+        return Uint16Array::New (buffer, 0, length);
+    case GI_TYPE_TAG_INT32:
+        return Int32Array::New (buffer, 0, length);
+    case GI_TYPE_TAG_UINT32:
+    case GI_TYPE_TAG_UNICHAR:
+        return Uint32Array::New (buffer, 0, length);
+    case GI_TYPE_TAG_FLOAT:
+        return Float32Array::New (buffer, 0, length);
+    case GI_TYPE_TAG_DOUBLE:
+        return Float64Array::New (buffer, 0, length);
+    default:
+        g_assert_not_reached ();
+    }
+}
+
+struct ExternalData {
+    Persistent<ArrayBuffer> persistent;
+    GDestroyNotify free_func;
+    gpointer owner;
+    size_t length;
+};
+
+static void ExternalDataDestroyed(const WeakCallbackData<ArrayBuffer, ExternalData> &data) {
+    ExternalData *external = data.GetParameter ();
+    data.GetIsolate ()->AdjustAmountOfExternalAllocatedMemory (-(int64_t) external->length);
+    external->free_func (external->owner);
+    external->persistent.Reset ();
+    delete external;
+}
+
+Local<ArrayBuffer> MakeExternalArrayBuffer(Isolate *isolate, void *data, size_t length,
+                                           GDestroyNotify free_func, gpointer owner) {
+    Local<ArrayBuffer> buffer = ArrayBuffer::New (isolate, data, length);
+
+    ExternalData *external = new ExternalData;
+    external->free_func = free_func;
+    external->owner = owner;
+    external->length = length;
+    external->persistent.Reset (isolate, buffer);
+    external->persistent.SetWeak (external, ExternalDataDestroyed);
+
+    isolate->AdjustAmountOfExternalAllocatedMemory (length);
+    return buffer;
+}
+
+/* What an array holds, and how much room each element takes up in it.
+ * Enums and flags are stored as their storage type; structs are stored
+ * inline unless the array holds pointers to them. */
+struct ArrayElement {
+    GITypeInfo *type_info;
+    GITypeTag tag;
+    gsize size;
+    bool is_struct;
+    /* Only arrays of these are handed out as raw memory */
+    bool is_plain_struct;
+};
+
+static void ArrayElementInit(ArrayElement *elem, GITypeInfo *array_info) {
+    elem->type_info = g_type_info_get_param_type (array_info, 0);
+    elem->tag = g_type_info_get_tag (elem->type_info);
+    elem->is_struct = false;
+    elem->is_plain_struct = false;
+    elem->size = 0;
+
+    if (elem->tag == GI_TYPE_TAG_INTERFACE && !g_type_info_is_pointer (elem->type_info)) {
+        GIBaseInfo *interface_info = g_type_info_get_interface (elem->type_info);
+
+        switch (g_base_info_get_type (interface_info)) {
+        case GI_INFO_TYPE_ENUM:
+        case GI_INFO_TYPE_FLAGS:
+            elem->tag = g_enum_info_get_storage_type ((GIEnumInfo *) interface_info);
+            break;
+        case GI_INFO_TYPE_BOXED:
+        case GI_INFO_TYPE_STRUCT:
+            elem->is_struct = true;
+            elem->is_plain_struct = StructIsPlainData ((GIStructInfo *) interface_info);
+            elem->size = g_struct_info_get_size ((GIStructInfo *) interface_info);
+            break;
+        default:
+            break;
+        }
+
+        g_base_info_unref (interface_info);
+    }
+
+    if (!elem->is_struct)
+        elem->size = GetTypeTagSize (elem->tag);
+}
+
+static void ArrayElementClear(ArrayElement *elem) {
+    g_base_info_unref (elem->type_info);
+}
+
+static void LoadArrayElement(ArrayElement *elem, const void *src, GIArgument *arg) {
+    switch (elem->tag) {
+    case GI_TYPE_TAG_BOOLEAN:
+        arg->v_boolean = *(const gboolean *) src;
+        break;
+    case GI_TYPE_TAG_INT8:
+        arg->v_int8 = *(const gint8 *) src;
+        break;
+    case GI_TYPE_TAG_UINT8:
+        arg->v_uint8 = *(const guint8 *) src;
+        break;
+    case GI_TYPE_TAG_INT16:
+        arg->v_int16 = *(const gint16 *) src;
+        break;
+    case GI_TYPE_TAG_UINT16:
+        arg->v_uint16 = *(const guint16 *) src;
+        break;
+    case GI_TYPE_TAG_INT32:
+        arg->v_int32 = *(const gint32 *) src;
+        break;
+    case GI_TYPE_TAG_UINT32:
+    case GI_TYPE_TAG_UNICHAR:
+        arg->v_uint32 = *(const guint32 *) src;
+        break;
+    case GI_TYPE_TAG_INT64:
+        arg->v_int64 = *(const gint64 *) src;
+        break;
+    case GI_TYPE_TAG_UINT64:
+        arg->v_uint64 = *(const guint64 *) src;
+        break;
+    case GI_TYPE_TAG_FLOAT:
+        arg->v_float = *(const gfloat *) src;
+        break;
+    case GI_TYPE_TAG_DOUBLE:
+        arg->v_double = *(const gdouble *) src;
+        break;
+    case GI_TYPE_TAG_GTYPE:
+        arg->v_size = *(const GType *) src;
+        break;
+    default:
+        arg->v_pointer = *(gpointer const *) src;
+        break;
+    }
+}
+
+static void StoreArrayElement(ArrayElement *elem, void *dest, GIArgument *arg) {
+    switch (elem->tag) {
+    case GI_TYPE_TAG_BOOLEAN:
+        *(gboolean *) dest = arg->v_boolean;
+        break;
+    case GI_TYPE_TAG_INT8:
+        *(gint8 *) dest = arg->v_int8;
+        break;
+    case GI_TYPE_TAG_UINT8:
+        *(guint8 *) dest = arg->v_uint8;
+        break;
+    case GI_TYPE_TAG_INT16:
+        *(gint16 *) dest = arg->v_int16;
+        break;
+    case GI_TYPE_TAG_UINT16:
+        *(guint16 *) dest = arg->v_uint16;
+        break;
+    case GI_TYPE_TAG_INT32:
+        *(gint32 *) dest = arg->v_int32;
+        break;
+    case GI_TYPE_TAG_UINT32:
+    case GI_TYPE_TAG_UNICHAR:
+        *(guint32 *) dest = arg->v_uint32;
+        break;
+    case GI_TYPE_TAG_INT64:
+        *(gint64 *) dest = arg->v_int64;
+        break;
+    case GI_TYPE_TAG_UINT64:
+        *(guint64 *) dest = arg->v_uint64;
+        break;
+    case GI_TYPE_TAG_FLOAT:
+        *(gfloat *) dest = arg->v_float;
+        break;
+    case GI_TYPE_TAG_DOUBLE:
+        *(gdouble *) dest = arg->v_double;
+        break;
+    case GI_TYPE_TAG_GTYPE:
+        *(GType *) dest = arg->v_size;
+        break;
+    default:
+        *(gpointer *) dest = arg->v_pointer;
+        break;
+    }
+}
+
+static bool IsZeroElement(const char *elem, gsize elem_size) {
+    for (gsize i = 0; i < elem_size; i++)
+        if (elem[i] != 0)
+            return false;
+    return true;
+}
+
+static long GetZeroTerminatedLength(const char *data, gsize elem_size) {
+    long length = 0;
+    while (!IsZeroElement (data + length * elem_size, elem_size))
+        length++;
+    return length;
+}
+
+/* Elements that don't fit a typed array are converted one by one,
+ * reading each at its real size. */
+static Local<Value> GIArrayElementsToV8(Isolate *isolate, ArrayElement *elem, const char *data,
+                                        long length, GITransfer transfer) {
+    if (elem->is_struct) {
+        isolate->ThrowException (Exception::TypeError (String::NewFromUtf8 (isolate, "Unsupported array element type.")));
+        return Undefined (isolate);
+    }
+
+    GITransfer elem_transfer = (transfer == GI_TRANSFER_EVERYTHING) ? GI_TRANSFER_EVERYTHING : GI_TRANSFER_NOTHING;
+    Local<Array> array = Array::New (isolate, length);
+
+    for (long i = 0; i < length; i++) {
+        GIArgument arg;
+        LoadArrayElement (elem, data + i * elem->size, &arg);
+        array->Set (i, GIArgumentToV8 (isolate, elem->type_info, &arg, -1, elem_transfer));
+    }
+
+    return array;
+}
+
+/* The elements have been converted (and freed when owned) one by one
+ * by then, so only the segment itself is left to free. */
+static void FreeGArraySegment(GArray *garray) {
+    g_array_set_clear_func (garray, NULL);
+    g_array_unref (garray);
+}
+
+static void FreeGPtrArraySegment(GPtrArray *ptr_array) {
+    g_ptr_array_set_free_func (ptr_array, NULL);
+    g_ptr_array_unref (ptr_array);
+}
+
+static Local<Value> GIArrayToV8(Isolate *isolate, GITypeInfo *type_info, GIArgument *arg,
+                                long length, GITransfer transfer) {
+    if (arg->v_pointer == NULL)
+        return Null (isolate);
+
+    ArrayElement elem;
+    ArrayElementInit (&elem, type_info);
+
+    GIArrayType array_type = g_type_info_get_array_type (type_info);
+    GDestroyNotify free_func;
+    Local<Value> result;
+    void *data;
+
+    switch (array_type) {
+    case GI_ARRAY_TYPE_C:
+        data = arg->v_pointer;
+        free_func = g_free;
+        if (length < 0)
+            length = g_type_info_get_array_fixed_size (type_info);
+        if (length < 0 && g_type_info_is_zero_terminated (type_info))
+            length = GetZeroTerminatedLength ((const char *) data, elem.size);
+        break;
+    case GI_ARRAY_TYPE_ARRAY:
+        {
+            GArray *garray = (GArray *) arg->v_pointer;
+            data = garray->data;
+            length = garray->len;
+            free_func = (GDestroyNotify) FreeGArraySegment;
+        }
+        break;
+    case GI_ARRAY_TYPE_PTR_ARRAY:
+        {
+            GPtrArray *ptr_array = (GPtrArray *) arg->v_pointer;
+            data = ptr_array->pdata;
+            length = ptr_array->len;
+            free_func = (GDestroyNotify) FreeGPtrArraySegment;
+        }
+        break;
+    case GI_ARRAY_TYPE_BYTE_ARRAY:
+        {
+            GByteArray *byte_array = (GByteArray *) arg->v_pointer;
+            data = byte_array->data;
+            length = byte_array->len;
+            free_func = (GDestroyNotify) g_byte_array_unref;
+        }
+        break;
+    default:
+        g_assert_not_reached ();
+    }
+
+    if (length < 0) {
+        isolate->ThrowException (Exception::TypeError (String::NewFromUtf8 (isolate, "Unknown array length.")));
+        result = Undefined (isolate);
+    } else if (IsTypedArrayTag (elem.tag) || elem.is_plain_struct) {
+        size_t byte_length = length * elem.size;
+        Local<ArrayBuffer> buffer;
+
+        /* A borrowed array may still be written to or resized by its
+         * owner, so it is copied even when it is refcounted. */
+        if (transfer == GI_TRANSFER_NOTHING) {
+            buffer = ArrayBuffer::New (isolate, byte_length);
+            memcpy (buffer->GetContents ().Data (), data, byte_length);
+        } else {
+            /* Element types that end up in typed arrays own no memory, so
+             * holding the container is the same as holding everything.
+             * So do inline structs without pointers. */
+            buffer = MakeExternalArrayBuffer (isolate, data, byte_length, free_func, arg->v_pointer);
+        }
+
+        if (elem.is_struct) {
+            GIBaseInfo *struct_info = g_type_info_get_interface (elem.type_info);
+            result = MakeStructArray (isolate, (GIStructInfo *) struct_info, buffer, length);
+            g_base_info_unref (struct_info);
+        } else {
+            result = MakeTypedArray (buffer, elem.tag, length);
+        }
+    } else {
+        result = GIArrayElementsToV8 (isolate, &elem, (const char *) data, length, transfer);
+        if (transfer != GI_TRANSFER_NOTHING)
+            free_func (arg->v_pointer);
+    }
+
+    ArrayElementClear (&elem);
+    return result;
+}
+
+/* GBytes are immutable and may be shared, while a Uint8Array can be
+ * written to, so JS gets a copy of the bytes. An owned GBytes that
+ * nobody else holds gives up its data without a copy. */
+static Local<Value> GBytesToV8(Isolate *isolate, GBytes *bytes, GITransfer transfer) {
+    if (bytes == NULL)
+        return Null (isolate);
+
+    if (transfer == GI_TRANSFER_NOTHING)
+        g_bytes_ref (bytes);
+
+    gsize size;
+    void *data = g_bytes_unref_to_data (bytes, &size);
+    Local<ArrayBuffer> buffer = MakeExternalArrayBuffer (isolate, data, size, g_free, data);
+    return Uint8Array::New (buffer, 0, size);
+}
+
+Local<Value> GIArgumentToV8(Isolate *isolate, GITypeInfo *type_info, GIArgument *arg,
+                            long length, GITransfer transfer) {
     GITypeTag type_tag = g_type_info_get_tag (type_info);
 
     switch (type_tag) {
     case GI_TYPE_TAG_VOID:
+        /* A gpointer goes to JS as an opaque External, which can be
+         * handed back to C, or to GNode.objectFromPointer () when it is
+         * known to be a GObject. */
+        if (g_type_info_is_pointer (type_info) && arg->v_pointer)
+            return External::New (isolate, arg->v_pointer);
+        if (g_type_info_is_pointer (type_info))
+            return Null (isolate);
         return Undefined (isolate);
 
     case GI_TYPE_TAG_BOOLEAN:
@@ -54,10 +473,17 @@ Local<Value> GIArgumentToV8(Isolate *isolate, GITypeInfo *type_info, GIArgument
         }
 
     case GI_TYPE_TAG_UTF8:
-        if (arg->v_pointer)
-            return String::NewFromUtf8 (isolate, (char *) arg->v_pointer);
-        else
+        if (arg->v_pointer) {
+            Local<Value> str = String::NewFromUtf8 (isolate, (char *) arg->v_pointer);
+            if (transfer == GI_TRANSFER_EVERYTHING)
+                g_free (arg->v_pointer);
+            return str;
+        } else {
             return Null (isolate);
+        }
+
+    case GI_TYPE_TAG_ARRAY:
+        return GIArrayToV8 (isolate, type_info, arg, length, transfer);
 
     case GI_TYPE_TAG_INTERFACE:
         {
@@ -66,10 +492,14 @@ Local<Value> GIArgumentToV8(Isolate *isolate, GITypeInfo *type_info, GIArgument
 
             switch (interface_type) {
             case GI_INFO_TYPE_OBJECT:
+            case GI_INFO_TYPE_INTERFACE:
                 return WrapperFromGObject (isolate, (GObject *) arg->v_pointer);
             case GI_INFO_TYPE_BOXED:
             case GI_INFO_TYPE_STRUCT:
-                return WrapperFromBoxed (isolate, interface_info, arg->v_pointer);
+            case GI_INFO_TYPE_UNION:
+                if (g_registered_type_info_get_g_type ((GIRegisteredTypeInfo *) interface_info) == G_TYPE_BYTES)
+                    return GBytesToV8 (isolate, (GBytes *) arg->v_pointer, transfer);
+                return WrapperFromBoxed (isolate, interface_info, arg->v_pointer, transfer);
             case GI_INFO_TYPE_FLAGS:
             case GI_INFO_TYPE_ENUM:
                 return Integer::New (isolate, arg->v_int);
@@ -84,6 +514,73 @@ Local<Value> GIArgumentToV8(Isolate *isolate, GITypeInfo *type_info, GIArgument
     }
 }
 
+template<typename T>
+static void PackIntegers(Local<Array> array, T *out, int length) {
+    for (int i = 0; i < length; i++) {
+        Local<Value> value = array->Get (i);
+        /* Elements of packed SMI arrays always take the first branch. */
+        if (value->IsInt32 ())
+            out[i] = (T) value.As<Int32> ()->Value ();
+        else
+            out[i] = (T) value->Int32Value ();
+    }
+}
+
+template<typename T>
+static void PackNumbers(Local<Array> array, T *out, int length) {
+    for (int i = 0; i < length; i++) {
+        Local<Value> value = array->Get (i);
+        /* Elements of packed double arrays always take the first branch. */
+        if (value->IsNumber ())
+            out[i] = (T) value.As<Number> ()->Value ();
+        else
+            out[i] = (T) value->NumberValue ();
+    }
+}
+
+/* Writes a JS array of numbers straight into element-sized storage,
+ * without going through a GIArgument per element. */
+static bool PackNumberArray(Local<Array> array, GITypeTag elem_tag, void *data, int length) {
+    switch (elem_tag) {
+    case GI_TYPE_TAG_BOOLEAN:
+        for (int i = 0; i < length; i++)
+            ((gboolean *) data)[i] = array->Get (i)->BooleanValue ();
+        return true;
+    case GI_TYPE_TAG_INT8:
+        PackIntegers (array, (gint8 *) data, length);
+        return true;
+    case GI_TYPE_TAG_UINT8:
+        PackIntegers (array, (guint8 *) data, length);
+        return true;
+    case GI_TYPE_TAG_INT16:
+        PackIntegers (array, (gint16 *) data, length);
+        return true;
+    case GI_TYPE_TAG_UINT16:
+        PackIntegers (array, (guint16 *) data, length);
+        return true;
+    case GI_TYPE_TAG_INT32:
+        PackIntegers (array, (gint32 *) data, length);
+        return true;
+    case GI_TYPE_TAG_UINT32:
+        PackIntegers (array, (guint32 *) data, length);
+        return true;
+    case GI_TYPE_TAG_INT64:
+        PackNumbers (array, (gint64 *) data, length);
+        return true;
+    case GI_TYPE_TAG_UINT64:
+        PackNumbers (array, (guint64 *) data, length);
+        return true;
+    case GI_TYPE_TAG_FLOAT:
+        PackNumbers (array, (gfloat *) data, length);
+        return true;
+    case GI_TYPE_TAG_DOUBLE:
+        PackNumbers (array, (gdouble *) data, length);
+        return true;
+    default:
+        return false;
+    }
+}
+
 static GArray * V8ToGArray(Isolate *isolate, GITypeInfo *type_info, Local<Value> value) {
     if (!value->IsArray ()) {
         isolate->ThrowException (Exception::TypeError (String::NewFromUtf8 (isolate, "Not an array.")));
@@ -91,32 +588,115 @@ static GArray * V8ToGArray(Isolate *isolate, GITypeInfo *type_info, Local<Value>
     }
 
     Local<Array> array = Local<Array>::Cast (value->ToObject ());
-    GITypeInfo *elem_info = g_type_info_get_param_type (type_info, 0);
+    ArrayElement elem;
+    ArrayElementInit (&elem, type_info);
 
     int length = array->Length ();
-    GArray *garray = g_array_sized_new (TRUE, FALSE, sizeof (GIArgument), length);
-    for (int i = 0; i < length; i++) {
-        Local<Value> value = array->Get (i);
-        GIArgument arg;
+    GArray *garray = g_array_sized_new (TRUE, TRUE, elem.size, length);
+    g_array_set_size (garray, length);
 
-        V8ToGIArgument (isolate, elem_info, &arg, value, false);
-        g_array_append_val (garray, arg);
+    if (!PackNumberArray (array, elem.tag, garray->data, length)) {
+        for (int i = 0; i < length; i++) {
+            void *dest = garray->data + i * elem.size;
+            GIArgument arg = {};
+
+            V8ToGIArgument (isolate, elem.type_info, &arg, array->Get (i), false);
+
+            if (!elem.is_struct)
+                StoreArrayElement (&elem, dest, &arg);
+            else if (arg.v_pointer != NULL)
+                memcpy (dest, arg.v_pointer, elem.size);
+        }
     }
 
-    g_base_info_unref ((GIBaseInfo *) elem_info);
+    ArrayElementClear (&elem);
     return garray;
 }
 
+bool V8TypedArrayToGIArgument(GITypeInfo *type_info, GIArgument *arg, Local<Value> value,
+                              size_t *length_p, bool *borrowed_p) {
+    GIArrayType array_type = g_type_info_get_array_type (type_info);
+    if (array_type == GI_ARRAY_TYPE_PTR_ARRAY)
+        return false;
+
+    ArrayElement elem;
+    ArrayElementInit (&elem, type_info);
+    GITypeTag elem_tag = g_type_info_get_tag (elem.type_info);
+    gsize elem_size = elem.size;
+    bool is_struct = elem.is_struct;
+    ArrayElementClear (&elem);
+
+    char *data;
+    size_t byte_length, length;
+
+    if (is_struct) {
+        /* A StructArray passes its elements' memory as it is. */
+        void *struct_data;
+        if (!StructArrayGetContents (Isolate::GetCurrent (), value, elem_size, &struct_data, &length))
+            return false;
+        data = (char *) struct_data;
+        byte_length = length * elem_size;
+    } else {
+        if (!IsTypedArrayFor (elem_tag, value))
+            return false;
+
+        Local<ArrayBufferView> view = Local<ArrayBufferView>::Cast (value);
+        ArrayBuffer::Contents contents = view->Buffer ()->GetContents ();
+        data = (char *) contents.Data () + view->ByteOffset ();
+        byte_length = view->ByteLength ();
+        elem_size = GetTypeTagSize (elem_tag);
+        length = byte_length / elem_size;
+    }
+
+    if (length_p)
+        *length_p = length;
+
+    switch (array_type) {
+    case GI_ARRAY_TYPE_C:
+        if (borrowed_p && !g_type_info_is_zero_terminated (type_info)) {
+            /* The caller keeps the view alive for the duration of the call. */
+            arg->v_pointer = data;
+            *borrowed_p = true;
+        } else {
+            /* One extra zeroed element keeps zero-terminated arrays valid. */
+            char *copy = (char *) g_malloc0 (byte_length + elem_size);
+            memcpy (copy, data, byte_length);
+            arg->v_pointer = copy;
+        }
+        break;
+    case GI_ARRAY_TYPE_ARRAY:
+        {
+            GArray *garray = g_array_sized_new (TRUE, FALSE, elem_size, length);
+            g_array_append_vals (garray, data, length);
+            arg->v_pointer = garray;
+        }
+        break;
+    case GI_ARRAY_TYPE_BYTE_ARRAY:
+        {
+            GByteArray *byte_array = g_byte_array_sized_new (byte_length);
+            g_byte_array_append (byte_array, (const guint8 *) data, byte_length);
+            arg->v_pointer = byte_array;
+        }
+        break;
+    default:
+        g_assert_not_reached ();
+    }
+
+    return true;
+}
+
 void V8ToGIArgument(Isolate *isolate, GIBaseInfo *base_info, GIArgument *arg, Local<Value> value) {
     GIInfoType type = g_base_info_get_type (base_info);
 
     switch (type) {
     case GI_INFO_TYPE_OBJECT:
+    case GI_INFO_TYPE_INTERFACE:
         arg->v_pointer = GObjectFromWrapper (value);
         break;
     case GI_INFO_TYPE_BOXED:
     case GI_INFO_TYPE_STRUCT:
-        arg->v_pointer = BoxedFromWrapper (value);
+    case GI_INFO_TYPE_UNION:
+        arg->v_pointer = BoxedFromValue (isolate, base_info, value);
         break;
     case GI_INFO_TYPE_FLAGS:
     case GI_INFO_TYPE_ENUM:
@@ -147,7 +727,7 @@ void V8ToGIArgument(Isolate *isolate, GITypeInfo *type_info, GIArgument *arg, Lo
 
     switch (type_tag) {
     case GI_TYPE_TAG_VOID:
-        arg->v_pointer = NULL;
+        arg->v_pointer = value->IsExternal () ? External::Cast (*value)->Value () : NULL;
         break;
     case GI_TYPE_TAG_BOOLEAN:
         arg->v_boolean = value->BooleanValue ();
@@ -199,9 +779,17 @@ void V8ToGIArgument(Isolate *isolate, GITypeInfo *type_info, GIArgument *arg, Lo
 
     case GI_TYPE_TAG_ARRAY:
         {
+            if (V8TypedArrayToGIArgument (type_info, arg, value, length_p))
+                break;
+
             GIArrayType array_type = g_type_info_get_array_type (type_info);
             GArray *garray = V8ToGArray (isolate, type_info, value);
 
+            if (garray == NULL) {
+                arg->v_pointer = NULL;
+                break;
+            }
+
             if (length_p)
                 *length_p = garray->len;
 
@@ -212,6 +800,21 @@ void V8ToGIArgument(Isolate *isolate, GITypeInfo *type_info, GIArgument *arg, Lo
             case GI_ARRAY_TYPE_ARRAY:
                 arg->v_pointer = garray;
                 break;
+            case GI_ARRAY_TYPE_PTR_ARRAY:
+                {
+                    GPtrArray *ptr_array = g_ptr_array_sized_new (garray->len);
+                    for (guint i = 0; i < garray->len; i++)
+                        g_ptr_array_add (ptr_array, g_array_index (garray, gpointer, i));
+                    g_array_free (garray, TRUE);
+                    arg->v_pointer = ptr_array;
+                }
+                break;
+            case GI_ARRAY_TYPE_BYTE_ARRAY:
+                {
+                    guint len = garray->len;
+                    arg->v_pointer = g_byte_array_new_take ((guint8 *) g_array_free (garray, FALSE), len);
+                }
+                break;
             default:
                 g_assert_not_reached ();
             }
@@ -234,14 +837,43 @@ void FreeGIArgument(GITypeInfo *type_info, GIArgument *arg) {
 
     case GI_TYPE_TAG_ARRAY:
         {
+            if (arg->v_pointer == NULL)
+                break;
+
             GIArrayType array_type = g_type_info_get_array_type (type_info);
+            GITypeInfo *elem_info = g_type_info_get_param_type (type_info, 0);
+            GITypeTag elem_tag = g_type_info_get_tag (elem_info);
+            g_base_info_unref (elem_info);
+
+            /* Strings are the only elements we allocate while marshaling. */
+            bool free_elements = (elem_tag == GI_TYPE_TAG_UTF8 || elem_tag == GI_TYPE_TAG_FILENAME);
 
             switch (array_type) {
             case GI_ARRAY_TYPE_C:
-                g_free (arg->v_pointer);
+                if (free_elements)
+                    g_strfreev ((char **) arg->v_pointer);
+                else
+                    g_free (arg->v_pointer);
                 break;
             case GI_ARRAY_TYPE_ARRAY:
-                g_array_free ((GArray *) arg->v_pointer, TRUE);
+                {
+                    GArray *garray = (GArray *) arg->v_pointer;
+                    if (free_elements)
+                        for (guint i = 0; i < garray->len; i++)
+                            g_free (g_array_index (garray, char *, i));
+                    g_array_free (garray, TRUE);
+                }
+                break;
+            case GI_ARRAY_TYPE_PTR_ARRAY:
+                {
+                    GPtrArray *ptr_array = (GPtrArray *) arg->v_pointer;
+                    if (free_elements)
+                        g_ptr_array_foreach (ptr_array, (GFunc) g_free, NULL);
+                    g_ptr_array_unref (ptr_array);
+                }
+                break;
+            case GI_ARRAY_TYPE_BYTE_ARRAY:
+                g_byte_array_unref ((GByteArray *) arg->v_pointer);
                 break;
             default:
                 g_assert_not_reached ();
@@ -253,53 +885,325 @@ void FreeGIArgument(GITypeInfo *type_info, GIArgument *arg) {
     }
 }
 
-void V8ToGValue(GValue *gvalue, Local<Value> value) {
-    if (G_VALUE_HOLDS_BOOLEAN (gvalue)) {
-        g_value_set_boolean (gvalue, value->BooleanValue ());
-    } else if (G_VALUE_HOLDS_INT (gvalue)) {
-        g_value_set_int (gvalue, value->Int32Value ());
-    } else if (G_VALUE_HOLDS_UINT (gvalue)) {
-        g_value_set_uint (gvalue, value->Uint32Value ());
-    } else if (G_VALUE_HOLDS_FLOAT (gvalue)) {
-        g_value_set_float (gvalue, value->NumberValue ());
-    } else if (G_VALUE_HOLDS_DOUBLE (gvalue)) {
-        g_value_set_double (gvalue, value->NumberValue ());
-    } else if (G_VALUE_HOLDS_STRING (gvalue)) {
-        String::Utf8Value str (value);
-        const char *data = *str;
-        g_value_set_string (gvalue, data);
-    } else if (G_VALUE_HOLDS_ENUM (gvalue)) {
-        g_value_set_enum (gvalue, value->Int32Value ());
-    } else if (G_VALUE_HOLDS_OBJECT (gvalue)) {
+/* GValue converters, one per fundamental type. Callers that convert the
+ * same type over and over look the converter up once and keep it. */
+
+static void BooleanFromV8(GValue *gvalue, Local<Value> value) {
+    g_value_set_boolean (gvalue, value->BooleanValue ());
+}
+
+static void CharFromV8(GValue *gvalue, Local<Value> value) {
+    g_value_set_schar (gvalue, value->Int32Value ());
+}
+
+static void UCharFromV8(GValue *gvalue, Local<Value> value) {
+    g_value_set_uchar (gvalue, value->Uint32Value ());
+}
+
+static void IntFromV8(GValue *gvalue, Local<Value> value) {
+    g_value_set_int (gvalue, value->Int32Value ());
+}
+
+static void UIntFromV8(GValue *gvalue, Local<Value> value) {
+    g_value_set_uint (gvalue, value->Uint32Value ());
+}
+
+static void LongFromV8(GValue *gvalue, Local<Value> value) {
+    g_value_set_long (gvalue, value->NumberValue ());
+}
+
+static void ULongFromV8(GValue *gvalue, Local<Value> value) {
+    g_value_set_ulong (gvalue, value->NumberValue ());
+}
+
+static void Int64FromV8(GValue *gvalue, Local<Value> value) {
+    g_value_set_int64 (gvalue, value->NumberValue ());
+}
+
+static void UInt64FromV8(GValue *gvalue, Local<Value> value) {
+    g_value_set_uint64 (gvalue, value->NumberValue ());
+}
+
+static void FloatFromV8(GValue *gvalue, Local<Value> value) {
+    g_value_set_float (gvalue, value->NumberValue ());
+}
+
+static void DoubleFromV8(GValue *gvalue, Local<Value> value) {
+    g_value_set_double (gvalue, value->NumberValue ());
+}
+
+static void StringFromV8(GValue *gvalue, Local<Value> value) {
+    if (value->IsNull ()) {
+        g_value_set_string (gvalue, NULL);
+        return;
+    }
+
+    String::Utf8Value str (value);
+    const char *data = *str;
+    g_value_set_string (gvalue, data);
+}
+
+static void EnumFromV8(GValue *gvalue, Local<Value> value) {
+    g_value_set_enum (gvalue, value->Int32Value ());
+}
+
+static void FlagsFromV8(GValue *gvalue, Local<Value> value) {
+    g_value_set_flags (gvalue, value->Uint32Value ());
+}
+
+static void ObjectFromV8(GValue *gvalue, Local<Value> value) {
+    if (value->IsNull ())
+        g_value_set_object (gvalue, NULL);
+    else
         g_value_set_object (gvalue, GObjectFromWrapper (value));
-    } else {
-        g_assert_not_reached ();
+}
+
+static void BoxedFromV8(GValue *gvalue, Local<Value> value) {
+    if (value->IsNull ())
+        g_value_set_boxed (gvalue, NULL);
+    else
+        g_value_set_boxed (gvalue, BoxedFromWrapper (value));
+}
+
+static void PointerFromV8(GValue *gvalue, Local<Value> value) {
+    if (value->IsExternal ())
+        g_value_set_pointer (gvalue, External::Cast (*value)->Value ());
+    else
+        g_value_set_pointer (gvalue, NULL);
+}
+
+static void UnsupportedFromV8(GValue *gvalue, Local<Value> value) {
+    Isolate *isolate = Isolate::GetCurrent ();
+    char *message = g_strdup_printf ("Unsupported GValue type %s.", G_VALUE_TYPE_NAME (gvalue));
+    isolate->ThrowException (Exception::TypeError (String::NewFromUtf8 (isolate, message)));
+    g_free (message);
+}
+
+static Local<Value> BooleanToV8(Isolate *isolate, const GValue *gvalue) {
+    if (g_value_get_boolean (gvalue))
+        return True (isolate);
+    else
+        return False (isolate);
+}
+
+static Local<Value> CharToV8(Isolate *isolate, const GValue *gvalue) {
+    return Integer::New (isolate, g_value_get_schar (gvalue));
+}
+
+static Local<Value> UCharToV8(Isolate *isolate, const GValue *gvalue) {
+    return Integer::NewFromUnsigned (isolate, g_value_get_uchar (gvalue));
+}
+
+static Local<Value> IntToV8(Isolate *isolate, const GValue *gvalue) {
+    return Integer::New (isolate, g_value_get_int (gvalue));
+}
+
+static Local<Value> UIntToV8(Isolate *isolate, const GValue *gvalue) {
+    return Integer::NewFromUnsigned (isolate, g_value_get_uint (gvalue));
+}
+
+static Local<Value> LongToV8(Isolate *isolate, const GValue *gvalue) {
+    return Number::New (isolate, g_value_get_long (gvalue));
+}
+
+static Local<Value> ULongToV8(Isolate *isolate, const GValue *gvalue) {
+    return Number::New (isolate, g_value_get_ulong (gvalue));
+}
+
+static Local<Value> Int64ToV8(Isolate *isolate, const GValue *gvalue) {
+    return Number::New (isolate, g_value_get_int64 (gvalue));
+}
+
+static Local<Value> UInt64ToV8(Isolate *isolate, const GValue *gvalue) {
+    return Number::New (isolate, g_value_get_uint64 (gvalue));
+}
+
+static Local<Value> FloatToV8(Isolate *isolate, const GValue *gvalue) {
+    return Number::New (isolate, g_value_get_float (gvalue));
+}
+
+static Local<Value> DoubleToV8(Isolate *isolate, const GValue *gvalue) {
+    return Number::New (isolate, g_value_get_double (gvalue));
+}
+
+static Local<Value> StringToV8(Isolate *isolate, const GValue *gvalue) {
+    const char *str = g_value_get_string (gvalue);
+    if (str)
+        return String::NewFromUtf8 (isolate, str);
+    else
+        return Null (isolate);
+}
+
+static Local<Value> EnumToV8(Isolate *isolate, const GValue *gvalue) {
+    return Integer::New (isolate, g_value_get_enum (gvalue));
+}
+
+static Local<Value> FlagsToV8(Isolate *isolate, const GValue *gvalue) {
+    return Integer::NewFromUnsigned (isolate, g_value_get_flags (gvalue));
+}
+
+static Local<Value> ObjectToV8(Isolate *isolate, const GValue *gvalue) {
+    GObject *gobject = (GObject *) g_value_get_object (gvalue);
+    if (gobject)
+        return WrapperFromGObject (isolate, gobject);
+    else
+        return Null (isolate);
+}
+
+Local<Value> BoxedGValueToV8(Isolate *isolate, const GValue *gvalue, GIBaseInfo *info) {
+    void *boxed = g_value_get_boxed (gvalue);
+    if (boxed == NULL)
+        return Null (isolate);
+
+    return WrapperFromBoxed (isolate, info, boxed, GI_TRANSFER_NOTHING);
+}
+
+static Local<Value> BoxedToV8(Isolate *isolate, const GValue *gvalue) {
+    void *boxed = g_value_get_boxed (gvalue);
+    if (boxed == NULL)
+        return Null (isolate);
+
+    GType gtype = G_VALUE_TYPE (gvalue);
+    if (gtype == G_TYPE_BYTES)
+        return GBytesToV8 (isolate, (GBytes *) boxed, GI_TRANSFER_NOTHING);
+
+    GIBaseInfo *info = g_irepository_find_by_gtype (g_irepository_get_default (), gtype);
+    if (info == NULL) {
+        char *message = g_strdup_printf ("No introspection data for boxed type %s.", g_type_name (gtype));
+        isolate->ThrowException (Exception::TypeError (String::NewFromUtf8 (isolate, message)));
+        g_free (message);
+        return Undefined (isolate);
     }
+
+    Local<Value> wrapper = BoxedGValueToV8 (isolate, gvalue, info);
+    g_base_info_unref (info);
+    return wrapper;
 }
 
-Local<Value> GValueToV8(Isolate *isolate, const GValue *gvalue) {
-    if (G_VALUE_HOLDS_BOOLEAN (gvalue)) {
-        if (g_value_get_boolean (gvalue))
-            return True (isolate);
-        else
-            return False (isolate);
-    } else if (G_VALUE_HOLDS_INT (gvalue)) {
-        return Integer::New (isolate, g_value_get_int (gvalue));
-    } else if (G_VALUE_HOLDS_UINT (gvalue)) {
-        return Integer::NewFromUnsigned (isolate, g_value_get_uint (gvalue));
-    } else if (G_VALUE_HOLDS_FLOAT (gvalue)) {
-        return Number::New (isolate, g_value_get_float (gvalue));
-    } else if (G_VALUE_HOLDS_DOUBLE (gvalue)) {
-        return Number::New (isolate, g_value_get_double (gvalue));
-    } else if (G_VALUE_HOLDS_STRING (gvalue)) {
-        return String::NewFromUtf8 (isolate, g_value_get_string (gvalue));
-    } else if (G_VALUE_HOLDS_ENUM (gvalue)) {
-        return Integer::New (isolate, g_value_get_enum (gvalue));
-    } else if (G_VALUE_HOLDS_OBJECT (gvalue)) {
-        return WrapperFromGObject (isolate, G_OBJECT (g_value_get_object (gvalue)));
-    } else {
-        g_assert_not_reached ();
+static Local<Value> PointerToV8(Isolate *isolate, const GValue *gvalue) {
+    void *pointer = g_value_get_pointer (gvalue);
+    if (pointer)
+        return External::New (isolate, pointer);
+    else
+        return Null (isolate);
+}
+
+/* Param specs (as passed to notify handlers) show up as their name. */
+static Local<Value> ParamToV8(Isolate *isolate, const GValue *gvalue) {
+    GParamSpec *pspec = g_value_get_param (gvalue);
+    if (pspec)
+        return String::NewFromUtf8 (isolate, pspec->name);
+    else
+        return Null (isolate);
+}
+
+static Local<Value> UnsupportedToV8(Isolate *isolate, const GValue *gvalue) {
+    char *message = g_strdup_printf ("Unsupported GValue type %s.", G_VALUE_TYPE_NAME (gvalue));
+    isolate->ThrowException (Exception::TypeError (String::NewFromUtf8 (isolate, message)));
+    g_free (message);
+    return Undefined (isolate);
+}
+
+V8ToGValueFunc GetV8ToGValueFunc(GType gtype) {
+    switch (G_TYPE_FUNDAMENTAL (gtype)) {
+    case G_TYPE_BOOLEAN:
+        return BooleanFromV8;
+    case G_TYPE_CHAR:
+        return CharFromV8;
+    case G_TYPE_UCHAR:
+        return UCharFromV8;
+    case G_TYPE_INT:
+        return IntFromV8;
+    case G_TYPE_UINT:
+        return UIntFromV8;
+    case G_TYPE_LONG:
+        return LongFromV8;
+    case G_TYPE_ULONG:
+        return ULongFromV8;
+    case G_TYPE_INT64:
+        return Int64FromV8;
+    case G_TYPE_UINT64:
+        return UInt64FromV8;
+    case G_TYPE_FLOAT:
+        return FloatFromV8;
+    case G_TYPE_DOUBLE:
+        return DoubleFromV8;
+    case G_TYPE_STRING:
+        return StringFromV8;
+    case G_TYPE_ENUM:
+        return EnumFromV8;
+    case G_TYPE_FLAGS:
+        return FlagsFromV8;
+    case G_TYPE_BOXED:
+        return BoxedFromV8;
+    case G_TYPE_POINTER:
+        return PointerFromV8;
+    case G_TYPE_OBJECT:
+    case G_TYPE_INTERFACE:
+        if (g_type_is_a (gtype, G_TYPE_OBJECT))
+            return ObjectFromV8;
+        break;
+    default:
+        break;
     }
+
+    return UnsupportedFromV8;
+}
+
+GValueToV8Func GetGValueToV8Func(GType gtype) {
+    switch (G_TYPE_FUNDAMENTAL (gtype)) {
+    case G_TYPE_BOOLEAN:
+        return BooleanToV8;
+    case G_TYPE_CHAR:
+        return CharToV8;
+    case G_TYPE_UCHAR:
+        return UCharToV8;
+    case G_TYPE_INT:
+        return IntToV8;
+    case G_TYPE_UINT:
+        return UIntToV8;
+    case G_TYPE_LONG:
+        return LongToV8;
+    case G_TYPE_ULONG:
+        return ULongToV8;
+    case G_TYPE_INT64:
+        return Int64ToV8;
+    case G_TYPE_UINT64:
+        return UInt64ToV8;
+    case G_TYPE_FLOAT:
+        return FloatToV8;
+    case G_TYPE_DOUBLE:
+        return DoubleToV8;
+    case G_TYPE_STRING:
+        return StringToV8;
+    case G_TYPE_ENUM:
+        return EnumToV8;
+    case G_TYPE_FLAGS:
+        return FlagsToV8;
+    case G_TYPE_BOXED:
+        return BoxedToV8;
+    case G_TYPE_POINTER:
+        return PointerToV8;
+    case G_TYPE_PARAM:
+        return ParamToV8;
+    case G_TYPE_OBJECT:
+    case G_TYPE_INTERFACE:
+        if (g_type_is_a (gtype, G_TYPE_OBJECT))
+            return ObjectToV8;
+        break;
+    default:
+        break;
+    }
+
+    return UnsupportedToV8;
+}
+
+void V8ToGValue(GValue *gvalue, Local<Value> value) {
+    GetV8ToGValueFunc (G_VALUE_TYPE (gvalue)) (gvalue, value);
+}
+
+Local<Value> GValueToV8(Isolate *isolate, const GValue *gvalue) {
+    return GetGValueToV8Func (G_VALUE_TYPE (gvalue)) (isolate, gvalue);
 }
 
 };
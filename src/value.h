@@ -6,13 +6,42 @@
 
 namespace GNodeJS {
 
-v8::Local<v8::Value> GIArgumentToV8(v8::Isolate *isolate, GITypeInfo *type_info, GIArgument *argument);
+/* With GI_TRANSFER_EVERYTHING, ownership of the argument passes to the
+ * returned value. `length` is the element count of C arrays whose length
+ * lives in another argument. */
+v8::Local<v8::Value> GIArgumentToV8(v8::Isolate *isolate, GITypeInfo *type_info, GIArgument *argument,
+                                    long length = -1, GITransfer transfer = GI_TRANSFER_NOTHING);
 void V8ToGIArgument(v8::Isolate *isolate, GIBaseInfo *base_info, GIArgument *arg, v8::Local<v8::Value> value);
 void V8ToGIArgument(v8::Isolate *isolate, GITypeInfo *type_info, GIArgument *argument, v8::Local<v8::Value> value,
                     bool may_be_null, size_t *length_p = NULL);
 void FreeGIArgument(GITypeInfo *type_info, GIArgument *argument);
 
+/* Marshals a typed array (or any view, for byte arrays) whose element
+ * type matches the array's. Returns false if the value doesn't fit. When
+ * borrowed_p is given, C arrays may point straight into the view's
+ * memory, in which case *borrowed_p is set and the argument must not be
+ * freed. */
+bool V8TypedArrayToGIArgument(GITypeInfo *type_info, GIArgument *argument, v8::Local<v8::Value> value,
+                              size_t *length_p = NULL, bool *borrowed_p = NULL);
+
+/* Wraps memory in an ArrayBuffer without copying it. free_func is
+ * called on owner once the buffer has been collected. */
+v8::Local<v8::ArrayBuffer> MakeExternalArrayBuffer(v8::Isolate *isolate, void *data, size_t length,
+                                                   GDestroyNotify free_func, gpointer owner);
+
 void V8ToGValue(GValue *gvalue, v8::Local<v8::Value> value);
 v8::Local<v8::Value> GValueToV8(v8::Isolate *isolate, const GValue *gvalue);
 
+typedef void (*V8ToGValueFunc)(GValue *gvalue, v8::Local<v8::Value> value);
+typedef v8::Local<v8::Value> (*GValueToV8Func)(v8::Isolate *isolate, const GValue *gvalue);
+
+/* Picks the converter for GValues of the given type, so that hot paths
+ * can resolve it once instead of probing the type on every conversion. */
+V8ToGValueFunc GetV8ToGValueFunc(GType gtype);
+GValueToV8Func GetGValueToV8Func(GType gtype);
+
+/* The boxed converter, for callers that already hold the introspection
+ * data of the GValue's type. */
+v8::Local<v8::Value> BoxedGValueToV8(v8::Isolate *isolate, const GValue *gvalue, GIBaseInfo *info);
+
 };